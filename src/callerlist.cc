@@ -37,10 +37,28 @@ ep_desc_t::ep_desc_t()
   version = "";
 }
 
-endpoint_list_t::endpoint_list_t() : runthread(true)
+endpoint_snapshot_t::endpoint_snapshot_t()
 {
   endpoints.resize(MAX_STAGE_ID);
-  statusthread = std::thread(&endpoint_list_t::checkstatus, this);
+  memset(srv_pubkey, 0, sizeof(srv_pubkey));
+}
+
+endpoint_snapshot_ptr_t::endpoint_snapshot_ptr_t(endpoint_snapshot_t* snapshot_)
+    : snapshot(snapshot_)
+{
+}
+
+endpoint_snapshot_ptr_t::~endpoint_snapshot_ptr_t()
+{
+  --snapshot->readers;
+}
+
+endpoint_list_t::endpoint_list_t(bool use_statusthread)
+    : statlogcnt(60000 / pingperiodms), runthread(true)
+{
+  endpoints.resize(MAX_STAGE_ID);
+  if(use_statusthread)
+    statusthread = std::thread(&endpoint_list_t::checkstatus, this);
 }
 
 endpoint_list_t::~endpoint_list_t()
@@ -50,71 +68,149 @@ endpoint_list_t::~endpoint_list_t()
     statusthread.join();
 }
 
+endpoint_snapshot_ptr_t endpoint_list_t::get_snapshot()
+{
+  while(true) {
+    size_t idx(current_snapshot);
+    ++snapshots[idx].readers;
+    // if a new snapshot was published in the meantime, then the
+    // slot might be overwritten, so try again:
+    if(idx == current_snapshot)
+      return endpoint_snapshot_ptr_t(&(snapshots[idx]));
+    --snapshots[idx].readers;
+  }
+}
+
+void endpoint_list_t::publish_endpoints()
+{
+  size_t cur(current_snapshot);
+  size_t idx((cur + 1) % ENDPOINT_SNAPSHOTS);
+  // find a snapshot which is not in use:
+  while(snapshots[idx].readers) {
+    idx = (idx + 1) % ENDPOINT_SNAPSHOTS;
+    if(idx == cur) {
+      idx = (idx + 1) % ENDPOINT_SNAPSHOTS;
+      std::this_thread::yield();
+    }
+  }
+  endpoint_snapshot_t& snap(snapshots[idx]);
+  snap.endpoints = endpoints;
+  snap.srv_has_pubkey = srv_has_pubkey;
+  memcpy(snap.srv_pubkey, srv_pubkey, sizeof(srv_pubkey));
+  snap.version = ++snapshot_version;
+  current_snapshot = idx;
+}
+
 void endpoint_list_t::cid_register(stage_device_id_t cid, char* data,
                                    epmode_t mode, const std::string& rver)
 {
   if(cid < MAX_STAGE_ID) {
-    if(mstat.try_lock()) {
-      size_t scid = (size_t)cid;
-      memcpy(&(endpoints[scid].ep), data, sizeof(endpoint_t));
-      if(mode != endpoints[cid].mode)
-        endpoints[scid].announced = false;
-      endpoints[scid].mode = mode;
-      endpoints[scid].timeout = CALLERLIST_TIMEOUT;
-      endpoints[scid].version = rver;
-      mstat.unlock();
-    }
+    std::lock_guard<std::mutex> lk(mstat);
+    ep_desc_t& ep(endpoints[cid]);
+    bool changed((ep.timeout == 0) || (ep.mode != mode) ||
+                 (ep.version != rver) ||
+                 (memcmp(&(ep.ep), data, sizeof(endpoint_t)) != 0));
+    memcpy(&(ep.ep), data, sizeof(endpoint_t));
+    if(mode != ep.mode)
+      ep.announced = false;
+    ep.mode = mode;
+    ep.timeout = CALLERLIST_TIMEOUT;
+    ep.version = rver;
+    if(changed)
+      publish_endpoints();
   }
 }
 
 void endpoint_list_t::cid_setlocalip(stage_device_id_t cid, char* data)
 {
   if(cid < MAX_STAGE_ID) {
-    memcpy(&(endpoints[cid].localep), data, sizeof(endpoint_t));
+    endpoint_t localep;
+    memcpy(&localep, data, sizeof(endpoint_t));
     // workaround for invalidly packed sockaddr structures when
     // receiving from some systems:
-    endpoints[cid].localep.sin_family = AF_INET;
+    localep.sin_family = AF_INET;
+    std::lock_guard<std::mutex> lk(mstat);
+    if(memcmp(&(endpoints[cid].localep), &localep, sizeof(endpoint_t)) != 0) {
+      endpoints[cid].localep = localep;
+      publish_endpoints();
+    }
   }
 }
 
+void endpoint_list_t::cid_set_caps(stage_device_id_t cid, epcaps_t caps)
+{
+  if(cid >= MAX_STAGE_ID)
+    return;
+  {
+    std::lock_guard<std::mutex> lk(mstat);
+    ep_desc_t& ep(endpoints[cid]);
+    if(ep.caps_known && (ep.caps == caps))
+      return;
+    ep.caps = caps;
+    ep.caps_known = true;
+    publish_endpoints();
+  }
+  announce_caps(cid, caps);
+}
+
 void endpoint_list_t::cid_setpingtime(stage_device_id_t cid, double pingtime)
 {
   if(cid < MAX_STAGE_ID) {
+    std::lock_guard<std::mutex> lk(mstat);
+    bool reactivated(endpoints[cid].timeout == 0);
     endpoints[cid].timeout = CALLERLIST_TIMEOUT;
+    if(reactivated)
+      publish_endpoints();
     if(pingtime > 0) {
-      if(mstat.try_lock()) {
-        ++endpoints[cid].pingt_n;
-        endpoints[cid].pingt_sum += pingtime;
-        endpoints[cid].pingt_max = std::max(pingtime, endpoints[cid].pingt_max);
-        endpoints[cid].pingt_min = std::min(pingtime, endpoints[cid].pingt_min);
-        mstat.unlock();
-      }
+      ++endpoints[cid].pingt_n;
+      endpoints[cid].pingt_sum += pingtime;
+      endpoints[cid].pingt_max = std::max(pingtime, endpoints[cid].pingt_max);
+      endpoints[cid].pingt_min = std::min(pingtime, endpoints[cid].pingt_min);
     }
   }
 }
 
-void endpoint_list_t::cid_set_pubkey(stage_device_id_t cid, char* data,
+bool endpoint_list_t::cid_set_pubkey(stage_device_id_t cid, char* data,
                                      size_t len)
 {
+  bool updated(false);
   if(len == crypto_box_PUBLICKEYBYTES) {
+    std::lock_guard<std::mutex> lk(mstat);
     if(cid < MAX_STAGE_ID) {
       if(memcmp(data, endpoints[cid].pubkey, len) != 0) {
         memcpy(endpoints[cid].pubkey, data, len);
         TASCAR::console_log(
             "Updated public key for " + std::to_string((int)cid) + ": \"" +
             bin2base64((uint8_t*)data, crypto_box_PUBLICKEYBYTES) + "\".");
+        updated = true;
       }
+      updated |= !endpoints[cid].has_pubkey;
       endpoints[cid].has_pubkey = true;
+      if(updated)
+        publish_endpoints();
     } else if(cid == STAGE_ID_SERVER) {
-      if(memcmp(data, srv_pubkey, len) != 0) {
+      if((memcmp(data, srv_pubkey, len) != 0) || (!srv_has_pubkey)) {
         memcpy(srv_pubkey, data, len);
         TASCAR::console_log(
             "Updated public key of server: \"" +
             bin2base64((uint8_t*)data, crypto_box_PUBLICKEYBYTES) + "\".");
+        srv_has_pubkey = true;
+        publish_endpoints();
       }
-      srv_has_pubkey = true;
     }
   }
+  return updated;
+}
+
+void endpoint_list_t::cid_set_sessionkey(stage_device_id_t cid,
+                                         const uint8_t* key)
+{
+  if(cid < MAX_STAGE_ID) {
+    std::lock_guard<std::mutex> lk(mstat);
+    memcpy(endpoints[cid].sessionkey, key, crypto_box_BEFORENMBYTES);
+    endpoints[cid].has_sessionkey = true;
+    publish_endpoints();
+  }
 }
 
 void endpoint_list_t::set_hiresping(bool hr)
@@ -127,53 +223,65 @@ void endpoint_list_t::set_hiresping(bool hr)
 
 void endpoint_list_t::checkstatus()
 {
-  uint32_t statlogcnt(60000 / pingperiodms);
   while(runthread) {
     std::this_thread::sleep_for(std::chrono::milliseconds(pingperiodms));
-    for(stage_device_id_t ep = 0; ep != MAX_STAGE_ID; ++ep) {
-      if(endpoints[ep].timeout) {
-        // bookkeeping of connected endpoints:
-        if(!endpoints[ep].announced) {
-          announce_new_connection(ep, endpoints[ep]);
-          endpoints[ep].announced = true;
-        }
-        --endpoints[ep].timeout;
-      } else {
-        // bookkeeping of disconnected endpoints:
-        if(endpoints[ep].announced) {
-          announce_connection_lost(ep);
-          endpoints[ep] = ep_desc_t();
-        }
+    update_status();
+  }
+}
+
+void endpoint_list_t::update_status()
+{
+  std::lock_guard<std::mutex> lk(mstat);
+  bool changed(false);
+  for(stage_device_id_t ep = 0; ep != MAX_STAGE_ID; ++ep) {
+    if(endpoints[ep].timeout) {
+      // bookkeeping of connected endpoints:
+      if(!endpoints[ep].announced) {
+        announce_new_connection(ep, endpoints[ep]);
+        endpoints[ep].announced = true;
+        changed = true;
+      }
+      --endpoints[ep].timeout;
+      if(!endpoints[ep].timeout)
+        changed = true;
+    } else {
+      // bookkeeping of disconnected endpoints:
+      if(endpoints[ep].announced) {
+        announce_connection_lost(ep);
+        endpoints[ep] = ep_desc_t();
+        changed = true;
       }
     }
-    if(!statlogcnt) {
-      // logging of ping statistics:
-      statlogcnt = 60000 / pingperiodms;
-      std::lock_guard<std::mutex> lk(mstat);
-      for(stage_device_id_t ep = 0; ep != MAX_STAGE_ID; ++ep) {
-        if(endpoints[ep].timeout) {
-          announce_latency(ep, endpoints[ep].pingt_min,
-                           endpoints[ep].pingt_sum /
-                               std::max(1u, endpoints[ep].pingt_n),
-                           endpoints[ep].pingt_max, endpoints[ep].num_received,
-                           endpoints[ep].num_lost);
-          endpoints[ep].pingt_n = 0;
-          endpoints[ep].pingt_min = 1000;
-          endpoints[ep].pingt_max = 0;
-          endpoints[ep].pingt_sum = 0.0;
-          endpoints[ep].num_received = 0;
-          endpoints[ep].num_lost = 0;
-        }
+  }
+  if(changed)
+    publish_endpoints();
+  if(!statlogcnt) {
+    // logging of ping statistics:
+    statlogcnt = 60000 / pingperiodms;
+    for(stage_device_id_t ep = 0; ep != MAX_STAGE_ID; ++ep) {
+      if(endpoints[ep].timeout) {
+        announce_latency(ep, endpoints[ep].pingt_min,
+                         endpoints[ep].pingt_sum /
+                             std::max(1u, endpoints[ep].pingt_n),
+                         endpoints[ep].pingt_max, endpoints[ep].num_received,
+                         endpoints[ep].num_lost);
+        endpoints[ep].pingt_n = 0;
+        endpoints[ep].pingt_min = 1000;
+        endpoints[ep].pingt_max = 0;
+        endpoints[ep].pingt_sum = 0.0;
+        endpoints[ep].num_received = 0;
+        endpoints[ep].num_lost = 0;
       }
     }
-    --statlogcnt;
   }
+  --statlogcnt;
 }
 
 uint32_t endpoint_list_t::get_num_clients()
 {
+  auto snap(get_snapshot());
   uint32_t c(0);
-  for(const auto& ep : endpoints)
+  for(const auto& ep : snap->endpoints)
     c += (ep.timeout > 0);
   return c;
 }
@@ -25,6 +25,8 @@
 
 // timeout of caller actvity, in ping periods:
 #define CALLERLIST_TIMEOUT 120
+// number of endpoint table snapshots which can be in use at the same time:
+#define ENDPOINT_SNAPSHOTS 4
 
 class ep_desc_t {
 public:
@@ -34,6 +36,8 @@ public:
   uint32_t timeout = 0;
   bool announced = false;
   epmode_t mode = B_PEER2PEER; // endpoint operation mode
+  epcaps_t caps = 0;           // features, see cid_set_caps()
+  bool caps_known = false;     // a ping with features was received
   double pingt_min = 10000.0;
   double pingt_max = 0.0;
   double pingt_sum = 0.0;
@@ -43,20 +47,78 @@ public:
   std::string version;
   bool has_pubkey = false;
   uint8_t pubkey[crypto_box_PUBLICKEYBYTES];
+  bool has_sessionkey = false;
+  // pre-computed shared key, see encryptmsg_sessionkey():
+  uint8_t sessionkey[crypto_box_BEFORENMBYTES];
   uint64_t padding = 0;
 };
 
+/**
+ * Immutable copy of the endpoint table.
+ *
+ * Snapshots are published by the control path of endpoint_list_t
+ * whenever the table changes, and are read without locks by the
+ * sending and receiving threads, see endpoint_list_t::get_snapshot().
+ * A reader retries only if a new snapshot was published while it
+ * acquired the current one, so reading is lock-free but not
+ * wait-free. In a snapshot, the timeout member of an endpoint is only
+ * meaningful as an activity flag.
+ */
+class endpoint_snapshot_t {
+public:
+  endpoint_snapshot_t();
+  /// Version number, incremented with each publication
+  uint64_t version = 0;
+  /// Copy of the endpoint table, with MAX_STAGE_ID entries
+  std::vector<ep_desc_t> endpoints;
+  bool srv_has_pubkey = false;
+  uint8_t srv_pubkey[crypto_box_PUBLICKEYBYTES];
+  /// Number of threads currently reading this snapshot
+  std::atomic_uint32_t readers{0};
+};
+
+/**
+ * Read access to an endpoint table snapshot.
+ *
+ * The snapshot remains valid and unchanged until this object is
+ * destroyed, so it should be held only for a short time, e.g., for
+ * processing one packet.
+ */
+class endpoint_snapshot_ptr_t {
+public:
+  explicit endpoint_snapshot_ptr_t(endpoint_snapshot_t* snapshot);
+  endpoint_snapshot_ptr_t(const endpoint_snapshot_ptr_t&) = delete;
+  ~endpoint_snapshot_ptr_t();
+  const endpoint_snapshot_t* operator->() const { return snapshot; };
+  const endpoint_snapshot_t& operator*() const { return *snapshot; };
+
+private:
+  endpoint_snapshot_t* snapshot;
+};
+
 class endpoint_list_t {
 public:
-  endpoint_list_t();
+  /**
+   * @param use_statusthread Start a thread which calls
+   * update_status() once per ping period. Otherwise, the owner has
+   * to call update_status().
+   */
+  endpoint_list_t(bool use_statusthread = true);
   ~endpoint_list_t();
   void add_endpoint(const endpoint_t& ep);
   void set_hiresping(bool hr);
+  /**
+   * Return the current snapshot of the endpoint table.
+   *
+   * This call does not block, and can be used from real-time threads.
+   */
+  endpoint_snapshot_ptr_t get_snapshot();
 
 protected:
   virtual void announce_new_connection(stage_device_id_t cid,
                                        const ep_desc_t& ep){};
   virtual void announce_connection_lost(stage_device_id_t cid){};
+  virtual void announce_caps(stage_device_id_t cid, epcaps_t caps){};
   virtual void announce_latency(stage_device_id_t cid, double lmin,
                                 double lmean, double lmax, uint32_t received,
                                 uint32_t lost){};
@@ -64,8 +126,36 @@ protected:
   void cid_register(stage_device_id_t cid, char* data, epmode_t mode,
                     const std::string& rver);
   void cid_setlocalip(stage_device_id_t cid, char* data);
-  void cid_set_pubkey(stage_device_id_t cid, char* data, size_t len);
+  /**
+   * Store the features of a device, received with a ping.
+   *
+   * announce_caps() is called after the first ping of a device, and
+   * whenever its features change.
+   */
+  void cid_set_caps(stage_device_id_t cid, epcaps_t caps);
+  /**
+   * Store public key of a device or of the server.
+   *
+   * @return True if the key of a device was new or has changed.
+   */
+  bool cid_set_pubkey(stage_device_id_t cid, char* data, size_t len);
+  /**
+   * Store pre-computed session key of a device.
+   *
+   * @param cid Device ID
+   * @param key Session key, crypto_box_BEFORENMBYTES bytes
+   */
+  void cid_set_sessionkey(stage_device_id_t cid, const uint8_t* key);
   uint32_t get_num_clients();
+  /**
+   * Update connection state and statistics after one ping period.
+   */
+  void update_status();
+  /**
+   * Endpoint table, owned by the control path. Modifications require
+   * a lock of mstat and a call of publish_endpoints(). Sending and
+   * receiving threads should use get_snapshot() instead.
+   */
   std::vector<ep_desc_t> endpoints;
   // ping period time in milliseconds:
   int pingperiodms = 2000;
@@ -73,10 +163,19 @@ protected:
   uint8_t srv_pubkey[crypto_box_PUBLICKEYBYTES];
 
 private:
+  /**
+   * Publish a copy of the endpoint table as new snapshot. Requires a
+   * lock of mstat.
+   */
+  void publish_endpoints();
   void checkstatus();
+  uint32_t statlogcnt;
   bool runthread;
   std::thread statusthread;
   std::mutex mstat;
+  endpoint_snapshot_t snapshots[ENDPOINT_SNAPSHOTS];
+  std::atomic_size_t current_snapshot{0};
+  uint64_t snapshot_version = 0;
 };
 
 #endif
@@ -69,10 +69,12 @@ size_t packmsg(char* destbuf, size_t maxlen, secret_t secret,
 {
   if(maxlen < HEADERLEN + msglen)
     return 0;
-  msg_secret(destbuf) = secret;
-  msg_callerid(destbuf) = callerid;
-  msg_port(destbuf) = destport;
-  msg_seq(destbuf) = seq;
+  msg_header_t hdr;
+  hdr.secret = secret;
+  hdr.callerid = callerid;
+  hdr.port = destport;
+  hdr.seq = seq;
+  hdr.store(destbuf);
   memcpy(&(destbuf[HEADERLEN]), msg, msglen);
   return HEADERLEN + msglen;
 }
@@ -86,6 +88,30 @@ size_t addmsg(char* destbuf, size_t maxlen, size_t currentlen, const char* msg,
   return currentlen + msglen;
 }
 
+size_t aggregate_add(char* destbuf, size_t maxlen, size_t currentlen,
+                     const char* msg, size_t msglen)
+{
+  if((msglen > UINT16_MAX) ||
+     (maxlen < currentlen + sizeof(uint16_t) + msglen))
+    return 0;
+  msg_store(destbuf, currentlen, (uint16_t)msglen);
+  memcpy(&(destbuf[currentlen + sizeof(uint16_t)]), msg, msglen);
+  return currentlen + sizeof(uint16_t) + msglen;
+}
+
+const char* aggregate_next(const char* msg, size_t len, size_t& pos,
+                           size_t& msglen)
+{
+  if(pos + sizeof(uint16_t) > len)
+    return NULL;
+  msglen = msg_load<uint16_t>(msg, pos);
+  if(pos + sizeof(uint16_t) + msglen > len)
+    return NULL;
+  const char* retv(&(msg[pos + sizeof(uint16_t)]));
+  pos += sizeof(uint16_t) + msglen;
+  return retv;
+}
+
 size_t encryptmsg(char* destmsg, size_t maxlen, const char* srcmsg,
                   size_t msglen, const uint8_t* pubkey)
 {
@@ -120,6 +146,63 @@ size_t decryptmsg(char* destmsg, const char* srcmsg, size_t msglen,
   return msglen - crypto_box_SEALBYTES;
 }
 
+static_assert(SESSIONKEY_OVERHEAD ==
+                  sizeof(uint64_t) + crypto_aead_chacha20poly1305_ietf_ABYTES,
+              "Invalid SESSIONKEY_OVERHEAD");
+
+static void sessionkey_nonce(uint8_t* nonce, stage_device_id_t callerid,
+                             uint64_t counter)
+{
+  // the sender ID separates the two directions which share the same key:
+  memset(nonce, 0, crypto_aead_chacha20poly1305_ietf_NPUBBYTES);
+  nonce[0] = callerid;
+  memcpy(&(nonce[crypto_aead_chacha20poly1305_ietf_NPUBBYTES -
+                 sizeof(counter)]),
+         &counter, sizeof(counter));
+}
+
+size_t encryptmsg_sessionkey(char* destmsg, size_t maxlen, const char* srcmsg,
+                             size_t msglen, const uint8_t* key,
+                             uint64_t counter)
+{
+  if((msglen < HEADERLEN) || (maxlen < msglen + SESSIONKEY_OVERHEAD))
+    return 0;
+  uint8_t nonce[crypto_aead_chacha20poly1305_ietf_NPUBBYTES];
+  sessionkey_nonce(nonce, msg_callerid(srcmsg), counter);
+  // copy the header part of the data and the nonce counter:
+  memcpy(destmsg, srcmsg, HEADERLEN);
+  memcpy(&(destmsg[HEADERLEN]), &counter, sizeof(counter));
+  // encrypt the rest of the message, authenticate header:
+  unsigned long long clen(0);
+  crypto_aead_chacha20poly1305_ietf_encrypt(
+      (uint8_t*)(&(destmsg[HEADERLEN + sizeof(counter)])), &clen,
+      (const uint8_t*)(&(srcmsg[HEADERLEN])), msglen - HEADERLEN,
+      (const uint8_t*)srcmsg, HEADERLEN, NULL, nonce, key);
+  return HEADERLEN + sizeof(counter) + (size_t)clen;
+}
+
+size_t decryptmsg_sessionkey(char* destmsg, const char* srcmsg, size_t msglen,
+                             const uint8_t* key)
+{
+  if(msglen < HEADERLEN + SESSIONKEY_OVERHEAD)
+    return 0;
+  uint64_t counter(0);
+  memcpy(&counter, &(srcmsg[HEADERLEN]), sizeof(counter));
+  uint8_t nonce[crypto_aead_chacha20poly1305_ietf_NPUBBYTES];
+  sessionkey_nonce(nonce, msg_callerid(srcmsg), counter);
+  // copy the header part of the data:
+  memcpy(destmsg, srcmsg, HEADERLEN);
+  // decrypt the rest of the message:
+  unsigned long long mlen(0);
+  if(crypto_aead_chacha20poly1305_ietf_decrypt(
+         (uint8_t*)(&(destmsg[HEADERLEN])), &mlen, NULL,
+         (const uint8_t*)(&(srcmsg[HEADERLEN + sizeof(counter)])),
+         msglen - HEADERLEN - sizeof(counter), (const uint8_t*)srcmsg,
+         HEADERLEN, nonce, key) != 0)
+    return 0;
+  return HEADERLEN + (size_t)mlen;
+}
+
 /*
  * Local Variables:
  * compile-command: "make -C .."
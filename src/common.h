@@ -29,6 +29,7 @@
  * @defgroup networkprotocol Definition of the network protocol
  */
 
+#include <cstring>
 #include <getopt.h>
 #include <iostream>
 #include <mutex>
@@ -74,6 +75,10 @@ enum {
   PORT_PING_LOCAL,
   PORT_PONG_LOCAL,
   PORT_PUBKEY,
+  /// Several packed messages in one datagram, see aggregate_add()
+  PORT_AGGREGATE,
+  /// Parity of a group of messages, see @ref fec
+  PORT_FEC,
   MAXSPECIALPORT
 };
 
@@ -132,6 +137,55 @@ typedef uint8_t epmode_t;
  * are available).
  */
 #define B_ENCRYPTION 0x20
+/**
+ * @ingroup operationmodes
+ *
+ * This device can encrypt and decrypt peer-to-peer data with a
+ * pre-computed session key (see encryptmsg_sessionkey()). Used only
+ * if both ends have B_ENCRYPTION and B_SESSIONKEY set, otherwise
+ * sealed boxes are used.
+ */
+#define B_SESSIONKEY 0x40
+/**
+ * @ingroup operationmodes
+ *
+ * This device can receive several messages aggregated into one
+ * datagram (see PORT_AGGREGATE). Aggregated messages are sent only
+ * peer-to-peer, and only to devices which have this flag set.
+ */
+#define B_AGGREGATE 0x80
+
+/**
+ * @ingroup operationmodes
+ * Bit mask of optional features of a device.
+ *
+ * All bits of epmode_t are in use, and the relay server forwards only
+ * these eight bits, so the features are announced directly to the
+ * peers, in a field after the payload of ping messages (see
+ * ovbox_udpsocket_t::send_ping()). Devices which do not send this
+ * field have no features. A feature which changes the messages sent
+ * to a peer may be used only if the peer announced it.
+ */
+typedef uint16_t epcaps_t;
+/**
+ * @ingroup operationmodes
+ * This device can receive audio streams in the format of @ref
+ * netaudio.
+ */
+#define CAP_NETAUDIO_RX 0x0001
+/**
+ * @ingroup operationmodes
+ * This device sends its audio stream in the format of @ref netaudio
+ * instead of the format of zita-njbridge.
+ */
+#define CAP_NETAUDIO_TX 0x0002
+/**
+ * @ingroup operationmodes
+ * This device can receive parity messages (see PORT_FEC). Parity
+ * messages are sent only to devices which have this flag set, since
+ * older devices treat port PORT_FEC as a data port.
+ */
+#define CAP_FEC 0x0004
 
 // the message header is a byte array with:
 // - secret
@@ -162,83 +216,143 @@ typedef uint8_t epmode_t;
 
 /**
  * @ingroup networkprotocol
- * Get session secret in a packed message
+ * Load a header field of a packed message.
+ *
+ * The fields are not aligned within the message, thus they are
+ * accessed with memcpy(), which compiles to a single load on
+ * platforms which support unaligned access, and is well-defined on
+ * all others.
+ *
+ * @param m Packed message
+ * @param pos Position of field, e.g., POS_PORT
+ * @return Value of field
+ */
+template <class T> inline T msg_load(const char* m, size_t pos)
+{
+  T v;
+  memcpy(&v, &(m[pos]), sizeof(T));
+  return v;
+}
+/**
+ * @ingroup networkprotocol
+ * Store a header field of a packed message, see msg_load().
+ *
  * @param m Packed message
- * @return Reference to session secret variable within message
+ * @param pos Position of field, e.g., POS_PORT
+ * @param v Value of field
  */
-inline secret_t& msg_secret(char* m)
+template <class T> inline void msg_store(char* m, size_t pos, T v)
 {
-  return *((secret_t*)m);
+  memcpy(&(m[pos]), &v, sizeof(T));
+}
+
+/**
+ * @ingroup networkprotocol
+ * Decoded header of a packed message.
+ *
+ * The header is decoded once when a message is received, see
+ * msgbuf_t::unpack(), and encoded once when a message is packed.
+ */
+struct msg_header_t {
+  secret_t secret = 0;
+  stage_device_id_t callerid = 0;
+  port_t port = 0;
+  sequence_t seq = 0;
+  /**
+   * Decode the header of a packed message.
+   * @param m Packed message of at least HEADERLEN bytes
+   */
+  static msg_header_t load(const char* m)
+  {
+    msg_header_t h;
+    h.secret = msg_load<secret_t>(m, 0);
+    h.callerid = msg_load<stage_device_id_t>(m, POS_CALLERID);
+    h.port = msg_load<port_t>(m, POS_PORT);
+    h.seq = msg_load<sequence_t>(m, POS_SEQ);
+    return h;
+  };
+  /**
+   * Encode the header into a packed message.
+   * @param m Packed message of at least HEADERLEN bytes
+   */
+  void store(char* m) const
+  {
+    msg_store(m, 0, secret);
+    msg_store(m, POS_CALLERID, callerid);
+    msg_store(m, POS_PORT, port);
+    msg_store(m, POS_SEQ, seq);
+  };
 };
+
+static_assert(HEADERLEN == sizeof(secret_t) + sizeof(stage_device_id_t) +
+                               sizeof(port_t) + sizeof(sequence_t),
+              "Invalid HEADERLEN");
+
 /**
  * @ingroup networkprotocol
- * Get device ID in a packed message
+ * Get session secret in a packed message
  * @param m Packed message
- * @return Reference to device ID variable within message
  */
-inline stage_device_id_t& msg_callerid(char* m)
+inline secret_t msg_secret(const char* m)
 {
-  return *((stage_device_id_t*)(&m[POS_CALLERID]));
+  return msg_load<secret_t>(m, 0);
 };
 /**
  * @ingroup networkprotocol
- * Get port number in a packed message
+ * Get device ID in a packed message
  * @param m Packed message
- * @return Reference to port number variable within message
  */
-inline port_t& msg_port(char* m)
+inline stage_device_id_t msg_callerid(const char* m)
 {
-  return *((port_t*)(&m[POS_PORT]));
+  return msg_load<stage_device_id_t>(m, POS_CALLERID);
 };
 /**
  * @ingroup networkprotocol
- * Get sequence number in a packed message
+ * Get port number in a packed message
  * @param m Packed message
- * @return Reference to sequence number variable within message
  */
-inline sequence_t& msg_seq(char* m)
+inline port_t msg_port(const char* m)
 {
-  return *((sequence_t*)(&m[POS_SEQ]));
+  return msg_load<port_t>(m, POS_PORT);
 };
 /**
  * @ingroup networkprotocol
- * Get session secret in a packed message
+ * Get sequence number in a packed message
  * @param m Packed message
- * @return Reference to session secret variable within message
  */
-inline const secret_t& msg_secret(const char* m)
+inline sequence_t msg_seq(const char* m)
 {
-  return *((secret_t*)m);
+  return msg_load<sequence_t>(m, POS_SEQ);
 };
 /**
  * @ingroup networkprotocol
- * Get device ID in a packed message
+ * Set device ID in a packed message
  * @param m Packed message
- * @return Reference to device ID variable within message
+ * @param callerid Device ID
  */
-inline const stage_device_id_t& msg_callerid(const char* m)
+inline void msg_set_callerid(char* m, stage_device_id_t callerid)
 {
-  return *((stage_device_id_t*)(&m[POS_CALLERID]));
+  msg_store(m, POS_CALLERID, callerid);
 };
 /**
  * @ingroup networkprotocol
- * Get port number in a packed message
+ * Set port number in a packed message
  * @param m Packed message
- * @return Reference to port number variable within message
+ * @param port Port number
  */
-inline const port_t& msg_port(const char* m)
+inline void msg_set_port(char* m, port_t port)
 {
-  return *((port_t*)(&m[POS_PORT]));
+  msg_store(m, POS_PORT, port);
 };
 /**
  * @ingroup networkprotocol
- * Get sequence number in a packed message
+ * Set sequence number in a packed message
  * @param m Packed message
- * @return Reference to sequence number variable within message
+ * @param seq Sequence number
  */
-inline const sequence_t& msg_seq(const char* m)
+inline void msg_set_seq(char* m, sequence_t seq)
 {
-  return *((sequence_t*)(&m[POS_SEQ]));
+  msg_store(m, POS_SEQ, seq);
 };
 
 /**
@@ -278,6 +392,41 @@ size_t packmsg(char* destbuf, size_t maxlen, secret_t secret,
 size_t addmsg(char* destbuf, size_t maxlen, size_t currentlen, const char* msg,
               size_t msglen);
 
+/**
+ * @ingroup networkprotocol
+ * Append a packed message to an aggregated message.
+ *
+ * An aggregated message is a packed message with port PORT_AGGREGATE,
+ * whose payload is a table of packed messages, each preceded by its
+ * length as a 16 bit number. The packed messages are forwarded and
+ * processed as if they were received in separate datagrams.
+ *
+ * @param[out] destbuf Start of memory area of aggregated message
+ * @param[in] maxlen Maximum length of aggregated message
+ * @param[in] currentlen Current length of aggregated message,
+ * including its header
+ * @param[in] msg Packed message
+ * @param[in] msglen Length of packed message
+ * @return New length of aggregated message, or zero if the message
+ * does not fit
+ */
+size_t aggregate_add(char* destbuf, size_t maxlen, size_t currentlen,
+                     const char* msg, size_t msglen);
+
+/**
+ * @ingroup networkprotocol
+ * Get the next packed message of an aggregated message.
+ *
+ * @param[in] msg Payload of aggregated message
+ * @param[in] len Length of payload
+ * @param[in,out] pos Position of next entry, start with zero
+ * @param[out] msglen Length of packed message
+ * @return Start of packed message, or NULL if there are no more
+ * valid entries
+ */
+const char* aggregate_next(const char* msg, size_t len, size_t& pos,
+                           size_t& msglen);
+
 /**
  * @ingroup networkprotocol
  * Encrypt the user data part of a packed message.
@@ -305,6 +454,51 @@ size_t encryptmsg(char* destmsg, size_t maxlen, const char* srcmsg,
 size_t decryptmsg(char* destmsg, const char* srcmsg, size_t msglen,
                   const uint8_t* pubkey, const uint8_t* seckey);
 
+/**
+ * @ingroup networkprotocol
+ * Number of bytes added to a packed message by encryptmsg_sessionkey():
+ * 64 bit nonce counter and 16 bytes authentication tag.
+ */
+#define SESSIONKEY_OVERHEAD (sizeof(uint64_t) + 16u)
+
+/**
+ * @ingroup networkprotocol
+ * Encrypt the user data part of a packed message with a symmetric session
+ * key.
+ *
+ * The nonce is derived from the sender ID in the header and a
+ * counter, which is transmitted in front of the encrypted data. The
+ * header is authenticated, but not encrypted.
+ *
+ * @param[out] destmsg Start of memory area where the data is stored.
+ * @param[in] maxlen Size of destmsg in bytes.
+ * @param[in] srcmsg Source message, unencrypted.
+ * @param[in] msglen Length of the source message in bytes.
+ * @param[in] key Session key of crypto_box_BEFORENMBYTES bytes, see
+ * crypto_box_beforenm().
+ * @param[in] counter Nonce counter. Must never be used twice with the same
+ * key by the same sender.
+ * @return The length of the encrypted message is returned, or zero if
+ * destmsg is too small.
+ */
+size_t encryptmsg_sessionkey(char* destmsg, size_t maxlen, const char* srcmsg,
+                             size_t msglen, const uint8_t* key,
+                             uint64_t counter);
+
+/**
+ * @ingroup networkprotocol
+ * Decrypt the user data part of a packed message which was encrypted with
+ * encryptmsg_sessionkey(). Return source message on failure.
+ * @param[out] destmsg Start of memory area where the data is stored.
+ * @param[in] srcmsg Source message, encrypted.
+ * @param[in] msglen Length of the source message in bytes.
+ * @param[in] key Session key of crypto_box_BEFORENMBYTES bytes.
+ * @return The length of the decrypted message is returned, or zero if
+ * decryption or authentication failed.
+ */
+size_t decryptmsg_sessionkey(char* destmsg, const char* srcmsg, size_t msglen,
+                             const uint8_t* key);
+
 #endif
 
 /*
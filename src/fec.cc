@@ -0,0 +1,225 @@
+/*
+ * This file is part of the ovbox software tool, see <http://orlandoviols.com/>.
+ *
+ * Copyright (c) 2021 Giso Grimm
+ */
+/*
+ * ovbox is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published
+ * by the Free Software Foundation, version 3 of the License.
+ *
+ * ovbox is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License, version 3 for more details.
+ *
+ * You should have received a copy of the GNU General Public License,
+ * Version 3 along with ovbox. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "fec.h"
+
+bool fec_valid_group(size_t group)
+{
+  return (group >= 2) && (group <= FEC_MAXGROUP) &&
+         ((group & (group - 1)) == 0);
+}
+
+// first sequence number of the group of a message:
+static sequence_t group_start(sequence_t seq, size_t group)
+{
+  return (sequence_t)((uint16_t)seq & ~(uint16_t)(group - 1));
+}
+
+static uint16_t group_bit(sequence_t seq, sequence_t start)
+{
+  return (uint16_t)(1u << (uint16_t)(seq - start));
+}
+
+// XOR a payload into an accumulator, which is implicitly zero beyond
+// its current length:
+static void xor_into(char* acc, size_t& acclen, const char* data, size_t len)
+{
+  size_t n(std::min(acclen, len));
+  for(size_t k = 0; k < n; ++k)
+    acc[k] ^= data[k];
+  if(len > acclen) {
+    memcpy(&(acc[acclen]), &(data[acclen]), len - acclen);
+    acclen = len;
+  }
+}
+
+size_t fec_encoder_t::add(const char* msg, size_t len, size_t group_,
+                          char* parity)
+{
+  if((len < HEADERLEN) || (!fec_valid_group(group_)) ||
+     (len - HEADERLEN > BUFSIZE - HEADERLEN - FEC_HEADERLEN)) {
+    active = false;
+    return 0;
+  }
+  msg_header_t hdr(msg_header_t::load(msg));
+  sequence_t gstart(group_start(hdr.seq, group_));
+  if((!active) || (hdr.port != port) || (group_ != group) ||
+     (gstart != start)) {
+    // start a new group:
+    active = true;
+    port = hdr.port;
+    group = group_;
+    start = gstart;
+    mask = 0;
+    lenxor = 0;
+    acclen = 0;
+  }
+  xor_into(acc, acclen, &(msg[HEADERLEN]), len - HEADERLEN);
+  lenxor ^= (uint16_t)(len - HEADERLEN);
+  mask |= group_bit(hdr.seq, start);
+  if((uint16_t)(hdr.seq - start) != group - 1)
+    return 0;
+  // last message of the group:
+  active = false;
+  msg_store(parity, 0, port);
+  msg_store(parity, 2, start);
+  msg_store(parity, 4, mask);
+  msg_store(parity, 6, (uint8_t)group);
+  msg_store(parity, 7, (uint8_t)0);
+  msg_store(parity, 8, lenxor);
+  memcpy(&(parity[FEC_HEADERLEN]), acc, acclen);
+  return FEC_HEADERLEN + acclen;
+}
+
+fec_decoder_t::fec_decoder_t()
+{
+  for(size_t k = 0; k < MAX_STAGE_ID; ++k) {
+    received[k] = 0;
+    recovered[k] = 0;
+  }
+}
+
+fec_decoder_t::~fec_decoder_t() {}
+
+fec_decoder_t::stream_t* fec_decoder_t::find_stream(stage_device_id_t cid,
+                                                    port_t port, bool create)
+{
+  if(cid >= MAX_STAGE_ID)
+    return NULL;
+  // linear probing, as in message_sorter_t:
+  size_t idx(port % FEC_PORTS);
+  for(size_t k = 0; k < FEC_PORTS; ++k) {
+    std::unique_ptr<stream_t>& stream(streams[cid][idx]);
+    if(!stream) {
+      if(!create)
+        return NULL;
+      stream.reset(new stream_t());
+      stream->port = port;
+      return stream.get();
+    }
+    if(stream->port == port)
+      return stream.get();
+    idx = (idx + 1) % FEC_PORTS;
+  }
+  return NULL;
+}
+
+fec_decoder_t::slot_t& fec_decoder_t::get_slot(stream_t& stream,
+                                               sequence_t start)
+{
+  slot_t& slot(stream.slot[((uint16_t)start / stream.group) % FEC_SLOTS]);
+  if((!slot.used) || (slot.start != start)) {
+    slot.used = true;
+    slot.start = start;
+    slot.rxmask = 0;
+    slot.lenxor = 0;
+    slot.acclen = 0;
+  }
+  return slot;
+}
+
+void fec_decoder_t::add(const msgbuf_t& msg)
+{
+  if(!msg.valid || (msg.destport <= MAXSPECIALPORT))
+    return;
+  stream_t* stream(find_stream(msg.cid, msg.destport, false));
+  if(!stream || !stream->group)
+    return;
+  slot_t& slot(get_slot(*stream, group_start(msg.seq, stream->group)));
+  uint16_t bit(group_bit(msg.seq, slot.start));
+  if(slot.rxmask & bit)
+    // duplicate:
+    return;
+  xor_into(slot.acc, slot.acclen, msg.msg, msg.size);
+  slot.lenxor ^= (uint16_t)(msg.size);
+  slot.rxmask |= bit;
+}
+
+bool fec_decoder_t::recover(const msgbuf_t& parity, secret_t secret,
+                            msgbuf_t& rec)
+{
+  if(!parity.valid || (parity.size < FEC_HEADERLEN) ||
+     (parity.cid >= MAX_STAGE_ID))
+    return false;
+  const char* p(parity.msg);
+  port_t port(msg_load<port_t>(p, 0));
+  sequence_t start(msg_load<sequence_t>(p, 2));
+  uint16_t mask(msg_load<uint16_t>(p, 4));
+  size_t group(msg_load<uint8_t>(p, 6));
+  uint16_t lenxor(msg_load<uint16_t>(p, 8));
+  const char* pdata(&(p[FEC_HEADERLEN]));
+  size_t plen(parity.size - FEC_HEADERLEN);
+  if((port <= MAXSPECIALPORT) || (!fec_valid_group(group)) ||
+     (group_start(start, group) != start) || (mask >> group))
+    return false;
+  ++received[parity.cid];
+  stream_t* stream(find_stream(parity.cid, port, true));
+  if(!stream)
+    return false;
+  if(stream->group != group) {
+    // start collecting payloads with the next group:
+    stream->group = group;
+    for(auto& slot : stream->slot)
+      slot.used = false;
+    return false;
+  }
+  slot_t& slot(get_slot(*stream, start));
+  uint16_t missing((uint16_t)(mask & ~slot.rxmask));
+  // exactly one message of the parity is missing:
+  if((missing == 0) || (missing & (missing - 1)) || (slot.rxmask & ~mask))
+    return false;
+  size_t len(lenxor ^ slot.lenxor);
+  if((len > plen) || (len > BUFSIZE - HEADERLEN))
+    return false;
+  uint16_t idx(0);
+  while(!(missing & (1u << idx)))
+    ++idx;
+  msg_header_t hdr;
+  hdr.secret = secret;
+  hdr.callerid = parity.cid;
+  hdr.port = port;
+  hdr.seq = (sequence_t)(start + idx);
+  hdr.store(rec.rawbuffer);
+  char* data(&(rec.rawbuffer[HEADERLEN]));
+  size_t n(std::min(len, slot.acclen));
+  for(size_t k = 0; k < n; ++k)
+    data[k] = (char)(pdata[k] ^ slot.acc[k]);
+  if(len > n)
+    memcpy(&(data[n]), &(pdata[n]), len - n);
+  rec.unpack(hdr, HEADERLEN + len);
+  rec.sender = parity.sender;
+  slot.rxmask |= missing;
+  ++recovered[parity.cid];
+  return true;
+}
+
+void fec_decoder_t::get_stat(stage_device_id_t cid, message_stat_t& stat) const
+{
+  if(cid >= MAX_STAGE_ID)
+    return;
+  stat.fec_overhead = received[cid];
+  stat.fec_recovered = recovered[cid];
+}
+
+/*
+ * Local Variables:
+ * mode: c++
+ * compile-command: "make -C .."
+ * End:
+ */
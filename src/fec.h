@@ -0,0 +1,168 @@
+/*
+ * This file is part of the ovbox software tool, see <http://orlandoviols.com/>.
+ *
+ * Copyright (c) 2021 Giso Grimm
+ */
+/*
+ * ovbox is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published
+ * by the Free Software Foundation, version 3 of the License.
+ *
+ * ovbox is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License, version 3 for more details.
+ *
+ * You should have received a copy of the GNU General Public License,
+ * Version 3 along with ovbox. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef FEC_H
+#define FEC_H
+
+#include "udpsocket.h"
+#include <memory>
+
+/**
+ * @defgroup fec Forward error correction
+ *
+ * XOR parity of groups of data messages of a stream, which allows to
+ * recover one lost message per group.
+ *
+ * The messages of a stream (device ID and port) are grouped by their
+ * sequence number: a group contains the group size consecutive
+ * sequence numbers, starting at a multiple of the group size. After
+ * the last message of a group the sender sends a parity message to
+ * port PORT_FEC, whose payload is:
+ *
+ * | Offset | Size | Content                                         |
+ * | ------ | ---- | ----------------------------------------------- |
+ * | 0      | 2    | port of the stream                              |
+ * | 2      | 2    | sequence number of first message of the group   |
+ * | 4      | 2    | bit mask of the messages contained in parity    |
+ * | 6      | 1    | group size                                      |
+ * | 7      | 1    | reserved                                        |
+ * | 8      | 2    | XOR of the payload lengths                      |
+ * | 10     |      | XOR of the payloads                             |
+ *
+ * Payloads of different length are XOR-ed as if they were padded
+ * with zeros.
+ */
+
+/// @ingroup fec
+#define FEC_HEADERLEN 10
+/**
+ * @ingroup fec
+ * Maximum group size
+ */
+#define FEC_MAXGROUP 16
+// number of ports per device which can be recovered:
+#define FEC_PORTS 16
+// number of groups per stream which are tracked at the same time:
+#define FEC_SLOTS 4
+
+/**
+ * @ingroup fec
+ * Return true if a group size is valid, i.e., a power of two between
+ * 2 and FEC_MAXGROUP.
+ */
+bool fec_valid_group(size_t group);
+
+/**
+ * @ingroup fec
+ * Parity of the messages sent from one local port.
+ */
+class fec_encoder_t {
+public:
+  /**
+   * Add a packed data message to the parity of its group.
+   *
+   * @param msg Packed message
+   * @param len Length of packed message
+   * @param group Group size, see fec_valid_group(), or zero to switch
+   * off parity messages
+   * @param parity Buffer of BUFSIZE - HEADERLEN bytes for the payload
+   * of the parity message
+   * @return Length of the payload of the parity message, if the
+   * message completed a group, otherwise zero
+   */
+  size_t add(const char* msg, size_t len, size_t group, char* parity);
+
+private:
+  bool active = false;
+  port_t port = 0;
+  size_t group = 0;
+  sequence_t start = 0;
+  uint16_t mask = 0;
+  uint16_t lenxor = 0;
+  size_t acclen = 0;
+  char acc[BUFSIZE];
+};
+
+/**
+ * @ingroup fec
+ * Recovery of lost messages from parity messages.
+ *
+ * The payloads of all received data messages of a stream are XOR-ed
+ * per group, but only once the first parity message of the stream was
+ * received, so no memory is used for streams without parity.
+ */
+class fec_decoder_t {
+public:
+  fec_decoder_t();
+  ~fec_decoder_t();
+  fec_decoder_t(const fec_decoder_t&) = delete;
+  /**
+   * Add a received, decrypted data message.
+   */
+  void add(const msgbuf_t& msg);
+  /**
+   * Process a received, decrypted parity message.
+   *
+   * @param parity Parity message
+   * @param secret Session secret, for the header of the recovered
+   * message
+   * @param[out] rec Recovered message
+   * @return True if a message was recovered
+   */
+  bool recover(const msgbuf_t& parity, secret_t secret, msgbuf_t& rec);
+  /**
+   * Set the parity statistics of a device in message statistics.
+   */
+  void get_stat(stage_device_id_t cid, message_stat_t& stat) const;
+
+private:
+  struct slot_t {
+    bool used = false;
+    sequence_t start = 0;
+    uint16_t rxmask = 0;
+    uint16_t lenxor = 0;
+    size_t acclen = 0;
+    char acc[BUFSIZE];
+  };
+  struct stream_t {
+    port_t port = 0;
+    size_t group = 0;
+    slot_t slot[FEC_SLOTS];
+  };
+  /**
+   * Find the stream of a device and port.
+   *
+   * @param create Create the stream if it does not exist
+   * @return Stream, or NULL
+   */
+  stream_t* find_stream(stage_device_id_t cid, port_t port, bool create);
+  slot_t& get_slot(stream_t& stream, sequence_t start);
+  std::unique_ptr<stream_t> streams[MAX_STAGE_ID][FEC_PORTS];
+  size_t received[MAX_STAGE_ID];
+  size_t recovered[MAX_STAGE_ID];
+};
+
+#endif
+
+/*
+ * Local Variables:
+ * mode: c++
+ * compile-command: "make -C .."
+ * End:
+ */
@@ -0,0 +1,137 @@
+/*
+ * This file is part of the ovbox software tool, see <http://orlandoviols.com/>.
+ *
+ * Copyright (c) 2021 Giso Grimm
+ */
+/*
+ * ovbox is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published
+ * by the Free Software Foundation, version 3 of the License.
+ *
+ * ovbox is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License, version 3 for more details.
+ *
+ * You should have received a copy of the GNU General Public License,
+ * Version 3 along with ovbox. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "histogram.h"
+#include <cmath>
+
+latency_histogram_t::latency_histogram_t()
+{
+  clear();
+}
+
+size_t latency_histogram_t::bucket(float value)
+{
+  // this also catches negative values and NaN:
+  if(!(value >= std::ldexp(1.0f, HIST_MINEXP)))
+    return 0;
+  int e(0);
+  // value = m * 2^e, with 0.5 <= m < 1:
+  float m(std::frexp(value, &e));
+  --e;
+  if(e >= HIST_MAXEXP)
+    return HIST_BUCKETS - 1;
+  size_t sub((size_t)((2.0f * m - 1.0f) * HIST_SUBBUCKETS));
+  if(sub >= HIST_SUBBUCKETS)
+    sub = HIST_SUBBUCKETS - 1;
+  return 1u + (size_t)(e - HIST_MINEXP) * HIST_SUBBUCKETS + sub;
+}
+
+void latency_histogram_t::add(float value)
+{
+  size_t b(bucket(value));
+  ++counts[b];
+  sums[b] += value;
+  ++total;
+}
+
+void latency_histogram_t::remove(float value)
+{
+  size_t b(bucket(value));
+  if(!counts[b])
+    return;
+  --counts[b];
+  --total;
+  if(counts[b])
+    sums[b] -= value;
+  else
+    // avoid accumulation of rounding errors:
+    sums[b] = 0.0;
+}
+
+void latency_histogram_t::clear()
+{
+  for(size_t k = 0; k < HIST_BUCKETS; ++k) {
+    counts[k] = 0u;
+    sums[k] = 0.0;
+  }
+  total = 0u;
+}
+
+void latency_histogram_t::operator+=(const latency_histogram_t& src)
+{
+  for(size_t k = 0; k < HIST_BUCKETS; ++k) {
+    counts[k] += src.counts[k];
+    sums[k] += src.sums[k];
+  }
+  total += src.total;
+}
+
+void latency_histogram_t::operator-=(const latency_histogram_t& src)
+{
+  total = 0u;
+  for(size_t k = 0; k < HIST_BUCKETS; ++k) {
+    if(counts[k] > src.counts[k]) {
+      counts[k] -= src.counts[k];
+      sums[k] -= src.sums[k];
+    } else {
+      counts[k] = 0u;
+      sums[k] = 0.0;
+    }
+    total += counts[k];
+  }
+}
+
+float latency_histogram_t::bucket_lower(size_t bucket)
+{
+  if(bucket == 0)
+    return 0.0f;
+  if(bucket >= HIST_BUCKETS - 1)
+    return std::ldexp(1.0f, HIST_MAXEXP);
+  --bucket;
+  int e((int)(bucket / HIST_SUBBUCKETS) + HIST_MINEXP);
+  float sub((float)(bucket % HIST_SUBBUCKETS));
+  return std::ldexp(1.0f + sub / HIST_SUBBUCKETS, e);
+}
+
+float latency_histogram_t::bucket_upper(size_t bucket)
+{
+  if(bucket >= HIST_BUCKETS - 1)
+    return INFINITY;
+  return bucket_lower(bucket + 1);
+}
+
+float latency_histogram_t::get_rank(size_t rank) const
+{
+  if(rank >= total)
+    return -1.0f;
+  size_t cumcount(0);
+  for(size_t k = 0; k < HIST_BUCKETS; ++k) {
+    cumcount += counts[k];
+    if(cumcount > rank)
+      return (float)(sums[k] / counts[k]);
+  }
+  return -1.0f;
+}
+
+/*
+ * Local Variables:
+ * mode: c++
+ * compile-command: "make -C .."
+ * End:
+ */
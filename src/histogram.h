@@ -0,0 +1,120 @@
+/*
+ * This file is part of the ovbox software tool, see <http://orlandoviols.com/>.
+ *
+ * Copyright (c) 2021 Giso Grimm
+ */
+/*
+ * ovbox is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published
+ * by the Free Software Foundation, version 3 of the License.
+ *
+ * ovbox is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License, version 3 for more details.
+ *
+ * You should have received a copy of the GNU General Public License,
+ * Version 3 along with ovbox. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef HISTOGRAM_H
+#define HISTOGRAM_H
+
+#include <cstddef>
+#include <cstdint>
+
+// number of buckets per octave of the latency histogram:
+#define HIST_SUBBUCKETS 32
+// values below 2^HIST_MINEXP ms are collected in the first bucket:
+#define HIST_MINEXP -7
+// values of 2^HIST_MAXEXP ms or more are collected in the last bucket:
+#define HIST_MAXEXP 14
+#define HIST_BUCKETS ((HIST_MAXEXP - HIST_MINEXP) * HIST_SUBBUCKETS + 2)
+
+/**
+ * Histogram of latency values with logarithmic buckets.
+ *
+ * The relative width of the buckets is 1/HIST_SUBBUCKETS, between
+ * 2^HIST_MINEXP and 2^HIST_MAXEXP milliseconds. The sum of values
+ * is stored with each bucket, and the mean of a bucket is used as
+ * its value, i.e., results are exact as long as all values in a
+ * bucket are identical.
+ *
+ * Values can be added and removed, so the histogram can represent a
+ * sliding window. No memory is allocated, and quantiles are computed
+ * in O(HIST_BUCKETS). Histograms of different time windows, peers or
+ * paths can be merged by adding them, and the histogram of a time
+ * window can be obtained by subtracting cumulative histograms.
+ */
+class latency_histogram_t {
+public:
+  latency_histogram_t();
+  /**
+   * Add a value.
+   *
+   * @param value Latency in milliseconds
+   */
+  void add(float value);
+  /**
+   * Remove a value which was previously added.
+   *
+   * @param value Latency in milliseconds
+   */
+  void remove(float value);
+  /**
+   * Remove all values.
+   */
+  void clear();
+  /**
+   * Merge the values of another histogram into this histogram.
+   */
+  void operator+=(const latency_histogram_t& src);
+  /**
+   * Remove the values of another histogram, e.g., an earlier state
+   * of this histogram.
+   */
+  void operator-=(const latency_histogram_t& src);
+  /**
+   * Return number of values.
+   */
+  size_t size() const { return total; };
+  /**
+   * Return the value at a given rank.
+   *
+   * @param rank Rank, zero for the smallest value
+   * @return Mean value of the bucket which contains the rank, or -1
+   * if the rank is out of range
+   */
+  float get_rank(size_t rank) const;
+  /**
+   * Return number of values in a bucket.
+   */
+  uint32_t get_count(size_t bucket) const { return counts[bucket]; };
+  /**
+   * Return bucket index of a value.
+   */
+  static size_t bucket(float value);
+  /**
+   * Return lower limit of a bucket in milliseconds.
+   */
+  static float bucket_lower(size_t bucket);
+  /**
+   * Return upper limit of a bucket in milliseconds, or infinity for
+   * the last bucket.
+   */
+  static float bucket_upper(size_t bucket);
+
+private:
+  uint32_t counts[HIST_BUCKETS];
+  double sums[HIST_BUCKETS];
+  size_t total;
+};
+
+#endif
+
+/*
+ * Local Variables:
+ * mode: c++
+ * compile-command: "make -C .."
+ * End:
+ */
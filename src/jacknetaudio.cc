@@ -0,0 +1,109 @@
+/*
+ * This file is part of the ovbox software tool, see <http://orlandoviols.com/>.
+ *
+ * Copyright (c) 2021 Giso Grimm
+ */
+/*
+ * ovbox is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published
+ * by the Free Software Foundation, version 3 of the License.
+ *
+ * ovbox is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License, version 3 for more details.
+ *
+ * You should have received a copy of the GNU General Public License,
+ * Version 3 along with ovbox. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "jacknetaudio.h"
+#include "errmsg.h"
+
+jack_netaudio_t::jack_netaudio_t(const std::string& clientname_)
+    : clientname(clientname_), jc(NULL), active(false)
+{
+  jack_options_t opt((jack_options_t)(JackNoStartServer));
+  jack_status_t jstat;
+  jc = jack_client_open(clientname.c_str(), opt, &jstat);
+  if(!jc)
+    throw ErrMsg("Unable to open jack client \"" + clientname + "\".");
+  clientname = jack_get_client_name(jc);
+  jack_set_process_callback(jc, &jack_netaudio_t::process, this);
+}
+
+jack_netaudio_t::~jack_netaudio_t()
+{
+  if(active)
+    jack_deactivate(jc);
+  for(auto p : outports)
+    jack_port_unregister(jc, p);
+  for(auto p : inports)
+    jack_port_unregister(jc, p);
+  jack_client_close(jc);
+}
+
+void jack_netaudio_t::add_receiver(port_t port, const std::string& prefix,
+                                   size_t channels, double buffer)
+{
+  if(active)
+    throw ErrMsg("Network audio receivers can not be added while active.");
+  receiver.add_stream(port, channels, buffer, jack_get_sample_rate(jc));
+  for(size_t c = 0; c < channels; ++c) {
+    std::string name(prefix + ".out_" + std::to_string(c + 1));
+    jack_port_t* p(jack_port_register(jc, name.c_str(), JACK_DEFAULT_AUDIO_TYPE,
+                                      JackPortIsOutput, 0));
+    if(!p)
+      throw ErrMsg("Unable to register jack port \"" + name + "\".");
+    outports.push_back(p);
+  }
+  outbuf.resize(outports.size());
+}
+
+void jack_netaudio_t::add_sender(const std::string& prefix, size_t channels,
+                                 netaudio_format_t format)
+{
+  if(active || sender)
+    throw ErrMsg("The network audio sender can be added only once.");
+  for(size_t c = 0; c < channels; ++c) {
+    std::string name(prefix + ".in_" + std::to_string(c + 1));
+    jack_port_t* p(jack_port_register(jc, name.c_str(), JACK_DEFAULT_AUDIO_TYPE,
+                                      JackPortIsInput, 0));
+    if(!p)
+      throw ErrMsg("Unable to register jack port \"" + name + "\".");
+    inports.push_back(p);
+  }
+  inbuf.resize(inports.size());
+  sender.reset(
+      new netaudio_sender_t(channels, format, jack_get_sample_rate(jc)));
+}
+
+void jack_netaudio_t::activate()
+{
+  if(jack_activate(jc) != 0)
+    throw ErrMsg("Unable to activate jack client \"" + clientname + "\".");
+  active = true;
+}
+
+int jack_netaudio_t::process(jack_nframes_t nframes, void* arg)
+{
+  jack_netaudio_t* self((jack_netaudio_t*)arg);
+  for(size_t k = 0; k < self->outports.size(); ++k)
+    self->outbuf[k] =
+        (float*)jack_port_get_buffer(self->outports[k], nframes);
+  self->receiver.process(self->outbuf.data(), nframes);
+  if(self->sender) {
+    for(size_t k = 0; k < self->inports.size(); ++k)
+      self->inbuf[k] =
+          (const float*)jack_port_get_buffer(self->inports[k], nframes);
+    self->sender->process(self->inbuf.data(), nframes);
+  }
+  return 0;
+}
+
+/*
+ * Local Variables:
+ * mode: c++
+ * compile-command: "make -C .."
+ * End:
+ */
@@ -0,0 +1,111 @@
+/*
+ * This file is part of the ovbox software tool, see <http://orlandoviols.com/>.
+ *
+ * Copyright (c) 2021 Giso Grimm
+ */
+/*
+ * ovbox is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published
+ * by the Free Software Foundation, version 3 of the License.
+ *
+ * ovbox is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License, version 3 for more details.
+ *
+ * You should have received a copy of the GNU General Public License,
+ * Version 3 along with ovbox. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef JACKNETAUDIO_H
+#define JACKNETAUDIO_H
+
+#include "netaudio.h"
+#include <jack/jack.h>
+
+/**
+ * @ingroup netaudio
+ * Jack client of the network audio streams of a session.
+ *
+ * All received streams are provided as output ports of a single jack
+ * client, which replaces one ovzita-n2j process per stage member.
+ * The received messages are passed directly from ovboxclient_t to
+ * the jitter buffers, see ovboxclient_t::set_local_receiver_callback().
+ * The sent stream is read from input ports of the same client, which
+ * replaces the ovzita-j2n process, and passed directly to
+ * ovboxclient_t::send_local().
+ */
+class jack_netaudio_t {
+public:
+  /**
+   * Open the jack client.
+   *
+   * @param clientname Name of jack client
+   *
+   * Throws an exception of type ErrMsg if no jack server is running.
+   */
+  jack_netaudio_t(const std::string& clientname);
+  ~jack_netaudio_t();
+  jack_netaudio_t(const jack_netaudio_t&) = delete;
+  /**
+   * Add a received stream with one output port per channel. Streams
+   * can be added only before activate().
+   *
+   * @param port Local port of the stream
+   * @param prefix Prefix of the port names, the ports are named
+   * prefix.out_1, prefix.out_2 etc.
+   * @param channels Number of channels
+   * @param buffer Jitter buffer length in milliseconds
+   */
+  void add_receiver(port_t port, const std::string& prefix, size_t channels,
+                    double buffer);
+  /**
+   * Add the sent stream with one input port per channel. The sender
+   * can be added only once, and only before activate().
+   *
+   * @param prefix Prefix of the port names, the ports are named
+   * prefix.in_1, prefix.in_2 etc.
+   * @param channels Number of channels
+   * @param format Sample format
+   */
+  void add_sender(const std::string& prefix, size_t channels,
+                  netaudio_format_t format);
+  /**
+   * Return the name of the jack client, which may differ from the
+   * requested name.
+   */
+  const std::string& get_client_name() const { return clientname; };
+  /**
+   * Start audio processing.
+   */
+  void activate();
+  /**
+   * Receiver of all streams, for ovboxclient_t::set_local_receiver_callback()
+   */
+  netaudio_receiver_t receiver;
+  /**
+   * Sender, or NULL if no sender was added. Sending starts with
+   * netaudio_sender_t::start().
+   */
+  std::unique_ptr<netaudio_sender_t> sender;
+
+private:
+  static int process(jack_nframes_t nframes, void* arg);
+  std::string clientname;
+  jack_client_t* jc;
+  bool active;
+  std::vector<jack_port_t*> outports;
+  std::vector<jack_port_t*> inports;
+  // buffers of current block:
+  std::vector<float*> outbuf;
+  std::vector<const float*> inbuf;
+};
+
+#endif
+
+/*
+ * Local Variables:
+ * mode: c++
+ * compile-command: "make -C .."
+ * End:
+ */
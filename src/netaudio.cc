@@ -0,0 +1,472 @@
+/*
+ * This file is part of the ovbox software tool, see <http://orlandoviols.com/>.
+ *
+ * Copyright (c) 2021 Giso Grimm
+ */
+/*
+ * ovbox is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published
+ * by the Free Software Foundation, version 3 of the License.
+ *
+ * ovbox is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License, version 3 for more details.
+ *
+ * You should have received a copy of the GNU General Public License,
+ * Version 3 along with ovbox. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "netaudio.h"
+#include "errmsg.h"
+#include <algorithm>
+#include <math.h>
+#include <string.h>
+#include <time.h>
+
+// largest block which can be stored in a jitter buffer:
+#define NETAUDIO_MAXFRAMES (NETAUDIO_MAXLEN / 2)
+
+netaudio_format_t netaudio_format(const std::string& name)
+{
+  if(name == "16bit")
+    return NETAUDIO_16BIT;
+  if(name == "24bit")
+    return NETAUDIO_24BIT;
+  if(name == "float")
+    return NETAUDIO_FLOAT;
+  throw ErrMsg("Invalid network audio sample format \"" + name + "\".");
+}
+
+size_t netaudio_sample_size(uint8_t format)
+{
+  switch(format) {
+  case NETAUDIO_16BIT:
+    return 2;
+  case NETAUDIO_24BIT:
+    return 3;
+  case NETAUDIO_FLOAT:
+    return 4;
+  }
+  return 0;
+}
+
+static inline uint16_t get_u16(const char* p)
+{
+  const uint8_t* u((const uint8_t*)p);
+  return (uint16_t)(u[0] | (u[1] << 8));
+}
+
+static inline uint32_t get_u32(const char* p)
+{
+  const uint8_t* u((const uint8_t*)p);
+  return (uint32_t)u[0] | ((uint32_t)u[1] << 8) | ((uint32_t)u[2] << 16) |
+         ((uint32_t)u[3] << 24);
+}
+
+static inline void set_u16(char* p, uint16_t v)
+{
+  p[0] = (char)(v & 0xff);
+  p[1] = (char)(v >> 8);
+}
+
+static inline void set_u32(char* p, uint32_t v)
+{
+  for(size_t k = 0; k < 4; ++k)
+    p[k] = (char)((v >> (8 * k)) & 0xff);
+}
+
+/**
+ * Convert a sample from the network format.
+ */
+static inline float get_sample(const char* p, uint8_t format)
+{
+  switch(format) {
+  case NETAUDIO_16BIT:
+    return (float)(int16_t)get_u16(p) * (1.0f / 32767.0f);
+  case NETAUDIO_24BIT: {
+    // sign extension of the most significant byte:
+    int32_t v((int32_t)(get_u32(p) << 8) >> 8);
+    return (float)v * (1.0f / 8388607.0f);
+  }
+  case NETAUDIO_FLOAT: {
+    uint32_t v(get_u32(p));
+    float f;
+    memcpy(&f, &v, sizeof(f));
+    return f;
+  }
+  }
+  return 0.0f;
+}
+
+/**
+ * Convert a sample to the network format.
+ */
+static inline void set_sample(char* p, float f, netaudio_format_t format)
+{
+  switch(format) {
+  case NETAUDIO_16BIT:
+    f = std::min(1.0f, std::max(-1.0f, f));
+    set_u16(p, (uint16_t)(int16_t)lrintf(32767.0f * f));
+    break;
+  case NETAUDIO_24BIT: {
+    f = std::min(1.0f, std::max(-1.0f, f));
+    uint32_t v((uint32_t)lrintf(8388607.0f * f));
+    p[0] = (char)(v & 0xff);
+    p[1] = (char)((v >> 8) & 0xff);
+    p[2] = (char)((v >> 16) & 0xff);
+    break;
+  }
+  case NETAUDIO_FLOAT: {
+    uint32_t v;
+    memcpy(&v, &f, sizeof(f));
+    set_u32(p, v);
+    break;
+  }
+  }
+}
+
+bool netaudio_decode(const char* msg, size_t len, netaudio_packet_t& pkt)
+{
+  if(len < NETAUDIO_HEADERLEN)
+    return false;
+  if((uint8_t)msg[0] != NETAUDIO_VERSION)
+    return false;
+  pkt.format = (uint8_t)msg[1];
+  pkt.channels = (uint8_t)msg[2];
+  pkt.frames = get_u16(msg + 4);
+  pkt.frame = get_u32(msg + 8);
+  pkt.srate = get_u32(msg + 12);
+  pkt.data = msg + NETAUDIO_HEADERLEN;
+  size_t samplesize(netaudio_sample_size(pkt.format));
+  if(!samplesize || !pkt.channels)
+    return false;
+  return len >= NETAUDIO_HEADERLEN +
+                    samplesize * (size_t)pkt.channels * (size_t)pkt.frames;
+}
+
+size_t netaudio_encode(char* buf, size_t len, netaudio_format_t format,
+                       size_t channels, size_t frames, uint32_t frame,
+                       uint32_t srate, const float* const* audio)
+{
+  size_t samplesize(netaudio_sample_size(format));
+  size_t msglen(NETAUDIO_HEADERLEN + samplesize * channels * frames);
+  if((msglen > len) || (channels > 0xff) || (frames > 0xffff) || (!channels))
+    return 0;
+  memset(buf, 0, NETAUDIO_HEADERLEN);
+  buf[0] = NETAUDIO_VERSION;
+  buf[1] = (char)format;
+  buf[2] = (char)channels;
+  set_u16(buf + 4, (uint16_t)frames);
+  set_u32(buf + 8, frame);
+  set_u32(buf + 12, srate);
+  char* p(buf + NETAUDIO_HEADERLEN);
+  for(size_t k = 0; k < frames; ++k)
+    for(size_t c = 0; c < channels; ++c) {
+      set_sample(p, audio[c][k], format);
+      p += samplesize;
+    }
+  return msglen;
+}
+
+netaudio_jitterbuffer_t::netaudio_jitterbuffer_t(size_t channels_,
+                                                 uint32_t target_)
+    : channels(channels_), target(target_), capacity(8192)
+{
+  // space for the buffer, one block of the writer and of the reader,
+  // and jitter:
+  while(capacity < 2 * (target + NETAUDIO_MAXFRAMES))
+    capacity *= 2;
+  data.resize((size_t)capacity * channels, 0.0f);
+}
+
+void netaudio_jitterbuffer_t::request_reset(uint32_t frame)
+{
+  reset_frame.store(frame);
+  reset_valid.store(true);
+  if(!reset.exchange(true, std::memory_order_release))
+    ++resets;
+}
+
+void netaudio_jitterbuffer_t::put(const netaudio_packet_t& pkt)
+{
+  const uint32_t f(pkt.frame);
+  const uint32_t n(pkt.frames);
+  if((n == 0) || (n > NETAUDIO_MAXFRAMES))
+    return;
+  if(reset.load(std::memory_order_acquire)) {
+    // the reader owns the buffer until the reset is done:
+    reset_frame.store(f + n);
+    reset_valid.store(true);
+    return;
+  }
+  const uint32_t we(wend.load(std::memory_order_relaxed));
+  const uint32_t lim(wlimit.load(std::memory_order_acquire));
+  const int32_t halfcap((int32_t)(capacity / 2));
+  const int32_t dist((int32_t)(f - we));
+  if((dist > halfcap) || (dist < -halfcap) ||
+     ((int32_t)(f + n - lim) > halfcap)) {
+    // the frame counter jumped, or the reader is stalled:
+    request_reset(f + n);
+    return;
+  }
+  // the reader reads only frames before the end of received frames,
+  // so only reordered messages may collide with the reader:
+  if((dist < 0) && ((int32_t)(f - lim) < 0)) {
+    ++late;
+    return;
+  }
+  const uint32_t mask(capacity - 1);
+  // replace lost frames by silence:
+  for(uint32_t z = we; (int32_t)(f - z) > 0; ++z)
+    memset(&(data[(size_t)(z & mask) * channels]), 0,
+           channels * sizeof(float));
+  const size_t samplesize(netaudio_sample_size(pkt.format));
+  const size_t nch(std::min(channels, (size_t)pkt.channels));
+  const char* p(pkt.data);
+  for(uint32_t k = 0; k < n; ++k) {
+    float* frame(&(data[(size_t)((f + k) & mask) * channels]));
+    for(size_t c = 0; c < nch; ++c)
+      frame[c] = get_sample(p + c * samplesize, pkt.format);
+    for(size_t c = nch; c < channels; ++c)
+      frame[c] = 0.0f;
+    p += samplesize * pkt.channels;
+  }
+  if((int32_t)(f + n - we) > 0)
+    wend.store(f + n, std::memory_order_release);
+}
+
+void netaudio_jitterbuffer_t::get(float* const* out, uint32_t frames)
+{
+  if(reset.load(std::memory_order_acquire)) {
+    if(!reset_valid.load()) {
+      // nothing was received yet:
+      for(size_t c = 0; c < channels; ++c)
+        memset(out[c], 0, frames * sizeof(float));
+      return;
+    }
+    // the writer does not access the buffer while the reset flag is
+    // set:
+    std::fill(data.begin(), data.end(), 0.0f);
+    const uint32_t we(reset_frame.load());
+    wend.store(we, std::memory_order_relaxed);
+    rpos = we - target;
+    meanfill = (float)target;
+    wlimit.store(rpos + frames, std::memory_order_relaxed);
+    reset_valid.store(false);
+    reset.store(false, std::memory_order_release);
+  }
+  const uint32_t we(wend.load(std::memory_order_acquire));
+  const int32_t fill((int32_t)(we - rpos));
+  if(fill < (int32_t)frames) {
+    // wait until enough frames are received:
+    ++underruns;
+    for(size_t c = 0; c < channels; ++c)
+      memset(out[c], 0, frames * sizeof(float));
+    return;
+  }
+  // compensate clock drift by consuming one frame more or less than
+  // the block size. At most one block is read, a dropped frame is
+  // skipped without reading it:
+  meanfill += 0.01f * ((float)fill - meanfill);
+  int32_t adjust(0);
+  if((meanfill > (float)(target + frames)) && (fill > (int32_t)frames))
+    adjust = 1;
+  else if(meanfill < (float)target - (float)frames)
+    adjust = -1;
+  const uint32_t consumed((uint32_t)((int32_t)frames + adjust));
+  meanfill -= (float)adjust;
+  const uint32_t mask(capacity - 1);
+  for(uint32_t k = 0; k < frames; ++k) {
+    // a repeated frame is the last frame of the block:
+    const float* frame(
+        &(data[(size_t)((rpos + std::min(k, consumed - 1u)) & mask) *
+               channels]));
+    for(size_t c = 0; c < channels; ++c)
+      out[c][k] = frame[c];
+  }
+  rpos += consumed;
+  if((int32_t)(we - rpos) > (int32_t)(target + target / 2 + 2 * frames)) {
+    // too many frames, e.g., after a burst of delayed messages:
+    rpos = we - target;
+    meanfill = (float)target;
+  }
+  // reordered messages may be stored only if they are not read in
+  // the next block. Calls of put() are much shorter than one block,
+  // thus a writer does not hold an outdated limit while the next
+  // block is read.
+  wlimit.store(rpos + frames, std::memory_order_release);
+}
+
+size_t netaudio_receiver_t::add_stream(port_t port, size_t channels,
+                                       double buffer, uint32_t srate_)
+{
+  size_t ch0(nchannels);
+  stream_t s;
+  s.port = port;
+  s.srate = srate_;
+  s.buffer.reset(new netaudio_jitterbuffer_t(
+      channels, (uint32_t)(0.001 * buffer * (double)srate_)));
+  streams.push_back(std::move(s));
+  nchannels += channels;
+  return ch0;
+}
+
+bool netaudio_receiver_t::receive(port_t port, const char* msg, size_t len)
+{
+  for(auto& s : streams)
+    if(s.port == port) {
+      netaudio_packet_t pkt;
+      // messages of other sampling rates are ignored, they would be
+      // played back with wrong pitch:
+      if(netaudio_decode(msg, len, pkt) && (pkt.srate == s.srate))
+        s.buffer->put(pkt);
+      else
+        ++invalid;
+      return true;
+    }
+  return false;
+}
+
+void netaudio_receiver_t::process(float* const* out, uint32_t frames)
+{
+  for(auto& s : streams) {
+    s.buffer->get(out, frames);
+    out += s.buffer->get_channels();
+  }
+}
+
+size_t netaudio_receiver_t::get_underruns() const
+{
+  size_t n(0);
+  for(auto& s : streams)
+    n += s.buffer->underruns;
+  return n;
+}
+
+netaudio_sender_t::netaudio_sender_t(size_t channels_,
+                                     netaudio_format_t format_,
+                                     uint32_t srate_, bool inplace_)
+    : channels(channels_), format(format_), srate(srate_), inplace(inplace_),
+      chptr(channels_), slots(NETAUDIO_SENDQUEUE * BUFSIZE)
+{
+#ifdef __APPLE__
+  sem = dispatch_semaphore_create(0);
+#else
+  if(sem_init(&sem, 0, 0) != 0)
+    throw ErrMsg("Unable to create semaphore of network audio sender.");
+#endif
+}
+
+netaudio_sender_t::~netaudio_sender_t()
+{
+  stop();
+#ifdef __APPLE__
+  dispatch_release(sem);
+#else
+  sem_destroy(&sem);
+#endif
+}
+
+void netaudio_sender_t::wakeup()
+{
+#ifdef __APPLE__
+  dispatch_semaphore_signal(sem);
+#else
+  sem_post(&sem);
+#endif
+}
+
+void netaudio_sender_t::wait_wakeup(int timeout_ms)
+{
+#ifdef __APPLE__
+  dispatch_semaphore_wait(
+      sem, dispatch_time(DISPATCH_TIME_NOW, (int64_t)timeout_ms * 1000000));
+#else
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  ts.tv_nsec += (long)timeout_ms * 1000000l;
+  ts.tv_sec += ts.tv_nsec / 1000000000l;
+  ts.tv_nsec %= 1000000000l;
+  sem_timedwait(&sem, &ts);
+#endif
+}
+
+void netaudio_sender_t::start(netaudio_send_cb_t cb_, void* data, int prio)
+{
+  stop();
+  cb = cb_;
+  cbdata = data;
+  running = true;
+  thread = std::thread(&netaudio_sender_t::sendsrv, this, prio);
+}
+
+void netaudio_sender_t::stop()
+{
+  if(!running)
+    return;
+  running = false;
+  wakeup();
+  if(thread.joinable())
+    thread.join();
+}
+
+void netaudio_sender_t::process(const float* const* in, uint32_t frames)
+{
+  const size_t framesize(channels * netaudio_sample_size(format));
+  const uint32_t maxframes(
+      (uint32_t)std::max((size_t)1u, NETAUDIO_MAXPAYLOAD / framesize));
+  const size_t offset(inplace ? HEADERLEN : 0u);
+  bool queued(false);
+  for(uint32_t k = 0; k < frames; k += maxframes) {
+    const uint32_t n(std::min(maxframes, frames - k));
+    const uint32_t tail(qtail.load(std::memory_order_relaxed));
+    if(!running ||
+       (tail - qhead.load(std::memory_order_acquire) >= NETAUDIO_SENDQUEUE)) {
+      ++dropped;
+    } else {
+      const size_t idx(tail % NETAUDIO_SENDQUEUE);
+      for(size_t c = 0; c < channels; ++c)
+        chptr[c] = in[c] + k;
+      slotlen[idx] = netaudio_encode(&(slots[idx * BUFSIZE + offset]),
+                                     NETAUDIO_MAXLEN, format, channels, n,
+                                     frame + k, srate, chptr.data());
+      qtail.store(tail + 1u, std::memory_order_release);
+      queued = true;
+    }
+  }
+  frame += frames;
+  // the semaphore counts the wakeups, so none is lost if the sending
+  // thread is not waiting yet:
+  if(queued)
+    wakeup();
+}
+
+void netaudio_sender_t::sendsrv(int prio)
+{
+  set_thread_prio((unsigned int)prio);
+  uint32_t head(qhead.load(std::memory_order_relaxed));
+  while(running) {
+    if(head == qtail.load(std::memory_order_acquire))
+      wait_wakeup(100);
+    while(head != qtail.load(std::memory_order_acquire)) {
+      const size_t idx(head % NETAUDIO_SENDQUEUE);
+      if(slotlen[idx])
+        cb(&(slots[idx * BUFSIZE]), slotlen[idx], inplace, cbdata);
+      qhead.store(++head, std::memory_order_release);
+    }
+  }
+}
+
+bool netaudio_receiver_t::receive_cb(port_t port, const char* msg, size_t len,
+                                     void* data)
+{
+  return ((netaudio_receiver_t*)data)->receive(port, msg, len);
+}
+
+/*
+ * Local Variables:
+ * mode: c++
+ * compile-command: "make -C .."
+ * End:
+ */
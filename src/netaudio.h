@@ -0,0 +1,386 @@
+/*
+ * This file is part of the ovbox software tool, see <http://orlandoviols.com/>.
+ *
+ * Copyright (c) 2021 Giso Grimm
+ */
+/*
+ * ovbox is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published
+ * by the Free Software Foundation, version 3 of the License.
+ *
+ * ovbox is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License, version 3 for more details.
+ *
+ * You should have received a copy of the GNU General Public License,
+ * Version 3 along with ovbox. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef NETAUDIO_H
+#define NETAUDIO_H
+
+#include "common.h"
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+#ifdef __APPLE__
+#include <dispatch/dispatch.h>
+#else
+#include <semaphore.h>
+#endif
+
+/**
+ * @defgroup netaudio Network audio
+ *
+ * Audio streams which are sent and received within the ovbox process,
+ * as an alternative to external zita-njbridge processes.
+ *
+ * Each message contains a block of interleaved samples of all
+ * channels, preceded by a header of NETAUDIO_HEADERLEN bytes:
+ *
+ * | Offset | Size | Content                                  |
+ * | ------ | ---- | ---------------------------------------- |
+ * | 0      | 1    | protocol version NETAUDIO_VERSION        |
+ * | 1      | 1    | sample format, see netaudio_format_t     |
+ * | 2      | 1    | number of channels                       |
+ * | 3      | 1    | reserved                                 |
+ * | 4      | 2    | number of frames                         |
+ * | 6      | 2    | reserved                                 |
+ * | 8      | 4    | frame counter of first frame             |
+ * | 12     | 4    | sampling rate in Hz                      |
+ *
+ * All numbers and samples are little endian.
+ *
+ * The format is not compatible with zita-njbridge. It is used only
+ * between peers which announce it in their features (CAP_NETAUDIO_RX
+ * and CAP_NETAUDIO_TX, see epcaps_t); streams of all other peers are
+ * exchanged with zita-njbridge processes.
+ */
+
+/// @ingroup netaudio
+#define NETAUDIO_VERSION 1
+/// @ingroup netaudio
+#define NETAUDIO_HEADERLEN 16
+/**
+ * @ingroup netaudio
+ * Maximum number of bytes of a network audio message
+ */
+#define NETAUDIO_MAXLEN (BUFSIZE - HEADERLEN)
+/**
+ * @ingroup netaudio
+ * Maximum number of bytes of samples in a message of a sender, to
+ * avoid IP fragmentation. Larger blocks are sent in several messages.
+ */
+#define NETAUDIO_MAXPAYLOAD 1400
+/**
+ * @ingroup netaudio
+ * Number of messages which can be queued by a sender
+ */
+#define NETAUDIO_SENDQUEUE 32
+
+/**
+ * @ingroup netaudio
+ * Sample formats
+ */
+enum netaudio_format_t {
+  NETAUDIO_16BIT = 1,
+  NETAUDIO_24BIT = 2,
+  NETAUDIO_FLOAT = 3
+};
+
+/**
+ * @ingroup netaudio
+ * Return the sample format of a name as used for zita-njbridge.
+ *
+ * @param name "16bit", "24bit" or "float"
+ *
+ * Throws an exception of type ErrMsg for unknown names.
+ */
+netaudio_format_t netaudio_format(const std::string& name);
+
+/**
+ * @ingroup netaudio
+ * Return the number of bytes per sample of a sample format, or zero
+ * for invalid formats.
+ */
+size_t netaudio_sample_size(uint8_t format);
+
+/**
+ * @ingroup netaudio
+ * Decoded header of a network audio message.
+ */
+struct netaudio_packet_t {
+  uint8_t format = 0;
+  uint8_t channels = 0;
+  uint16_t frames = 0;
+  /// Frame counter of first frame
+  uint32_t frame = 0;
+  uint32_t srate = 0;
+  /// Start of samples
+  const char* data = nullptr;
+};
+
+/**
+ * @ingroup netaudio
+ * Decode a network audio message.
+ *
+ * @param msg Message
+ * @param len Length of message
+ * @param[out] pkt Decoded header
+ * @return True if the message is a valid network audio message
+ */
+bool netaudio_decode(const char* msg, size_t len, netaudio_packet_t& pkt);
+
+/**
+ * @ingroup netaudio
+ * Encode a network audio message.
+ *
+ * @param buf Memory area where the message is stored
+ * @param len Size of memory area
+ * @param format Sample format
+ * @param channels Number of channels
+ * @param frames Number of frames
+ * @param frame Frame counter of first frame
+ * @param srate Sampling rate in Hz
+ * @param audio Audio data, one array of frames per channel
+ * @return Length of message, or zero if it does not fit into the buffer
+ */
+size_t netaudio_encode(char* buf, size_t len, netaudio_format_t format,
+                       size_t channels, size_t frames, uint32_t frame,
+                       uint32_t srate, const float* const* audio);
+
+/**
+ * @ingroup netaudio
+ * Jitter buffer of one received audio stream.
+ *
+ * Received blocks are stored at the position of their frame counter,
+ * so reordered messages are sorted implicitly, and lost messages are
+ * replaced by silence. The reader plays back with a delay of the
+ * configured buffer length behind the latest received frame. Clock
+ * drift between sender and receiver is compensated by dropping or
+ * repeating single frames when the mean buffer fill deviates from the
+ * target.
+ *
+ * One thread may call put(), and another thread may call get(),
+ * without locking. If the frame counter jumps, e.g., because the
+ * sender was restarted, the buffer is reset by the reader.
+ */
+class netaudio_jitterbuffer_t {
+public:
+  /**
+   * @param channels Number of channels
+   * @param target Buffer length in frames
+   */
+  netaudio_jitterbuffer_t(size_t channels, uint32_t target);
+  netaudio_jitterbuffer_t(const netaudio_jitterbuffer_t&) = delete;
+  /**
+   * Store a received block (writer thread).
+   *
+   * @param pkt Decoded message
+   *
+   * Channels which are not contained in the message are silent,
+   * additional channels are ignored.
+   */
+  void put(const netaudio_packet_t& pkt);
+  /**
+   * Read a block of audio (reader thread).
+   *
+   * @param out One array of frames per channel
+   * @param frames Number of frames
+   */
+  void get(float* const* out, uint32_t frames);
+  size_t get_channels() const { return channels; };
+  /// Number of blocks which were not available in time
+  std::atomic_size_t underruns{0};
+  /// Number of messages which arrived too late for playback
+  std::atomic_size_t late{0};
+  /// Number of buffer resets
+  std::atomic_size_t resets{0};
+
+private:
+  void request_reset(uint32_t frame);
+  const size_t channels;
+  const uint32_t target;
+  // capacity in frames, a power of two:
+  uint32_t capacity;
+  std::vector<float> data;
+  // end of received frames, owned by the writer unless reset is set:
+  std::atomic<uint32_t> wend{0};
+  // first frame which the writer may store, published by the reader:
+  std::atomic<uint32_t> wlimit{0};
+  // reset requested by the writer, performed by the reader:
+  std::atomic<bool> reset{true};
+  std::atomic<bool> reset_valid{false};
+  std::atomic<uint32_t> reset_frame{0};
+  // read position, owned by the reader:
+  uint32_t rpos = 0;
+  // mean buffer fill in frames:
+  float meanfill = 0.0f;
+};
+
+/**
+ * @ingroup netaudio
+ * Receiver of multiple network audio streams.
+ *
+ * Streams are identified by their local port, see
+ * ovboxclient_t::set_local_receiver_callback(). Messages are passed
+ * to receive() by the network thread, and the audio of all streams is
+ * read with process() by the audio thread.
+ */
+class netaudio_receiver_t {
+public:
+  /**
+   * Add a stream. Streams must be added before audio processing
+   * starts.
+   *
+   * @param port Local port of the stream
+   * @param channels Number of channels
+   * @param buffer Buffer length in milliseconds
+   * @param srate Sampling rate of the receiver in Hz
+   * @return Index of first output channel of the stream
+   *
+   * Messages with a different sampling rate are ignored.
+   */
+  size_t add_stream(port_t port, size_t channels, double buffer,
+                    uint32_t srate);
+  /**
+   * Process a received message (network thread).
+   *
+   * @param port Local destination port
+   * @param msg Message
+   * @param len Length of message
+   * @return True if a stream with this port exists
+   */
+  bool receive(port_t port, const char* msg, size_t len);
+  /**
+   * Read a block of all streams (audio thread).
+   *
+   * @param out One array of frames per output channel, in the order
+   * of the streams
+   * @param frames Number of frames
+   */
+  void process(float* const* out, uint32_t frames);
+  /// Total number of output channels of all streams
+  size_t get_channels() const { return nchannels; };
+  /// Sum of underruns of all streams
+  size_t get_underruns() const;
+  /// Number of messages which could not be decoded
+  std::atomic_size_t invalid{0};
+  /**
+   * Callback for ovboxclient_t::set_local_receiver_callback()
+   */
+  static bool receive_cb(port_t port, const char* msg, size_t len,
+                         void* data);
+
+private:
+  struct stream_t {
+    port_t port;
+    uint32_t srate;
+    std::unique_ptr<netaudio_jitterbuffer_t> buffer;
+  };
+  std::vector<stream_t> streams;
+  size_t nchannels = 0;
+};
+
+/**
+ * @ingroup netaudio
+ * Function which sends the messages of a netaudio_sender_t.
+ *
+ * Arguments are the buffer of BUFSIZE bytes, the length of the
+ * message, a flag which is true if the message starts at HEADERLEN
+ * bytes after the start of the buffer (otherwise at the start), and
+ * the user data. The buffer may be modified. See
+ * ovboxclient_t::send_local_cb().
+ */
+typedef std::function<void(char*, size_t, bool, void*)> netaudio_send_cb_t;
+
+/**
+ * @ingroup netaudio
+ * Sender of a network audio stream.
+ *
+ * The audio thread encodes blocks into a queue of message buffers
+ * with process(), and a sending thread passes the messages to a send
+ * function. In the default mode, messages are encoded behind HEADERLEN
+ * bytes of headroom, so the send function can pack the header of the
+ * network protocol without copying the message. The audio thread
+ * wakes the sending thread with a semaphore, so it never waits for a
+ * lock. The stream is sent to all peers, so it is used only if all
+ * peers announce CAP_NETAUDIO_RX.
+ */
+class netaudio_sender_t {
+public:
+  /**
+   * @param channels Number of channels
+   * @param format Sample format
+   * @param srate Sampling rate in Hz
+   * @param inplace Encode messages with headroom for the header
+   */
+  netaudio_sender_t(size_t channels, netaudio_format_t format, uint32_t srate,
+                    bool inplace = true);
+  ~netaudio_sender_t();
+  netaudio_sender_t(const netaudio_sender_t&) = delete;
+  /**
+   * Start the sending thread.
+   *
+   * @param cb Send function
+   * @param data User data of send function
+   * @param prio Real-time priority of sending thread
+   */
+  void start(netaudio_send_cb_t cb, void* data, int prio);
+  /**
+   * Stop the sending thread. Blocks which are processed afterwards
+   * are dropped.
+   */
+  void stop();
+  /**
+   * Encode a block of audio (audio thread).
+   *
+   * @param in One array of frames per channel
+   * @param frames Number of frames
+   */
+  void process(const float* const* in, uint32_t frames);
+  size_t get_channels() const { return channels; };
+  /// Number of messages which were dropped since the queue was full
+  std::atomic_size_t dropped{0};
+
+private:
+  void sendsrv(int prio);
+  // wake up the sending thread, without blocking:
+  void wakeup();
+  // wait for a wakeup or a timeout:
+  void wait_wakeup(int timeout_ms);
+  const size_t channels;
+  const netaudio_format_t format;
+  const uint32_t srate;
+  const bool inplace;
+  // frame counter of next block:
+  uint32_t frame = 0;
+  std::vector<const float*> chptr;
+  // queue of message buffers, BUFSIZE bytes each:
+  std::vector<char> slots;
+  size_t slotlen[NETAUDIO_SENDQUEUE];
+  std::atomic<uint32_t> qhead{0};
+  std::atomic<uint32_t> qtail{0};
+#ifdef __APPLE__
+  dispatch_semaphore_t sem;
+#else
+  sem_t sem;
+#endif
+  std::atomic<bool> running{false};
+  std::thread thread;
+  netaudio_send_cb_t cb = nullptr;
+  void* cbdata = nullptr;
+};
+
+#endif
+
+/*
+ * Local Variables:
+ * mode: c++
+ * compile-command: "make -C .."
+ * End:
+ */
@@ -19,6 +19,7 @@
 
 #include "ov_render_tascar.h"
 #include "soundcardtools.h"
+#include <algorithm>
 #include <fstream>
 #include <iostream>
 #include <jack/jack.h>
@@ -394,7 +395,8 @@ ov_render_tascar_t::ov_render_tascar_t(const std::string& deviceid,
       inputports({"system:capture_1", "system:capture_2"}),
       headtrack_tauref(33.315f), zitapath(ZITAPATH), is_proxy(false),
       use_proxy(false), cb_seqerr(nullptr), cb_seqerr_data(nullptr),
-      sorter_deadline(5.0), expedited_forwarding_PHB(false),
+      sorter_deadline(5.0), sorter_depth(0), reactor_threads(0),
+      use_uring(false), expedited_forwarding_PHB(false),
       render_soundscape(true), jackrec_fileformat("WAV"),
       jackrec_sampleformat("PCM_16"), secondary(secondary_)
 {
@@ -443,19 +445,14 @@ void ov_render_tascar_t::add_secondary_bus(const stage_device_t& stagemember,
   std::string clientname(get_stagedev_name(stagemember.id) + "_sec");
   std::string netclientname("n2j_" + std::to_string(stagemember.id) + "_sec");
   if(!stagemember.nozita) {
-    tsccfg::node_t e_sys(tsccfg::node_add_child(e_mods, "system"));
     double buff(thisdev.receiverjitter + stagemember.senderjitter);
-    tsccfg::node_set_attribute(e_sys, "noshell", "true");
-    tsccfg::node_set_attribute(e_sys, "sleep", "0.2");
-    tsccfg::node_set_attribute(
-        e_sys, "command",
-        zitapath + "ovzita-n2j --chan " + chanlist + " --jname " +
-            netclientname + "." + stage.thisdeviceid + " --buf " +
-            TASCAR::to_string(stage.rendersettings.secrec + buff) +
-            " 0.0.0.0 " +
-            TASCAR::to_string(get_zitaport_(stagemember.id, portoffset, 100)));
+    add_audio_receiver(
+        e_mods, stagemember.id, netclientname + "." + stage.thisdeviceid,
+        chanlist,
+        stagemember.senddownmix ? 2u : stagemember.channels.size(),
+        stage.rendersettings.secrec + buff,
+        get_zitaport_(stagemember.id, portoffset, 100));
   }
-  // tsccfg::node_set_attribute(e_sys, "onunload", "killall ovzita-n2j");
   // create also a route with correct gain settings:
   tsccfg::node_t e_route(tsccfg::node_add_child(e_mods, "route"));
   tsccfg::node_set_attribute(e_route, "name", clientname);
@@ -468,8 +465,10 @@ void ov_render_tascar_t::add_secondary_bus(const stage_device_t& stagemember,
   if(!stagemember.nozita) {
     for(size_t c = 0; c < stagemember.channels.size(); ++c) {
       if(stage.thisstagedeviceid != stagemember.id) {
-        std::string srcport(netclientname + "." + stage.thisdeviceid + ":out_" +
-                            std::to_string(c + 1));
+        std::string srcport(
+            get_receiver_port(stagemember.id,
+                              netclientname + "." + stage.thisdeviceid,
+                              std::to_string(c + 1)));
         std::string destport(clientname + ":in." + std::to_string(c));
         waitports.push_back(srcport);
         session_add_connect(e_session, srcport, destport);
@@ -505,19 +504,12 @@ void ov_render_tascar_t::add_network_receiver(
       n2jclientname = "n2j_" + n2jclientname;
     }
     if(!stagemember.nozita) {
-      tsccfg::node_t e_sys(tsccfg::node_add_child(e_mods, "system"));
-      tsccfg::node_set_attribute(e_sys, "sleep", "0.2");
-      tsccfg::node_set_attribute(e_sys, "noshell", "true");
       double buff(thisdev.receiverjitter + stagemember.senderjitter);
-      // provide access to path!
-      tsccfg::node_set_attribute(
-          e_sys, "command",
-          zitapath + "ovzita-n2j --chan " + chanlist + " --jname " +
-              n2jclientname + " --buf " + TASCAR::to_string(buff) +
-              " 0.0.0.0 " +
-              TASCAR::to_string(get_zitaport_(stagemember.id, portoffset)));
+      add_audio_receiver(
+          e_mods, stagemember.id, n2jclientname, chanlist,
+          stagemember.senddownmix ? 2u : stagemember.channels.size(), buff,
+          get_zitaport_(stagemember.id, portoffset));
     }
-    // tsccfg::node_set_attribute(e_sys, "onunload", "killall ovzita-n2j");
     if(stage.rendersettings.rawmode || stage.thisdevice.receivedownmix) {
       // create additional route for gain control:
       tsccfg::node_t e_route = tsccfg::node_add_child(e_mods, "route");
@@ -531,8 +523,9 @@ void ov_render_tascar_t::add_network_receiver(
       tsccfg::node_set_attribute(
           e_route, "gain", TASCAR::to_string(20 * log10(stagemember.gain)));
       if(!stagemember.nozita)
-        tsccfg::node_set_attribute(e_route, "connect",
-                                   n2jclientname + ":out_.*");
+        tsccfg::node_set_attribute(
+            e_route, "connect",
+            get_receiver_port(stagemember.id, n2jclientname, ".*"));
       for(size_t c = 0; c < memchannels; ++c) {
         ++chcnt;
         if(stage.thisstagedeviceid != stagemember.id) {
@@ -548,8 +541,9 @@ void ov_render_tascar_t::add_network_receiver(
             session_add_connect(e_session, srcport, destport);
           }
           if(!stagemember.nozita)
-            waitports.push_back(n2jclientname + ":out_" +
-                                std::to_string(c + 1));
+            waitports.push_back(
+                get_receiver_port(stagemember.id, n2jclientname,
+                                  std::to_string(c + 1)));
         }
       }
     } else {
@@ -559,8 +553,9 @@ void ov_render_tascar_t::add_network_receiver(
         size_t portnamenumber = 0;
         for(size_t c = 0; c < stagemember.channels.size(); ++c) {
           if(stage.thisstagedeviceid != stagemember.id) {
-            std::string srcport(n2jclientname + ":out_" +
-                                std::to_string(c + 1));
+            std::string srcport(
+                get_receiver_port(stagemember.id, n2jclientname,
+                                  std::to_string(c + 1)));
             std::string destport;
             if(stagemember.channels[c].name.empty()) {
               destport = stage.thisdeviceid + ".main:" + clientname + "." +
@@ -585,6 +580,119 @@ void ov_render_tascar_t::add_network_receiver(
   }
 }
 
+void ov_render_tascar_t::add_audio_receiver(tsccfg::node_t& e_mods,
+                                            stage_device_id_t cid,
+                                            const std::string& jname,
+                                            const std::string& chanlist,
+                                            size_t channels, double buffer,
+                                            port_t port)
+{
+  if(netaudio && (netaudio_rx & (1u << cid))) {
+    netaudio->add_receiver(port, jname, channels, buffer);
+    return;
+  }
+  tsccfg::node_t e_sys(tsccfg::node_add_child(e_mods, "system"));
+  tsccfg::node_set_attribute(e_sys, "sleep", "0.2");
+  tsccfg::node_set_attribute(e_sys, "noshell", "true");
+  // provide access to path!
+  tsccfg::node_set_attribute(e_sys, "command",
+                             zitapath + "ovzita-n2j --chan " + chanlist +
+                                 " --jname " + jname + " --buf " +
+                                 TASCAR::to_string(buffer) + " 0.0.0.0 " +
+                                 TASCAR::to_string(port));
+  // tsccfg::node_set_attribute(e_sys, "onunload", "killall ovzita-n2j");
+}
+
+std::string
+ov_render_tascar_t::get_receiver_port(stage_device_id_t cid,
+                                      const std::string& jname,
+                                      const std::string& channel) const
+{
+  if(netaudio && (netaudio_rx & (1u << cid)))
+    return netaudio->get_client_name() + ":" + jname + ".out_" + channel;
+  return jname + ":out_" + channel;
+}
+
+void ov_render_tascar_t::add_audio_sender(tsccfg::node_t& e_mods,
+                                          size_t channels)
+{
+  if(netaudio && netaudio_tx) {
+    netaudio->add_sender("sender", channels,
+                         netaudio_format(zitasampleformat));
+    return;
+  }
+  tsccfg::node_t e_sys(tsccfg::node_add_child(e_mods, "system"));
+  tsccfg::node_set_attribute(e_sys, "sleep", "0.2");
+  tsccfg::node_set_attribute(e_sys, "noshell", "true");
+  tsccfg::node_set_attribute(
+      e_sys, "command",
+      zitapath + "ovzita-j2n --chan " + std::to_string(channels) +
+          " --jname " + stage.thisdeviceid + "_sender --" + zitasampleformat +
+          " 127.0.0.1 " +
+          std::to_string(get_zitaport_(stage.thisstagedeviceid, portoffset)));
+  // tsccfg::node_set_attribute(e_sys, "onunload", "killall ovzita-j2n");
+}
+
+void ov_render_tascar_t::get_netaudio_formats(bool& tx, uint32_t& rx) const
+{
+  // there is only one stream for all peers, so send in the format of
+  // network audio only if all peers announced that they can receive
+  // it:
+  tx = netaudio_enabled;
+  for(stage_device_id_t cid = 0; cid < MAX_STAGE_ID; ++cid)
+    if(netaudio_members & (1u << cid)) {
+      auto caps(peer_caps.find(cid));
+      if((caps == peer_caps.end()) || (!(caps->second & CAP_NETAUDIO_RX)))
+        tx = false;
+    }
+  rx = 0;
+  if(!netaudio_rx_enabled)
+    return;
+  // only streams of peers which announced that they send in the
+  // format of network audio, all others are received by ovzita-n2j:
+  for(const auto& caps : peer_caps)
+    if((caps.first < MAX_STAGE_ID) && (caps.second & CAP_NETAUDIO_TX))
+      rx |= 1u << caps.first;
+}
+
+void ov_render_tascar_t::caps_cb(stage_device_id_t cid, epcaps_t caps,
+                                 void* data)
+{
+  ov_render_tascar_t* self((ov_render_tascar_t*)data);
+  std::lock_guard<std::mutex> lk(self->mtx_peer_caps);
+  self->peer_caps[cid] = caps;
+  bool tx(false);
+  uint32_t rx(0);
+  self->get_netaudio_formats(tx, rx);
+  if((tx != self->netaudio_tx) || (rx != self->netaudio_rx)) {
+    TASCAR::console_log("Network audio formats of peers changed.");
+    self->require_session_restart();
+  }
+}
+
+double ov_render_tascar_t::get_aggregation_window() const
+{
+  if(!aggregate)
+    return 0.0;
+  if(aggregate_window > 0.0f)
+    return aggregate_window;
+  // the senders send their blocks right after each audio period, so
+  // a fraction of a period is enough to collect them:
+  double window(1.0);
+  if(audiodevice.srate > 0)
+    window = std::min(
+        window, 0.25 * 1000.0 * audiodevice.periodsize / audiodevice.srate);
+  return window;
+}
+
+std::string ov_render_tascar_t::get_sender_port(size_t channel) const
+{
+  if(netaudio && netaudio_tx)
+    return netaudio->get_client_name() + ":sender.in_" +
+           std::to_string(channel);
+  return stage.thisdeviceid + "_sender:in_" + std::to_string(channel);
+}
+
 tsccfg::node_t ov_render_tascar_t::configure_simplefdn(tsccfg::node_t e_scene)
 {
   // create reverb engine:
@@ -857,30 +965,16 @@ void ov_render_tascar_t::create_virtual_acoustics(tsccfg::node_t e_session,
     metronome.set_xmlattr(tsccfg::node_add_child(e_mplug, "metronome"),
                           tsccfg::node_add_child(e_mplug, "delay"));
     // create network sender:
-    if(!stage.thisdevice.nozita) {
-      tsccfg::node_t e_sys(tsccfg::node_add_child(e_mods, "system"));
-      tsccfg::node_set_attribute(e_sys, "sleep", "0.2");
-      tsccfg::node_set_attribute(e_sys, "noshell", "true");
-      tsccfg::node_set_attribute(e_sys, "command",
-                                 zitapath + "ovzita-j2n --chan " +
-                                     std::to_string(thisdev.channels.size()) +
-                                     " --jname " + stage.thisdeviceid +
-                                     "_sender --" + zitasampleformat +
-                                     " 127.0.0.1 " +
-                                     std::to_string(get_zitaport_(
-                                         stage.thisstagedeviceid, portoffset)));
-    }
-    // tsccfg::node_set_attribute(e_sys, "onunload", "killall ovzita-j2n");
+    if(!stage.thisdevice.nozita)
+      add_audio_sender(e_mods, thisdev.channels.size());
     int chn(0);
     for(auto ch : thisdev.channels) {
       ++chn;
       if(!stage.thisdevice.nozita) {
         session_add_connect(e_session, get_channel_source(ch),
-                            stage.thisdeviceid + "_sender:in_" +
-                                std::to_string(chn));
+                            get_sender_port(chn));
         session_add_connect(e_session, stage.thisdeviceid + ".metronome:out.0",
-                            stage.thisdeviceid + "_sender:in_" +
-                                std::to_string(chn));
+                            get_sender_port(chn));
       }
       if(stage.rendersettings.receive &&
          (chn - 1 < (int)(ego_source_names.size())))
@@ -888,28 +982,18 @@ void ov_render_tascar_t::create_virtual_acoustics(tsccfg::node_t e_session,
                             stage.thisdeviceid +
                                 ".main:" + ego_source_names[chn - 1]);
       if(!stage.thisdevice.nozita) {
-        waitports.push_back(stage.thisdeviceid + "_sender:in_" +
-                            std::to_string(chn));
+        waitports.push_back(get_sender_port(chn));
       }
     }
   }
   if(stage.thisdevice.senddownmix && stage.rendersettings.receive &&
      (!stage.thisdevice.nozita)) {
     // create network sender:
-    tsccfg::node_t e_sys(tsccfg::node_add_child(e_mods, "system"));
-    tsccfg::node_set_attribute(e_sys, "sleep", "0.2");
-    tsccfg::node_set_attribute(e_sys, "noshell", "true");
-    tsccfg::node_set_attribute(
-        e_sys, "command",
-        zitapath + "ovzita-j2n --chan " + std::to_string(2) + " --jname " +
-            stage.thisdeviceid + "_sender --" + zitasampleformat +
-            " 127.0.0.1 " +
-            std::to_string(get_zitaport_(stage.thisstagedeviceid, portoffset)));
-    // tsccfg::node_set_attribute(e_sys, "onunload", "killall ovzita-j2n");
+    add_audio_sender(e_mods, 2);
     session_add_connect(e_session, stage.thisdeviceid + ".main:main_l",
-                        stage.thisdeviceid + "_sender:in_1");
+                        get_sender_port(1));
     session_add_connect(e_session, stage.thisdeviceid + ".main:main_r",
-                        stage.thisdeviceid + "_sender:in_2");
+                        get_sender_port(2));
   }
   session_add_waitforjackports(e_mods, stage.thisdeviceid + ".waitforports",
                                waitports, true);
@@ -1083,27 +1167,14 @@ void ov_render_tascar_t::create_raw_dev(tsccfg::node_t e_session)
     }
   }
   if(thisdev.channels.size() > 0) {
-    tsccfg::node_t e_sys = tsccfg::node_add_child(e_mods, "system");
-    tsccfg::node_set_attribute(e_sys, "sleep", "0.2");
-    tsccfg::node_set_attribute(e_sys, "noshell", "true");
-    tsccfg::node_set_attribute(
-        e_sys, "command",
-        zitapath + "ovzita-j2n --chan " +
-            std::to_string(thisdev.channels.size()) + " --jname " +
-            stage.thisdeviceid + "_sender --" + zitasampleformat +
-            " 127.0.0.1 " +
-            std::to_string(get_zitaport_(stage.thisstagedeviceid, portoffset)));
-    // tsccfg::node_set_attribute(e_sys, "onunload", "killall ovzita-j2n");
+    add_audio_sender(e_mods, thisdev.channels.size());
     int chn(0);
     for(auto ch : thisdev.channels) {
       ++chn;
       tsccfg::node_t e_port = tsccfg::node_add_child(e_session, "connect");
       tsccfg::node_set_attribute(e_port, "src", get_channel_source(ch));
-      tsccfg::node_set_attribute(e_port, "dest",
-                                 stage.thisdeviceid + "_sender:in_" +
-                                     std::to_string(chn));
-      waitports.push_back(stage.thisdeviceid + "_sender:in_" +
-                          std::to_string(chn));
+      tsccfg::node_set_attribute(e_port, "dest", get_sender_port(chn));
+      waitports.push_back(get_sender_port(chn));
     }
   }
   session_add_waitforjackports(e_mods, stage.thisdeviceid + ".waitforports",
@@ -1208,6 +1279,26 @@ void ov_render_tascar_t::start_session()
   // #endif
   //  do whatever needs to be done in base class:
   ov_render_base_t::start_session();
+  if(netaudio) {
+    // left over from a failed session start:
+    delete netaudio;
+    netaudio = NULL;
+  }
+  if(native_audio && (!stage.host.empty()))
+    netaudio = new jack_netaudio_t(stage.thisdeviceid + ".net");
+  {
+    std::lock_guard<std::mutex> lk(mtx_peer_caps);
+    netaudio_enabled = (netaudio != NULL);
+    // proxy clients receive the streams from the proxy directly in
+    // the ovzita-n2j processes:
+    netaudio_rx_enabled = netaudio_enabled && (!use_proxy);
+    netaudio_members = 0;
+    for(const auto& dev : stage.stage)
+      if((dev.second.id != stage.thisstagedeviceid) && (!dev.second.nozita) &&
+         (dev.second.id < MAX_STAGE_ID))
+        netaudio_members |= 1u << dev.second.id;
+    get_netaudio_formats(netaudio_tx, netaudio_rx);
+  }
   // xml code for TASCAR configuration:
   TASCAR::xml_doc_t tsc;
   // default TASCAR session settings:
@@ -1410,9 +1501,29 @@ void ov_render_tascar_t::start_session()
         stage.thisdevice.receivedownmix,
         stage.stage[stage.thisstagedeviceid].sendlocal, sorter_deadline,
         stage.thisdevice.senddownmix, use_proxy,
-        stage.rendersettings.usetcptunnel, stage.rendersettings.encryption);
+        stage.rendersettings.usetcptunnel, stage.rendersettings.encryption,
+        reactor_threads, use_uring);
     if(cb_seqerr)
       ovboxclient->set_seqerr_callback(cb_seqerr, cb_seqerr_data);
+    ovboxclient->set_reorder_depth(sorter_depth);
+    ovboxclient->set_aggregation(get_aggregation_window());
+    ovboxclient->set_fec(fec_group);
+    ovboxclient->set_redundancy(redundant);
+    ovboxclient->set_path_selection(path_selection);
+    ovboxclient->set_uplink_limit(uplink_limit);
+    if(netaudio) {
+      ovboxclient->set_local_receiver_callback(&netaudio_receiver_t::receive_cb,
+                                               &(netaudio->receiver));
+      epcaps_t caps(0);
+      if(netaudio_rx_enabled)
+        caps |= CAP_NETAUDIO_RX;
+      if(netaudio_tx)
+        caps |= CAP_NETAUDIO_TX;
+      ovboxclient->set_caps(caps);
+      ovboxclient->set_caps_callback(&ov_render_tascar_t::caps_cb, this);
+    }
+    if(netaudio && netaudio->sender)
+      netaudio->sender->start(&ovboxclient_t::send_local_cb, ovboxclient, 30);
     if(stage.rendersettings.secrec > 0)
       ovboxclient->add_extraport(100);
     for(auto p : stage.rendersettings.xrecport)
@@ -1425,6 +1536,10 @@ void ov_render_tascar_t::start_session()
     for(auto proxyclient : proxyclients) {
       ovboxclient->add_proxy_client(proxyclient.first, proxyclient.second);
     }
+    if(is_proxy && !proxyclients.empty())
+      ovboxclient->set_proxy_multicast(proxymcaddr, true);
+    else if(use_proxy)
+      ovboxclient->set_proxy_multicast(proxymcaddr, false);
     // update ping timimng:
     ovboxclient->set_hiresping(stage.thisdevice.hiresping);
   }
@@ -1556,6 +1671,8 @@ void ov_render_tascar_t::start_session()
     tsccfg::node_set_attribute(e_midi, "pattern", TASCAR::vecstr2str(pattern));
   }
   tsc.save(folder + "ovbox_debugsession.tsc");
+  if(netaudio)
+    netaudio->activate();
   tascar = new TASCAR::session_t(tsc.save_to_string(),
                                  TASCAR::session_t::LOAD_STRING, "");
   try {
@@ -1581,11 +1698,17 @@ void ov_render_tascar_t::start_session()
     tascar = NULL;
     delete del_tascar;
     std::lock_guard<std::mutex> lock(mtx_ovboxclient);
+    if(netaudio && netaudio->sender)
+      netaudio->sender->stop();
     if(ovboxclient) {
       auto del_ovboxclient = ovboxclient;
       ovboxclient = NULL;
       delete del_ovboxclient;
     }
+    if(netaudio) {
+      delete netaudio;
+      netaudio = NULL;
+    }
     // end_session();
     throw ErrMsg(err);
   }
@@ -1640,11 +1763,20 @@ void ov_render_tascar_t::end_session()
     std::this_thread::sleep_for(std::chrono::milliseconds(500));
   }
   std::lock_guard<std::mutex> lock(mtx_ovboxclient);
+  // the network audio sender uses ovboxclient:
+  if(netaudio && netaudio->sender)
+    netaudio->sender->stop();
   if(ovboxclient) {
     delete ovboxclient;
     ovboxclient = NULL;
     TASCAR::console_log("deleted ovboxclient");
   }
+  // the network audio receiver is used by ovboxclient, thus it is
+  // deleted afterwards:
+  if(netaudio) {
+    delete netaudio;
+    netaudio = NULL;
+  }
   TASCAR::console_log("ended TASCAR session.");
 }
 
@@ -2017,6 +2149,63 @@ void ov_render_tascar_t::set_extra_config(const std::string& js)
           if(ovboxclient)
             ovboxclient->set_reorder_deadline(sorter_deadline);
         }
+        // takes effect when the next session is started:
+        reactor_threads =
+            my_js_value(xcfg["network"], "reactorthreads", reactor_threads);
+        use_uring = my_js_value(xcfg["network"], "iouring", use_uring);
+        UPDATEVAR_RESTART2("network", nativeaudio, native_audio);
+        uint32_t new_depth =
+            my_js_value(xcfg["network"], "reorderdepth", sorter_depth);
+        if(new_depth != sorter_depth) {
+          sorter_depth = new_depth;
+          std::lock_guard<std::mutex> lock(mtx_ovboxclient);
+          if(ovboxclient)
+            ovboxclient->set_reorder_depth(sorter_depth);
+        }
+        bool new_aggregate =
+            my_js_value(xcfg["network"], "aggregate", aggregate);
+        float new_aggregate_window = my_js_value(
+            xcfg["network"], "aggregatewindow", aggregate_window);
+        if((new_aggregate != aggregate) ||
+           (new_aggregate_window != aggregate_window)) {
+          aggregate = new_aggregate;
+          aggregate_window = new_aggregate_window;
+          std::lock_guard<std::mutex> lock(mtx_ovboxclient);
+          if(ovboxclient)
+            ovboxclient->set_aggregation(get_aggregation_window());
+        }
+        uint32_t new_fec_group =
+            my_js_value(xcfg["network"], "fec", fec_group);
+        if(new_fec_group != fec_group) {
+          fec_group = new_fec_group;
+          std::lock_guard<std::mutex> lock(mtx_ovboxclient);
+          if(ovboxclient)
+            ovboxclient->set_fec(fec_group);
+        }
+        bool new_redundant =
+            my_js_value(xcfg["network"], "redundant", redundant);
+        if(new_redundant != redundant) {
+          redundant = new_redundant;
+          std::lock_guard<std::mutex> lock(mtx_ovboxclient);
+          if(ovboxclient)
+            ovboxclient->set_redundancy(redundant);
+        }
+        bool new_path_selection =
+            my_js_value(xcfg["network"], "pathselection", path_selection);
+        if(new_path_selection != path_selection) {
+          path_selection = new_path_selection;
+          std::lock_guard<std::mutex> lock(mtx_ovboxclient);
+          if(ovboxclient)
+            ovboxclient->set_path_selection(path_selection);
+        }
+        float new_uplink_limit =
+            my_js_value(xcfg["network"], "uplinklimit", uplink_limit);
+        if(new_uplink_limit != uplink_limit) {
+          uplink_limit = new_uplink_limit;
+          std::lock_guard<std::mutex> lock(mtx_ovboxclient);
+          if(ovboxclient)
+            ovboxclient->set_uplink_limit(uplink_limit);
+        }
         {
           std::lock_guard<std::mutex> lock(mtx_ovboxclient);
           bool new_expedited_forwarding_PHB = my_js_value(
@@ -2114,13 +2303,17 @@ void ov_render_tascar_t::set_extra_config(const std::string& js)
               cfg_proxyclients[(uint8_t)cfg_proxy_id] = cfg_proxy_ip;
           }
         }
+        std::string cfg_proxymcaddr =
+            my_js_value(xcfg["proxy"], "mcaddr", std::string(""));
         if((cfg_is_proxy != is_proxy) || (cfg_use_proxy != use_proxy) ||
-           (cfg_proxyclients != proxyclients) || (cfg_proxyip != proxyip))
+           (cfg_proxyclients != proxyclients) || (cfg_proxyip != proxyip) ||
+           (cfg_proxymcaddr != proxymcaddr))
           restart_session = true;
         is_proxy = cfg_is_proxy;
         use_proxy = cfg_use_proxy;
         proxyclients = cfg_proxyclients;
         proxyip = cfg_proxyip;
+        proxymcaddr = cfg_proxymcaddr;
       }
       if(xcfg["mcrec"].is_object()) {
         UPDATEVAR_RESTART2("mcrec", use, mczita);
@@ -2162,6 +2355,15 @@ nlohmann::json to_json(const ping_stat_t& ps)
   p["mean"] = ps.t_mean;
   p["received"] = ps.received;
   p["lost"] = ps.lost;
+  // distribution since last report, as list of non-empty buckets
+  // [lower limit, upper limit or null, count]; it can be merged with
+  // other reports by adding the counts of equal buckets:
+  nlohmann::json hist = nlohmann::json::array();
+  for(const auto& bin : ps.hist)
+    hist.push_back({latency_histogram_t::bucket_lower(bin.first),
+                    latency_histogram_t::bucket_upper(bin.first),
+                    bin.second});
+  p["histogram"] = hist;
   return p;
 }
 
@@ -2172,6 +2374,9 @@ nlohmann::json to_json(const message_stat_t& ms)
   p["lost"] = ms.lost;
   p["seqerr"] = ms.seqerr_in;
   p["seqrecovered"] = ms.seqerr_in - ms.seqerr_out;
+  p["fecoverhead"] = ms.fec_overhead;
+  p["fecrecovered"] = ms.fec_recovered;
+  p["duplicates"] = ms.duplicates;
   return p;
 }
 
@@ -2182,6 +2387,7 @@ nlohmann::json to_json(const client_stats_t& ms)
   p["srv"] = to_json(ms.ping_srv);
   p["loc"] = to_json(ms.ping_loc);
   p["packages"] = to_json(ms.packages);
+  p["path"] = ms.path;
   return p;
 }
 
@@ -2194,7 +2400,7 @@ std::string ov_render_tascar_t::get_client_stats()
   else
     client_stats.clear();
   nlohmann::json jsstat;
-  for(auto stat : client_stats)
+  for(const auto& stat : client_stats)
     if(stat.first != stage.thisstagedeviceid)
       jsstat[stat.first] = to_json(stat.second);
   return jsstat.dump();
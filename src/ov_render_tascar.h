@@ -22,6 +22,7 @@
 
 #include "../tascar/libtascar/include/session.h"
 #include "../tascar/libtascar/include/spawn_process.h"
+#include "jacknetaudio.h"
 #include "ov_tools.h"
 #include "ovboxclient.h"
 #include <lo/lo.h>
@@ -117,6 +118,54 @@ private:
                             tsccfg::node_t& e_mods, tsccfg::node_t& e_session,
                             std::vector<std::string>& waitports,
                             uint32_t& chcnt);
+  /**
+   * Add a receiver of the audio of a stage member, either as an
+   * ovzita-n2j process or, if the member sends in the format of
+   * network audio (see get_netaudio_formats()), as a stream of the
+   * jack client of network audio.
+   */
+  void add_audio_receiver(tsccfg::node_t& e_mods, stage_device_id_t cid,
+                          const std::string& jname,
+                          const std::string& chanlist, size_t channels,
+                          double buffer, port_t port);
+  /**
+   * Return the name of an output port of a network audio receiver.
+   *
+   * @param cid Stage device ID of sender
+   * @param jname Name of receiver, see add_audio_receiver()
+   * @param channel Channel number, starting at one, or a pattern
+   */
+  std::string get_receiver_port(stage_device_id_t cid,
+                                const std::string& jname,
+                                const std::string& channel) const;
+  /**
+   * Decide the formats of the network audio streams from the features
+   * of the peers. Requires a lock of mtx_peer_caps.
+   *
+   * @param[out] tx This device sends in the format of network audio
+   * @param[out] rx Bit mask of the stage members whose streams are
+   * received in the format of network audio
+   */
+  void get_netaudio_formats(bool& tx, uint32_t& rx) const;
+  /**
+   * Store the features of a peer, and restart the session if the
+   * formats of the network audio streams change, see
+   * ovboxclient_t::set_caps_callback().
+   */
+  static void caps_cb(stage_device_id_t cid, epcaps_t caps, void* data);
+  /**
+   * Add the sender of the audio of this device, either as an
+   * ovzita-j2n process or, if all peers receive the format of network
+   * audio (see get_netaudio_formats()), as the sender of the jack
+   * client of network audio.
+   */
+  void add_audio_sender(tsccfg::node_t& e_mods, size_t channels);
+  /**
+   * Return the name of an input port of the network audio sender.
+   *
+   * @param channel Channel number, starting at one
+   */
+  std::string get_sender_port(size_t channel) const;
   // for the time being we (optionally if jack is chosen as an audio
   // backend) start the jack backend. This will be replaced by a more
   // generic audio backend interface:
@@ -162,6 +211,11 @@ private:
   */
   bool use_proxy;
   std::string proxyip;
+  /**
+     \brief multicast group of the proxy and its clients, or empty
+     \ingroup proxymode
+   */
+  std::string proxymcaddr;
   std::string localip;
   std::function<void(stage_device_id_t sender, sequence_t expected,
                      sequence_t received, port_t destport, void* data)>
@@ -169,6 +223,53 @@ private:
   void* cb_seqerr_data;
   std::map<stage_device_id_t, client_stats_t> client_stats;
   float sorter_deadline;
+  uint32_t sorter_depth;
+  // number of threads of event-driven network mode, or zero:
+  uint32_t reactor_threads;
+  // use io_uring for network sockets ("iouring"). Experimental, it
+  // copies each received message and is not faster than
+  // sendmmsg()/recvmmsg(), see uring_t:
+  bool use_uring;
+  // receive network audio in this process instead of ovzita-n2j:
+  bool native_audio = false;
+  // jack client of network audio, or NULL:
+  jack_netaudio_t* netaudio = NULL;
+  // features of the peers, see caps_cb(), which are kept across
+  // session restarts, and the network audio formats of the current
+  // session, see get_netaudio_formats():
+  std::mutex mtx_peer_caps;
+  std::map<stage_device_id_t, epcaps_t> peer_caps;
+  bool netaudio_enabled = false;
+  bool netaudio_rx_enabled = false;
+  // bit mask of the stage members which receive the stream of this
+  // device:
+  uint32_t netaudio_members = 0;
+  bool netaudio_tx = false;
+  uint32_t netaudio_rx = 0;
+  // aggregate messages to peers into fewer datagrams:
+  bool aggregate = false;
+  // aggregation window in ms ("aggregatewindow"), or zero for a
+  // quarter of an audio period, but at most 1 ms. Each message is
+  // delayed by up to this window, which adds to the end-to-end
+  // latency:
+  float aggregate_window = 0.0f;
+  // messages per parity message, or zero for no forward error correction:
+  uint32_t fec_group = 0;
+  // send messages to peers also via the server:
+  bool redundant = false;
+  // select the path to each peer from the ping times:
+  bool path_selection = false;
+  // maximum upstream rate in kbit/s, or zero for no limit:
+  float uplink_limit = 0.0f;
+  /**
+   * Return the aggregation window in ms, or zero if aggregation is
+   * off, see ovboxclient_t::set_aggregation().
+   *
+   * Messages are delayed by up to the window, so large windows
+   * increase the latency. Windows longer than one audio period also
+   * delay the messages of a period until the next period.
+   */
+  double get_aggregation_window() const;
   bool expedited_forwarding_PHB;
   bool render_soundscape;
   bool allow_systemmods = false;
@@ -492,7 +492,8 @@ ping_stat_t::ping_stat_t()
 {
 }
 message_stat_t::message_stat_t()
-    : received(0u), lost(0u), seqerr_in(0u), seqerr_out(0u)
+    : received(0u), lost(0u), seqerr_in(0u), seqerr_out(0u), fec_overhead(0u),
+      fec_recovered(0u), duplicates(0u)
 {
 }
 
@@ -502,6 +503,9 @@ void message_stat_t::operator+=(const message_stat_t& src)
   lost += src.lost;
   seqerr_in += src.seqerr_in;
   seqerr_out += src.seqerr_out;
+  fec_overhead += src.fec_overhead;
+  fec_recovered += src.fec_recovered;
+  duplicates += src.duplicates;
 }
 
 void message_stat_t::operator-=(const message_stat_t& src)
@@ -510,6 +514,9 @@ void message_stat_t::operator-=(const message_stat_t& src)
   lost -= src.lost;
   seqerr_in -= src.seqerr_in;
   seqerr_out -= src.seqerr_out;
+  fec_overhead -= src.fec_overhead;
+  fec_recovered -= src.fec_recovered;
+  duplicates -= src.duplicates;
 }
 
 void device_channel_t::update_plugin_cfg(const std::string& jscfg)
@@ -32,6 +32,7 @@
 #ifndef OV_TYPES
 #define OV_TYPES
 
+#include <atomic>
 #include <cstdint>
 #include <iostream>
 #include <map>
@@ -297,6 +298,12 @@ public:
   size_t lost;
   size_t seqerr_in;
   size_t seqerr_out;
+  /// Number of received parity messages, see @ref fec
+  size_t fec_overhead;
+  /// Number of lost messages recovered from parity messages
+  size_t fec_recovered;
+  /// Number of dropped duplicates, e.g., of redundant copies
+  size_t duplicates;
 };
 
 class ping_stat_t {
@@ -310,6 +317,10 @@ public:
   size_t lost;
   size_t state_sent;
   size_t state_received;
+  /// Distribution of ping times received since the last update, as
+  /// bucket index of latency_histogram_t and count of each non-empty
+  /// bucket
+  std::vector<std::pair<uint16_t, uint32_t>> hist;
 };
 
 class client_stats_t {
@@ -319,6 +330,8 @@ public:
   ping_stat_t ping_loc;
   message_stat_t packages;
   message_stat_t state_packages;
+  /// Path of messages to the peer: "p2p", "srv" or "loc"
+  std::string path;
 };
 
 class ov_client_base_t;
@@ -549,7 +562,8 @@ protected:
 private:
   bool session_active;
   bool audio_active;
-  bool restart_needed;
+  // can be set from network threads, see require_session_restart():
+  std::atomic<bool> restart_needed;
 };
 
 // This class manages the communication with the frontend and calls
@@ -22,6 +22,7 @@
 #include "../tascar/libtascar/include/tscconfig.h"
 #include <algorithm>
 #include <condition_variable>
+#include <limits>
 #include <string.h>
 #include <strings.h>
 #if defined(WIN32) || defined(UNDER_CE)
@@ -31,6 +32,7 @@
 #define MSG_CONFIRM 0
 
 #elif defined(LINUX) || defined(linux) || defined(__APPLE__)
+#include <arpa/inet.h>
 #include <ifaddrs.h>
 #include <net/if.h>
 #include <netdb.h>
@@ -43,6 +45,57 @@
 #include <cmath>
 #include <errno.h>
 
+// size of a buffer for an encrypted message:
+#define CMSGSIZE (BUFSIZE + crypto_box_SEALBYTES)
+
+static bool use_reactor(size_t reactor_threads)
+{
+#ifdef HAS_REACTOR
+  return reactor_threads > 0;
+#else
+  return false;
+#endif
+}
+
+#ifdef HAS_REACTOR
+/**
+ * Extra receiver port in event-driven mode.
+ */
+struct xport_t {
+  udpsocket_t sock;
+  port_t destport = 0;
+  local_sender_t sender;
+};
+
+/**
+ * State of the event-driven mode. The buffers are used by the
+ * handlers of one file descriptor each.
+ */
+struct ovboxclient_t::reactor_state_t {
+  reactor_state_t(bool multithreaded) : reactor(multithreaded){};
+  reactor_t reactor;
+  std::vector<std::thread> threads;
+  // messages from relay server and peers:
+  msgbuf_t msg[RECV_BATCHSIZE];
+  // empty message, for releasing held messages after a timeout:
+  msgbuf_t timermsg;
+  // the sorter is used by the receiver and the deadline timer:
+  std::mutex msorter;
+  int sortertimer = -1;
+  // messages from local primary port:
+  local_sender_t sender;
+  // beacons of peers in the local network:
+  msgbuf_t beaconmsg;
+  int pingtimer = -1;
+  int statustimer = -1;
+  // sends aggregated messages:
+  int aggtimer = -1;
+  int timerperiodms = 0;
+  std::mutex mxports;
+  std::vector<std::unique_ptr<xport_t>> xports;
+};
+#endif
+
 /**
  * @defgroup proxymode Proxy mode
  *
@@ -65,6 +118,15 @@
  * locally as unencoded messages, and forwarded as unencoded messages
  * to the proxy clients if the message arrived from outside the local
  * network, see ovboxclient_t::process_msg().
+ *
+ * Optionally the proxy sends these messages only once to a multicast
+ * group of the session, which all proxy clients join, see
+ * ovboxclient_t::set_proxy_multicast(). The multicast group is
+ * provided by the configuration server as "mcaddr" in the proxy
+ * settings. Messages of proxy clients which are relayed by the server
+ * are still sent to each other client, since the group would deliver
+ * them back to their sender, see
+ * ovboxclient_t::forward_to_proxy_clients().
  */
 
 /**
@@ -87,10 +149,15 @@ ovboxclient_t::ovboxclient_t(std::string desthost, port_t destport,
                              bool peer2peer_, bool donotsend_,
                              bool receivedownmix_, bool sendlocal_,
                              double deadline, bool senddownmix, bool usingproxy,
-                             bool use_tcp_tunnel, bool encryption)
-    : prio(prio), remote_server(secret, callerid), toport(destport),
-      recport(recport), portoffset(portoffset), callerid(callerid),
-      runsession(true), mode(0), sendlocal(sendlocal_), last_tx(0), last_rx(0),
+                             bool use_tcp_tunnel, bool encryption,
+                             size_t reactor_threads, bool use_uring)
+    : endpoint_list_t(!use_reactor(reactor_threads)), prio(prio),
+      remote_server(secret, callerid,
+                    use_uring && !use_reactor(reactor_threads)),
+      local_server(use_uring && !use_reactor(reactor_threads)),
+      toport(destport), recport(recport), portoffset(portoffset),
+      callerid(callerid), runsession(true), mode(0), sendlocal(sendlocal_),
+      last_tx(0), last_rx(0),
       t_bitrate(std::chrono::high_resolution_clock::now()), cb_seqerr(nullptr),
       cb_seqerr_data(nullptr)
 {
@@ -105,7 +172,12 @@ ovboxclient_t::ovboxclient_t(std::string desthost, port_t destport,
   if(usingproxy)
     mode |= B_USINGPROXY;
   if(encryption)
-    mode |= B_ENCRYPTION;
+    mode |= B_ENCRYPTION | B_SESSIONKEY;
+  // aggregated messages and parity can always be received:
+  mode |= B_AGGREGATE;
+  remote_server.set_caps(CAP_FEC);
+  for(auto& path : peer_path)
+    path = PATH_NONE;
   local_server.set_timeout_usec(10000);
   local_server.set_destination("localhost");
   local_server.bind(recport, true);
@@ -115,8 +187,10 @@ ovboxclient_t::ovboxclient_t(std::string desthost, port_t destport,
   if(use_tcp_tunnel && (!peer2peer_))
     desthost = "127.0.0.1";
   remote_server.set_destination(desthost.c_str());
-  if(deadline > 0.0)
+  if(deadline > 0.0) {
     remote_server.set_timeout_usec((int)(1000.0 * std::min(1e3, deadline)));
+    sorter.set_deadline_usec((uint32_t)(1000.0 * std::min(1e3, deadline)));
+  }
   port_t local_relay_port = remote_server.bind(0, false);
   if(use_tcp_tunnel && (!peer2peer_)) {
     tcp_tunnel = new ovtcpsocket_t(0);
@@ -131,6 +205,30 @@ ovboxclient_t::ovboxclient_t(std::string desthost, port_t destport,
   }
   localep = getipaddr();
   localep.sin_port = remote_server.getsockep().sin_port;
+  // beacons for discovery of peers in the local network:
+  memset(&beacon_ep, 0, sizeof(beacon_ep));
+  beacon_ep.sin_family = AF_INET;
+  beacon_ep.sin_addr.s_addr = inet_addr(LAN_BEACON_GROUP);
+  beacon_ep.sin_port = htons(LAN_BEACON_PORT);
+  try {
+    beacon.reset(new ovbox_udpsocket_t(secret, callerid));
+    beacon->bind(LAN_BEACON_PORT);
+    beacon->join_multicast(LAN_BEACON_GROUP);
+    beacon->set_timeout_usec(100000);
+    // in event-driven mode the beacons are answered by the reactor:
+    if(!use_reactor(reactor_threads))
+      beaconthread = std::thread(&ovboxclient_t::beaconsrv, this);
+  }
+  catch(const std::exception& e) {
+    beacon.reset();
+    log(recport, std::string("no local beacons: ") + e.what());
+  }
+#ifdef HAS_REACTOR
+  if(reactor_threads) {
+    start_reactor(reactor_threads);
+    return;
+  }
+#endif
   sendthread = std::thread(&ovboxclient_t::sendsrv, this);
   recthread = std::thread(&ovboxclient_t::recsrv, this);
   pingthread = std::thread(&ovboxclient_t::pingservice, this);
@@ -145,16 +243,34 @@ ovboxclient_t::~ovboxclient_t()
     recthread.join();
   if(pingthread.joinable())
     pingthread.join();
+  cond_aggregate.notify_all();
+  if(aggthread.joinable())
+    aggthread.join();
+  if(beaconthread.joinable())
+    beaconthread.join();
   if(!xrecthread.empty()) {
     for(auto& th : xrecthread) {
       if(th.joinable())
         th.join();
     }
   }
+#ifdef HAS_REACTOR
+  if(rstate) {
+    for(auto& th : rstate->threads)
+      if(th.joinable())
+        th.join();
+    delete rstate;
+    rstate = nullptr;
+  }
+#endif
   if(tcp_tunnel) {
     delete tcp_tunnel;
     tcp_tunnel = nullptr;
   }
+  if(cryptpool) {
+    delete cryptpool;
+    cryptpool = nullptr;
+  }
 }
 
 void ovboxclient_t::set_expedited_forwarding_PHB()
@@ -166,10 +282,34 @@ void ovboxclient_t::set_reorder_deadline(double t_ms)
 {
   if(t_ms > 0) {
     remote_server.set_timeout_usec((int)(1000.0 * std::min(1e3, t_ms)));
+    sorter.set_deadline_usec((uint32_t)(1000.0 * std::min(1e3, t_ms)));
     DEBUG(t_ms);
   }
 }
 
+void ovboxclient_t::set_reorder_depth(size_t depth)
+{
+  sorter.set_depth(depth);
+}
+
+void ovboxclient_t::set_aggregation(double window_ms)
+{
+  {
+    std::lock_guard<std::mutex> lk(mtx_aggregate);
+    if(aggregates.empty())
+      aggregates.resize(MAX_STAGE_ID);
+  }
+  // the routing plans are rebuilt when the window is switched on or
+  // off:
+  aggregate_usec = (uint32_t)(1000.0 * std::max(0.0, std::min(1e3, window_ms)));
+#ifdef HAS_REACTOR
+  if(rstate)
+    return;
+#endif
+  if(aggregate_usec && (!aggthread.joinable()))
+    aggthread = std::thread(&ovboxclient_t::aggsrv, this);
+}
+
 void ovboxclient_t::getbitrate(double& txrate, double& rxrate)
 {
   std::chrono::high_resolution_clock::time_point t2(
@@ -195,6 +335,26 @@ void ovboxclient_t::set_ping_callback(
   cb_ping_data = d;
 }
 
+void ovboxclient_t::set_caps(epcaps_t caps)
+{
+  remote_server.set_caps(caps | CAP_FEC);
+}
+
+void ovboxclient_t::set_caps_callback(
+    std::function<void(stage_device_id_t, epcaps_t, void*)> f, void* d)
+{
+  cb_caps = f;
+  cb_caps_data = d;
+}
+
+void ovboxclient_t::announce_caps(stage_device_id_t cid, epcaps_t caps)
+{
+  log(recport, "peer " + std::to_string(cid) + " features " +
+                   std::to_string(caps));
+  if(cb_caps)
+    cb_caps(cid, caps, cb_caps_data);
+}
+
 void ovboxclient_t::set_latreport_callback(latreport_cb_t f, void* d)
 {
   cb_latreport = f;
@@ -213,6 +373,26 @@ void ovboxclient_t::set_seqerr_callback(
 
 void ovboxclient_t::add_receiverport(port_t srcxport, port_t destxport)
 {
+#ifdef HAS_REACTOR
+  if(rstate) {
+    xport_t* xport(new xport_t());
+    xport->sock.set_destination("localhost");
+    xport->sock.bind(srcxport, false);
+    xport->destport = destxport;
+    {
+      std::lock_guard<std::mutex> lk(rstate->mxports);
+      rstate->xports.emplace_back(xport);
+    }
+    rstate->reactor.add(xport->sock.getsockfd(), [this, xport]() {
+      endpoint_t sender_endpoint;
+      ssize_t n(xport->sock.recvfrom(xport->sender.payload(),
+                                     BUFSIZE - HEADERLEN, sender_endpoint));
+      if(n > 0)
+        forward_local(xport->sender, (size_t)n, xport->destport, false);
+    });
+    return;
+  }
+#endif
   xrecthread.emplace_back(
       std::thread(&ovboxclient_t::xrecsrv, this, srcxport, destxport));
 }
@@ -248,6 +428,32 @@ void ovboxclient_t::add_proxy_client(stage_device_id_t cid,
   proxyclients[cid] = serv_addr;
 }
 
+void ovboxclient_t::set_proxy_multicast(const std::string& group, bool proxy)
+{
+  if(group.empty() || proxy_mc)
+    return;
+  try {
+    proxy_mc.reset(new udpsocket_t());
+    if(proxy) {
+      memset(&proxy_mc_ep, 0, sizeof(proxy_mc_ep));
+      proxy_mc_ep.sin_family = AF_INET;
+      proxy_mc_ep.sin_addr.s_addr = inet_addr(group.c_str());
+      if(!IN_MULTICAST(ntohl(proxy_mc_ep.sin_addr.s_addr)))
+        throw ErrMsg("Not a multicast group: " + group);
+      // the proxy delivers the messages to its own receivers via
+      // localhost:
+      proxy_mc->set_multicast_loop(false);
+    } else
+      proxy_mc->join_multicast(group.c_str());
+  }
+  catch(const std::exception& e) {
+    proxy_mc.reset();
+    log(recport, std::string("no proxy multicast: ") + e.what());
+    return;
+  }
+  proxy_mc_send = proxy;
+}
+
 void ovboxclient_t::announce_new_connection(stage_device_id_t cid,
                                             const ep_desc_t& ep)
 {
@@ -312,14 +518,32 @@ void ovboxclient_t::update_client_stats(stage_device_id_t cid,
                                         client_stats_t& stats)
 {
   stats.packages = sorter.get_stat(cid);
+  fec.get_stat(cid, stats.packages);
   message_stat_t ostat(stats.state_packages);
   stats.state_packages = stats.packages;
   stats.packages -= ostat;
   if(stats.packages.lost > (1 << 30))
     stats.packages.lost = 0;
-  ping_stat_collecors_p2p[cid].update_ping_stat(stats.ping_p2p);
-  ping_stat_collecors_srv[cid].update_ping_stat(stats.ping_srv);
-  ping_stat_collecors_local[cid].update_ping_stat(stats.ping_loc);
+  if(cid >= MAX_STAGE_ID)
+    return;
+  ping_stat_t* const ps[PATH_NONE] = {&(stats.ping_p2p), &(stats.ping_srv),
+                                      &(stats.ping_loc)};
+  read_ping_stats(cid, ps, true);
+  stats.path = to_string(get_path(cid));
+}
+
+void ovboxclient_t::read_ping_stats(stage_device_id_t cid,
+                                    ping_stat_t* const ps[PATH_NONE],
+                                    bool report_hist)
+{
+  if(cid >= MAX_STAGE_ID)
+    return;
+  ping_snapshots[cid][PATH_P2P].read(ping_stat_collecors_p2p[cid],
+                                     *(ps[PATH_P2P]), report_hist);
+  ping_snapshots[cid][PATH_SRV].read(ping_stat_collecors_srv[cid],
+                                     *(ps[PATH_SRV]), report_hist);
+  ping_snapshots[cid][PATH_LOC].read(ping_stat_collecors_local[cid],
+                                     *(ps[PATH_LOC]), report_hist);
 }
 
 void ovboxclient_t::handle_endpoint_list_update(stage_device_id_t cid,
@@ -334,42 +558,322 @@ void ovboxclient_t::pingservice()
 {
   while(runsession) {
     std::this_thread::sleep_for(std::chrono::milliseconds(pingperiodms));
-    // send registration to relay server:
-    remote_server.send_registration(mode, toport, localep);
-    // send ping to other peers:
-    uint8_t ocid(0);
-    for(auto& ep : endpoints) {
-      if(ep.timeout && (ocid != callerid)) {
-        remote_server.send_ping(ep.ep, ocid);
-        ++ping_stat_collecors_p2p[ocid].sent;
-        remote_server.send_ping(remote_server.get_destination(), ocid,
-                                PORT_PING_SRV);
-        ++ping_stat_collecors_srv[ocid].sent;
-        // test if peer is in same network:
+    send_pings();
+  }
+}
+
+void ovboxclient_t::send_pings()
+{
+  // send registration to relay server:
+  remote_server.send_registration(mode, toport, localep);
+  // send ping to other peers:
+  auto snap(get_snapshot());
+  const std::vector<ep_desc_t>& endpoints(snap->endpoints);
+  uint8_t ocid(0);
+  uint32_t active(0);
+  bool discover(false);
+  for(auto& ep : endpoints) {
+    if(ep.timeout && (ocid != callerid)) {
+      active |= 1u << ocid;
+      remote_server.send_ping(ep.ep, ocid);
+      ++ping_stat_collecors_p2p[ocid].sent;
+      remote_server.send_ping(remote_server.get_destination(), ocid,
+                              PORT_PING_SRV);
+      ++ping_stat_collecors_srv[ocid].sent;
+      // ping the local endpoint of peers which answered in the local
+      // network, or try the local address of peers with the same
+      // public address:
+      if(lan.is_reachable(ocid)) {
+        remote_server.send_ping(lan.get_endpoint(ocid), ocid, PORT_PING_LOCAL);
+        ++ping_stat_collecors_local[ocid].sent;
+      } else {
+        discover = true;
         if((endpoints[callerid].ep.sin_addr.s_addr == ep.ep.sin_addr.s_addr) &&
            (ep.localep.sin_addr.s_addr != 0)) {
           remote_server.send_ping(ep.localep, ocid, PORT_PING_LOCAL);
           ++ping_stat_collecors_local[ocid].sent;
         }
       }
-      ++ocid;
     }
+    ++ocid;
+  }
+  // the beacon reaches peers in the local network even if their
+  // public or local addresses do not indicate it:
+  if(beacon && discover)
+    remote_server.send_ping(beacon_ep, 0, PORT_PING_LOCAL);
+  if(lan.update(active)) {
+    // the routing plans are rebuilt on the next message:
+    ++path_version;
+    for(stage_device_id_t cid = 0; cid < MAX_STAGE_ID; ++cid)
+      if(active & (1u << cid))
+        log(recport, "peer " + std::to_string(cid) +
+                         (lan.is_reachable(cid)
+                              ? " in local network at " +
+                                    ep2str(lan.get_endpoint(cid))
+                              : " not in local network"));
+  }
+  if(select_paths || (uplink.get() > 0.0) || relay_mask)
+    update_paths(*snap);
+}
+
+void ovboxclient_t::beaconsrv()
+{
+  msgbuf_t msg;
+  while(runsession) {
+    if(beacon->recv_sec_msg(msg))
+      answer_beacon(msg);
+  }
+}
+
+void ovboxclient_t::answer_beacon(msgbuf_t& msg)
+{
+  if((msg.destport == PORT_PING_LOCAL) && (msg.cid != callerid)) {
+    // answer from the main socket, so the peer learns the local
+    // endpoint of this device from the sender of the pong:
+    msg_set_callerid(msg.rawbuffer, callerid);
+    msg_set_port(msg.rawbuffer, PORT_PONG_LOCAL);
+    remote_server.send(msg.rawbuffer, msg.size + HEADERLEN, msg.sender);
+  }
+}
+
+lan_probe_t::lan_probe_t()
+{
+  for(size_t k = 0; k < MAX_STAGE_ID; ++k) {
+    ep[k] = 0;
+    pongs[k] = 0;
+    pongs_seen[k] = 0;
+    missed[k] = 0;
+  }
+}
+
+// pack address and port of an endpoint into one integer:
+static uint64_t ep2int(const endpoint_t& ep)
+{
+  return ((uint64_t)(ep.sin_addr.s_addr) << 16) | ep.sin_port;
+}
+
+void lan_probe_t::add_pong(stage_device_id_t cid, const endpoint_t& sender)
+{
+  if(cid >= MAX_STAGE_ID)
+    return;
+  if(ep[cid].exchange(ep2int(sender)) != ep2int(sender))
+    ep_changed = true;
+  ++pongs[cid];
+}
+
+bool lan_probe_t::update(uint32_t active)
+{
+  uint32_t mask(0);
+  for(stage_device_id_t cid = 0; cid < MAX_STAGE_ID; ++cid) {
+    uint32_t n(pongs[cid]);
+    if(n != pongs_seen[cid]) {
+      pongs_seen[cid] = n;
+      missed[cid] = 0;
+    } else if(missed[cid] < LAN_MAXMISS) {
+      ++missed[cid];
+    }
+    if((active & (1u << cid)) && n && (missed[cid] < LAN_MAXMISS))
+      mask |= 1u << cid;
+  }
+  bool changed(ep_changed.exchange(false) && mask);
+  return (reachable.exchange(mask) != mask) || changed;
+}
+
+endpoint_t lan_probe_t::get_endpoint(stage_device_id_t cid) const
+{
+  endpoint_t lep;
+  memset(&lep, 0, sizeof(lep));
+  if(cid >= MAX_STAGE_ID)
+    return lep;
+  uint64_t v(ep[cid]);
+  lep.sin_family = AF_INET;
+  lep.sin_addr.s_addr = (uint32_t)(v >> 16);
+  lep.sin_port = (uint16_t)(v & 0xffff);
+  return lep;
+}
+
+bool lan_probe_t::is_local(stage_device_id_t cid,
+                           const endpoint_t& sender) const
+{
+  return is_reachable(cid) &&
+         ((uint32_t)(ep[cid] >> 16) == sender.sin_addr.s_addr);
+}
+
+void ovboxclient_t::update_paths(const endpoint_snapshot_t& snap)
+{
+  path_update_ms += pingperiodms;
+  if(path_update_ms < PATH_UPDATE_MS)
+    return;
+  path_update_ms = 0;
+  const std::vector<ep_desc_t>& endpoints(snap.endpoints);
+  for(size_t cid = 0; cid < std::min(endpoints.size(), (size_t)MAX_STAGE_ID);
+      ++cid) {
+    const ep_desc_t& ep(endpoints[cid]);
+    if((!ep.timeout) || (cid == callerid))
+      continue;
+    ping_stat_t* ps(path_stats[cid]);
+    ping_stat_t* const pps[PATH_NONE] = {&(ps[PATH_P2P]), &(ps[PATH_SRV]),
+                                         &(ps[PATH_LOC])};
+    read_ping_stats((stage_device_id_t)cid, pps, false);
+    uint8_t allowed(1u << PATH_SRV);
+    if((mode & B_PEER2PEER) && (ep.mode & B_PEER2PEER)) {
+      // messages between peer-to-peer devices are lost at a server
+      // which does not relay them, even if pings pass:
+      if(!srv_relays_p2p)
+        allowed = 0;
+      allowed |= 1u << PATH_P2P;
+      if(sendlocal && lan.is_reachable((stage_device_id_t)cid))
+        allowed |= 1u << PATH_LOC;
+    }
+    const ping_stat_t* const stat[PATH_NONE] = {
+        &(ps[PATH_P2P]), &(ps[PATH_SRV]), &(ps[PATH_LOC])};
+    if(select_paths && path_selector[cid].update(stat, allowed)) {
+      peer_path[cid] = path_selector[cid].get();
+      // the routing plans are rebuilt on the next message:
+      ++path_version;
+      log(recport, "path to " + std::to_string(cid) + " " +
+                       to_string(path_selector[cid].get()));
+    }
+  }
+  update_uplink(snap);
+}
+
+void ovboxclient_t::update_uplink(const endpoint_snapshot_t& snap)
+{
+  auto now(std::chrono::steady_clock::now());
+  double sc(8.0 / std::max(1e-3, std::chrono::duration<double>(now - t_uplink)
+                                     .count()));
+  t_uplink = now;
+  size_t tx(remote_server.tx_bytes);
+  size_t stream_tx(stream_tx_bytes);
+  double txrate(sc * (double)(tx - uplink_tx));
+  double streamrate(sc * (double)(stream_tx - uplink_stream_tx));
+  uplink_tx = tx;
+  uplink_stream_tx = stream_tx;
+  // peers which could receive a direct copy, and ping loss of the
+  // direct paths:
+  const std::vector<ep_desc_t>& endpoints(snap.endpoints);
+  std::vector<std::pair<float, stage_device_id_t>> peers;
+  size_t received(0);
+  size_t lost(0);
+  for(size_t cid = 0; cid < std::min(endpoints.size(), (size_t)MAX_STAGE_ID);
+      ++cid) {
+    const ep_desc_t& ep(endpoints[cid]);
+    if((!ep.timeout) || (cid == callerid) || (!(mode & B_PEER2PEER)) ||
+       (!(ep.mode & B_PEER2PEER)) ||
+       (select_paths && (peer_path[cid] == PATH_SRV)))
+      continue;
+    const ping_stat_t& ps(path_stats[cid][PATH_P2P]);
+    // the reply to the last ping may still be on its way:
+    lost += ps.lost - std::min((size_t)1, ps.lost);
+    received += ps.received;
+    peers.push_back(std::make_pair(
+        (ps.t_p99 < 0.0f) ? std::numeric_limits<float>::max() : ps.t_p99,
+        (stage_device_id_t)cid));
+  }
+  if(uplink.update(txrate,
+                   (float)lost / (float)std::max((size_t)1, received + lost)))
+    log(recport, "uplink budget " +
+                     std::to_string((int)(0.001 * uplink.get())) + " kbit/s");
+  // keep the peers with the lowest ping times direct:
+  std::sort(peers.begin(), peers.end());
+  size_t ndirect(uplink.get_direct(streamrate, peers.size(),
+                                   redundant || (!(mode & B_PEER2PEER))));
+  // messages for peer-to-peer devices are lost at a server which does
+  // not relay them, so all peers are kept direct:
+  if(!srv_relays_p2p)
+    ndirect = peers.size();
+  uint32_t mask(0);
+  for(size_t k = ndirect; k < peers.size(); ++k)
+    mask |= 1u << peers[k].second;
+  if(mask != relay_mask) {
+    relay_mask = mask;
+    // the routing plans are rebuilt on the next message:
+    ++path_version;
+    log(recport, "relaying to " +
+                     std::to_string(peers.size() - ndirect) + " of " +
+                     std::to_string(peers.size()) + " peers");
   }
 }
 
+void ovboxclient_t::set_uplink_limit(double kbps)
+{
+  uplink.set_limit(1000.0 * std::max(0.0, kbps));
+}
+
+void uplink_budget_t::set_limit(double limit_)
+{
+  limit = limit_;
+  budget = limit;
+}
+
+bool uplink_budget_t::update(double txrate, double lossrate)
+{
+  double prev(budget);
+  if(limit <= 0.0)
+    budget = 0.0;
+  else if((lossrate > UPLINK_MAXLOSS) && (txrate > 0.0))
+    budget = UPLINK_DECREASE * std::min(budget, txrate);
+  else
+    budget = std::min(limit, budget + UPLINK_INCREASE * limit);
+  return budget != prev;
+}
+
+size_t uplink_budget_t::get_direct(double streamrate, size_t npeers,
+                                   bool server) const
+{
+  if((budget <= 0.0) || (streamrate <= 0.0))
+    return npeers;
+  double copies(budget / streamrate);
+  if((double)(npeers + server) <= copies)
+    return npeers;
+  // reserve one copy for the server:
+  copies -= 1.0;
+  if(copies < 1.0)
+    return 0;
+  return std::min(npeers, (size_t)copies);
+}
+
+void ovboxclient_t::set_path_selection(bool enable)
+{
+  select_paths = enable;
+  ++path_version;
+}
+
+path_t ovboxclient_t::get_path(stage_device_id_t cid)
+{
+  if(cid >= MAX_STAGE_ID)
+    return PATH_NONE;
+  if(relay_mask & (1u << cid))
+    return PATH_SRV;
+  if(select_paths && (peer_path[cid] != PATH_NONE))
+    return (path_t)(peer_path[cid].load());
+  // static choice, see update_routing_plan():
+  auto snap(get_snapshot());
+  const std::vector<ep_desc_t>& endpoints(snap->endpoints);
+  if((cid >= endpoints.size()) || (!(mode & B_PEER2PEER)) ||
+     (!(endpoints[cid].mode & B_PEER2PEER)))
+    return PATH_SRV;
+  if(sendlocal && lan.is_reachable(cid))
+    return PATH_LOC;
+  return PATH_P2P;
+}
+
 // this thread receives messages from the session server and the peers:
 void ovboxclient_t::sendsrv()
 {
   try {
     set_thread_prio(prio);
-    msgbuf_t msg;
+    msgbuf_t msg[RECV_BATCHSIZE];
     while(runsession) {
-      bool can_process = remote_server.recv_sec_msg(msg);
-      if(can_process) {
-        msgbuf_t* pmsg(&msg);
-        while(sorter.process(&pmsg))
-          process_msg(*pmsg);
-      }
+      // if the sorter holds messages, then wait for new messages only
+      // until the next deadline:
+      int wait_usec(sorter.get_wait_usec(sorter_clock_t::now()));
+      size_t nmsg(0);
+      if((wait_usec < 0) || remote_server.wait_readable(wait_usec))
+        // receive all pending messages with one call:
+        nmsg = remote_server.recv_sec_msg(msg, RECV_BATCHSIZE);
+      process_received(msg, nmsg);
     }
   }
   catch(const std::exception& e) {
@@ -378,26 +882,161 @@ void ovboxclient_t::sendsrv()
   }
 }
 
+void ovboxclient_t::process_received(msgbuf_t* msg, size_t nmsg)
+{
+  // validate and sort the messages one by one:
+  for(size_t k = 0; k < nmsg; ++k) {
+    if(msg[k].valid && (msg[k].destport == PORT_AGGREGATE))
+      process_aggregate(msg[k]);
+    else if(msg[k].valid)
+      receive_msg(msg[k]);
+  }
+  // release held messages which are in sequence now, or whose
+  // deadline has passed:
+  msg[0].valid = false;
+  msgbuf_t* pmsg(&(msg[0]));
+  while(sorter.process(&pmsg))
+    process_msg(*pmsg);
+  flush_local();
+}
+
+void ovboxclient_t::process_aggregate(const msgbuf_t& msg)
+{
+  size_t pos(0);
+  size_t len(0);
+  const char* packed(NULL);
+  while((packed = aggregate_next(msg.msg, msg.size, pos, len))) {
+    if(len < HEADERLEN)
+      continue;
+    msg_header_t hdr(msg_header_t::load(packed));
+    if(hdr.secret != remote_server.get_secret())
+      continue;
+    // the message is handled as if it was received on its own:
+    memcpy(aggregated_msg.rawbuffer, packed, len);
+    aggregated_msg.unpack(hdr, len);
+    aggregated_msg.sender = msg.sender;
+    receive_msg(aggregated_msg);
+  }
+}
+
+void ovboxclient_t::receive_msg(msgbuf_t& msg)
+{
+  // parity is computed from the plain messages, so decryption is
+  // needed before recovery:
+  decrypt_msg(msg);
+  if(msg.destport == PORT_FEC) {
+    // a recovered message is sorted like a received one, so it can
+    // fill a gap in the reorder window:
+    if((msg.cid != callerid) &&
+       fec.recover(msg, remote_server.get_secret(), recovered_msg))
+      sort_msg(recovered_msg);
+    msg.valid = false;
+    return;
+  }
+  fec.add(msg);
+  sort_msg(msg);
+}
+
+void ovboxclient_t::sort_msg(msgbuf_t& msg)
+{
+  msgbuf_t* pmsg(&msg);
+  while(sorter.process(&pmsg))
+    process_msg(*pmsg);
+}
+
+void ovboxclient_t::decrypt_msg(msgbuf_t& msg)
+{
+  if(((msg.destport <= MAXSPECIALPORT) && (msg.destport != PORT_FEC)) ||
+     (msg.cid >= MAX_STAGE_ID) || (!(mode & B_ENCRYPTION)))
+    return;
+  auto snap(get_snapshot());
+  const ep_desc_t& ep(snap->endpoints[msg.cid]);
+  if(!(ep.mode & B_ENCRYPTION))
+    return;
+  size_t len(0);
+  // peer-to-peer messages use the session key, messages relayed by
+  // the server are sealed:
+  if((mode & B_SESSIONKEY) && (ep.mode & B_SESSIONKEY) && ep.has_sessionkey) {
+    size_t dlen(decryptmsg_sessionkey(decrypted_msg.rawbuffer, msg.rawbuffer,
+                                      msg.size + HEADERLEN, ep.sessionkey));
+    if(dlen >= HEADERLEN)
+      len = dlen - HEADERLEN;
+  }
+  if((!len) && (msg.size >= crypto_box_SEALBYTES) &&
+     (crypto_box_seal_open((uint8_t*)(decrypted_msg.msg), (uint8_t*)(msg.msg),
+                           msg.size, remote_server.recipient_public,
+                           remote_server.recipient_secret) == 0))
+    len = msg.size - crypto_box_SEALBYTES;
+  if(!len)
+    return;
+  msg_header_t hdr;
+  hdr.secret = remote_server.get_secret();
+  hdr.callerid = msg.cid;
+  hdr.port = msg.destport;
+  hdr.seq = msg.seq;
+  hdr.store(decrypted_msg.rawbuffer);
+  decrypted_msg.unpack(hdr, HEADERLEN + len);
+  decrypted_msg.sender = msg.sender;
+  msg.take(decrypted_msg);
+}
+
+void ovboxclient_t::set_fec(size_t group)
+{
+  fec_group = fec_valid_group(group) ? group : 0;
+}
+
+void ovboxclient_t::set_redundancy(bool enable)
+{
+  // the routing plans are rebuilt on the next message:
+  redundant = enable;
+}
+
+void ovboxclient_t::set_local_receiver_callback(local_receiver_cb_t cb,
+                                                void* data)
+{
+  if(has_localrec)
+    throw ErrMsg("The local receiver callback can be set only once.");
+  cb_localrec = cb;
+  cb_localrec_data = data;
+  has_localrec.store(true, std::memory_order_release);
+}
+
+void ovboxclient_t::deliver_local(const char* msg, size_t len, port_t port)
+{
+  if(has_localrec.load(std::memory_order_acquire) &&
+     cb_localrec(port, msg, len, cb_localrec_data))
+    return;
+  local_server.queue(msg, len, port);
+}
+
+void ovboxclient_t::flush_local()
+{
+  // send all messages to local UDP receivers with one call:
+  local_server.flush();
+}
+
 void ovboxclient_t::process_ping_msg(msgbuf_t& msg)
 {
   stage_device_id_t cid(msg.cid);
-  msg_callerid(msg.rawbuffer) = callerid;
+  cid_set_caps(cid, ovbox_udpsocket_t::get_ping_caps(msg.msg, msg.size,
+                                                     msg.destport));
+  msg_set_callerid(msg.rawbuffer, callerid);
   switch(msg.destport) {
   case PORT_PING:
     // we received a ping message, so we just send it back as a pong
     // message and with our own stage device id:
-    msg_port(msg.rawbuffer) = PORT_PONG;
+    msg_set_port(msg.rawbuffer, PORT_PONG);
     break;
   case PORT_PING_SRV:
     // we received a ping message via server so we just send it back as a pong
     // message and with our own stage device id:
-    msg_port(msg.rawbuffer) = PORT_PONG_SRV;
+    msg_set_port(msg.rawbuffer, PORT_PONG_SRV);
     *((stage_device_id_t*)(msg.msg)) = cid;
     break;
   case PORT_PING_LOCAL:
     // we received a ping message, so we just send it back as a pong
     // message and with our own stage device id:
-    msg_port(msg.rawbuffer) = PORT_PONG_LOCAL;
+    msg_set_port(msg.rawbuffer, PORT_PONG_LOCAL);
     break;
   }
   remote_server.send(msg.rawbuffer, msg.size + HEADERLEN, msg.sender);
@@ -415,6 +1054,8 @@ void ovboxclient_t::process_pong_msg(msgbuf_t& msg)
   if(tms > 0) {
     if(cb_ping)
       cb_ping(msg.cid, msg.destport, tms, msg.sender, cb_ping_data);
+    if(msg.cid >= MAX_STAGE_ID)
+      return;
     switch(msg.destport) {
     case PORT_PONG:
       ping_stat_collecors_p2p[msg.cid].add_value((float)tms);
@@ -423,12 +1064,37 @@ void ovboxclient_t::process_pong_msg(msgbuf_t& msg)
       ping_stat_collecors_srv[msg.cid].add_value((float)tms);
       break;
     case PORT_PONG_LOCAL:
-      ping_stat_collecors_local[msg.cid].add_value((float)tms);
+      lan.add_pong(msg.cid, msg.sender);
+      // pongs of beacons are not counted, since beacons are not
+      // counted as sent pings. The ping contains its destination:
+      if((tsize < sizeof(endpoint_t)) ||
+         (msg_load<uint32_t>(tbuf, offsetof(endpoint_t, sin_addr)) !=
+          beacon_ep.sin_addr.s_addr))
+        ping_stat_collecors_local[msg.cid].add_value((float)tms);
       break;
     }
   }
 }
 
+void ovboxclient_t::forward_to_proxy_clients(const msgbuf_t& msg)
+{
+  // either once to the multicast group, unless the message is from a
+  // proxy client, since the group would deliver it back to its sender:
+  if(proxy_mc_send && (proxyclients.find(msg.cid) == proxyclients.end())) {
+    endpoint_t ep(proxy_mc_ep);
+    ep.sin_port = htons((unsigned short)msg.destport);
+    proxy_mc->send(msg.msg, msg.size, ep);
+    return;
+  }
+  // or to each proxy client:
+  for(auto& client : proxyclients) {
+    if(msg.cid != client.first) {
+      client.second.sin_port = htons((unsigned short)msg.destport);
+      remote_server.send(msg.msg, msg.size, client.second);
+    }
+  }
+}
+
 void ovboxclient_t::process_msg(msgbuf_t& msg)
 {
   msg.valid = false;
@@ -439,36 +1105,26 @@ void ovboxclient_t::process_msg(msgbuf_t& msg)
   // not a special port, thus we forward data to localhost and proxy
   // clients:
   if(msg.destport > MAXSPECIALPORT) {
-    char* send_msg = msg.msg;
-    size_t send_len = msg.size;
-    if((msg.cid < MAX_STAGE_ID) && (endpoints[msg.cid].mode & B_ENCRYPTION) &&
-       (mode & B_ENCRYPTION)) {
-      if(crypto_box_seal_open((uint8_t*)(decrypted_msg.msg),
-                              (uint8_t*)(msg.msg), msg.size,
-                              remote_server.recipient_public,
-                              remote_server.recipient_secret) == 0) {
-        // success:
-        send_msg = decrypted_msg.msg;
-        send_len = msg.size - crypto_box_SEALBYTES;
-      }
+    if((!srv_relays_p2p) && (mode & B_PEER2PEER) &&
+       (msg.cid < MAX_STAGE_ID) &&
+       (ep2int(msg.sender) == ep2int(remote_server.get_destination())) &&
+       (get_snapshot()->endpoints[msg.cid].mode & B_PEER2PEER)) {
+      srv_relays_p2p = true;
+      log(recport, "server relays between peer-to-peer devices");
     }
+    // the message was decrypted in receive_msg():
+    const char* send_msg = msg.msg;
+    size_t send_len = msg.size;
     if(msg.destport + portoffset != recport)
-      // forward to local UDP receivers (zita etc.), add portoffset:
-      local_server.send(send_msg, send_len,
-                        (uint16_t)(msg.destport + portoffset));
+      // forward to local UDP receivers (zita etc.), add portoffset;
+      // the queue is sent after the whole batch was processed:
+      deliver_local(send_msg, send_len, (port_t)(msg.destport + portoffset));
     for(auto xd : xdest)
       if(msg.destport + xd != recport)
-        local_server.send(send_msg, send_len, (uint16_t)(msg.destport + xd));
+        deliver_local(send_msg, send_len, (port_t)(msg.destport + xd));
     // is this message from same network?
-    if(!is_same_network(msg.sender, localep)) {
-      // now send to proxy clients:
-      for(auto& client : proxyclients) {
-        if(msg.cid != client.first) {
-          client.second.sin_port = htons((unsigned short)msg.destport);
-          remote_server.send(send_msg, send_len, client.second);
-        }
-      }
-    }
+    if(!lan.is_local(msg.cid, msg.sender))
+      forward_to_proxy_clients(msg);
     return;
   }
   switch(msg.destport) {
@@ -496,101 +1152,387 @@ void ovboxclient_t::process_msg(msgbuf_t& msg)
     }
     break;
   case PORT_PUBKEY:
-    cid_set_pubkey(msg.cid, msg.msg, msg.size);
+    if(cid_set_pubkey(msg.cid, msg.msg, msg.size) &&
+       (msg.cid < MAX_STAGE_ID)) {
+      uint8_t sessionkey[crypto_box_BEFORENMBYTES];
+      if(remote_server.derive_sessionkey((uint8_t*)(msg.msg), sessionkey))
+        cid_set_sessionkey(msg.cid, sessionkey);
+    }
     break;
   }
 }
 
+fanout_crypt_t ovboxclient_t::peer_crypt(const ep_desc_t& ep) const
+{
+  fanout_crypt_t crypt;
+  crypt.pubkey = ep.pubkey;
+  if((mode & B_SESSIONKEY) && (ep.mode & B_SESSIONKEY) && ep.has_sessionkey)
+    crypt.sessionkey = ep.sessionkey;
+  return crypt;
+}
+
+void ovboxclient_t::set_encryption_workers(size_t nthreads)
+{
+  if(nthreads && (!cryptpool))
+    cryptpool = new worker_pool_t(nthreads, prio);
+}
+
+void ovboxclient_t::encrypt_and_send(const char* msg, size_t msglen,
+                                     fanout_dest_t* dest,
+                                     const fanout_crypt_t* crypt, size_t ndest,
+                                     char* cmsg, bool parallel)
+{
+  // encrypt the copies of a range of destinations and send them:
+  auto encrypt_range = [&](size_t k0, size_t k1) {
+    for(size_t k = k0; k < k1; ++k) {
+      if(crypt[k].pubkey) {
+        char* cbuf(&(cmsg[k * CMSGSIZE]));
+        dest[k].len = encrypt_copy(msg, msglen, crypt[k], cbuf);
+        dest[k].buf = cbuf;
+      }
+    }
+    remote_server.sendmmsg(msg, msglen, &(dest[k0]), k1 - k0);
+  };
+  size_t nencrypt(0);
+  for(size_t k = 0; k < ndest; ++k)
+    nencrypt += (crypt[k].pubkey != nullptr);
+  worker_pool_t* pool(cryptpool);
+  if(parallel && pool && (nencrypt > 1)) {
+    // split the destinations into one chunk per thread, each thread
+    // sends its chunk as soon as it is encrypted:
+    size_t nchunks(std::min(ndest, pool->size() + 1));
+    pool->run(nchunks, [&](size_t chunk) {
+      encrypt_range((chunk * ndest) / nchunks, ((chunk + 1) * ndest) / nchunks);
+    });
+  } else {
+    encrypt_range(0, ndest);
+  }
+}
+
+size_t ovboxclient_t::encrypt_copy(const char* msg, size_t msglen,
+                                   const fanout_crypt_t& crypt, char* cbuf)
+{
+  if(crypt.sessionkey)
+    return encryptmsg_sessionkey(cbuf, CMSGSIZE, msg, msglen, crypt.sessionkey,
+                                 ++sessionkey_counter);
+  return encryptmsg(cbuf, CMSGSIZE, msg, msglen, crypt.pubkey);
+}
+
+void ovboxclient_t::aggregate(const char* msg, size_t msglen,
+                              const routing_plan_t& plan, char* cbuf)
+{
+  for(size_t k = 0; k < plan.nagg; ++k) {
+    const char* amsg(msg);
+    size_t alen(msglen);
+    if(plan.aggcrypt[k].pubkey) {
+      alen = encrypt_copy(msg, msglen, plan.aggcrypt[k], cbuf);
+      amsg = cbuf;
+    }
+    std::lock_guard<std::mutex> lk(mtx_aggregate);
+    aggregate_t& agg(aggregates[plan.aggcid[k]]);
+    size_t len(0);
+    if(agg.len)
+      len = aggregate_add(agg.buf, AGGREGATE_MAXLEN, agg.len, amsg, alen);
+    if(!len) {
+      // the message does not fit, send the pending messages first:
+      if(agg.len)
+        remote_server.send(agg.buf, agg.len, agg.ep);
+      msg_header_t hdr;
+      hdr.secret = remote_server.get_secret();
+      hdr.callerid = callerid;
+      hdr.port = PORT_AGGREGATE;
+      hdr.store(agg.buf);
+      len = aggregate_add(agg.buf, AGGREGATE_MAXLEN, HEADERLEN, amsg, alen);
+      if(!len) {
+        // too large for aggregation:
+        remote_server.send(amsg, alen, plan.aggep[k]);
+        agg.len = 0;
+        continue;
+      }
+    }
+    agg.len = len;
+    agg.ep = plan.aggep[k];
+    if(!aggregate_pending) {
+      uint32_t usec(std::max(1u, aggregate_usec.load()));
+      aggregate_pending = true;
+      aggregate_due =
+          std::chrono::steady_clock::now() + std::chrono::microseconds(usec);
+#ifdef HAS_REACTOR
+      if(rstate)
+        reactor_t::set_timer(rstate->aggtimer, usec, false);
+      else
+#endif
+        cond_aggregate.notify_one();
+    }
+  }
+}
+
+void ovboxclient_t::flush_aggregates()
+{
+  std::lock_guard<std::mutex> lk(mtx_aggregate);
+  if(!aggregate_pending)
+    return;
+  for(auto& agg : aggregates)
+    if(agg.len) {
+      remote_server.send(agg.buf, agg.len, agg.ep);
+      agg.len = 0;
+    }
+  aggregate_pending = false;
+}
+
+void ovboxclient_t::aggsrv()
+{
+  set_thread_prio(prio);
+  while(runsession) {
+    bool due(false);
+    {
+      std::unique_lock<std::mutex> lk(mtx_aggregate);
+      if(aggregate_pending)
+        cond_aggregate.wait_until(lk, aggregate_due);
+      else
+        cond_aggregate.wait_for(lk, std::chrono::milliseconds(100));
+      due = aggregate_pending &&
+            (std::chrono::steady_clock::now() >= aggregate_due);
+    }
+    if(due)
+      flush_aggregates();
+  }
+}
+
+void ovboxclient_t::update_routing_plan(const endpoint_snapshot_t& snap,
+                                        routing_plan_t& plan, bool primary,
+                                        bool parity) const
+{
+  bool aggregating(aggregate_usec > 0);
+  // parity is sent over one path, so the second path cannot reach
+  // peers which skipped it:
+  bool redundant_(redundant && primary && (!parity));
+  uint64_t path_version_(path_version);
+  if(plan.valid && (plan.version == snap.version) &&
+     (plan.aggregate == aggregating) && (plan.redundant == redundant_) &&
+     (plan.path_version == path_version_) &&
+     (plan.srv_relays_p2p == srv_relays_p2p))
+    return;
+  const std::vector<ep_desc_t>& endpoints(snap.endpoints);
+  bool sendtoserver(!(mode & B_PEER2PEER));
+  plan.aggregate = aggregating;
+  plan.redundant = redundant_;
+  plan.path_version = path_version_;
+  plan.srv_relays_p2p = srv_relays_p2p;
+  plan.nagg = 0;
+  plan.ndest = 0;
+  plan.peers_total = 0;
+  plan.peers_encrypted = 0;
+  // the server forwards parity to all peers, so it is sent via the
+  // server only if all peers can receive it:
+  bool srv_parity(true);
+  if(parity) {
+    size_t ocid(0);
+    for(auto& ep : endpoints) {
+      if(ep.timeout && (ocid != callerid) && (!(ep.caps & CAP_FEC)))
+        srv_parity = false;
+      ++ocid;
+    }
+  }
+  if(mode & B_PEER2PEER) {
+    // we are in peer-to-peer mode.
+    size_t ocid(0);
+    for(auto& ep : endpoints) {
+      if(ep.timeout && (ocid != callerid)) {
+        // target endpoint is active, and we are not sending to ourself.
+        if(ep.mode & B_PEER2PEER) {
+          // target/other end is in peer-to-peer mode.
+          ++plan.peers_total;
+          // now check for encryption:
+          bool encrypt((mode & B_ENCRYPTION) && (ep.mode & B_ENCRYPTION) &&
+                       ep.has_pubkey);
+          if(encrypt)
+            ++plan.peers_encrypted;
+          // The destination is in the same network as this device
+          // if it answered a local ping, see lan_probe_t:
+          bool target_in_same_network(
+              lan.is_reachable((stage_device_id_t)ocid));
+          endpoint_t lanep(lan.get_endpoint((stage_device_id_t)ocid));
+          if((!(bool)(ep.mode & B_DONOTSEND)) ||
+             ((bool)(ep.mode & B_USINGPROXY) && target_in_same_network)) {
+            // sending is not deactivated.
+            // Extra ports ignore the downmix mode. On the primary
+            // port, either remote is receiving downmix and this is
+            // downmixer, or remote is not expecting downmix and this
+            // is not a downmixer (normal mode):
+            if((!primary) || ((bool)(ep.mode & B_RECEIVEDOWNMIX_deprecated) ==
+                              (bool)(mode & B_SENDDOWNMIX_deprecated))) {
+              endpoint_t destep(ep.ep);
+              if(sendlocal && target_in_same_network)
+                // same network.
+                destep = lanep;
+              path_t path(select_paths ? (path_t)(peer_path[ocid].load())
+                                       : PATH_NONE);
+              if(path == PATH_P2P)
+                destep = ep.ep;
+              if((path == PATH_LOC) && target_in_same_network)
+                destep = lanep;
+              if(plan.srv_relays_p2p && (relay_mask & (1u << ocid)))
+                path = PATH_SRV;
+              if(path == PATH_SRV) {
+                // the relay server was selected:
+                sendtoserver = true;
+              } else if(parity && (!(ep.caps & CAP_FEC))) {
+                // the peer does not know parity messages
+              } else if(aggregating && (ep.mode & B_AGGREGATE)) {
+                plan.aggcid[plan.nagg] = (stage_device_id_t)ocid;
+                plan.aggep[plan.nagg] = destep;
+                plan.aggcrypt[plan.nagg] =
+                    encrypt ? peer_crypt(ep) : fanout_crypt_t();
+                ++plan.nagg;
+              } else {
+                fanout_dest_t& d(plan.dest[plan.ndest]);
+                d.buf = nullptr;
+                plan.crypt[plan.ndest] =
+                    encrypt ? peer_crypt(ep) : fanout_crypt_t();
+                d.ep = destep;
+                ++plan.ndest;
+              }
+              if(redundant_ && (path != PATH_SRV)) {
+                // second path, to the other endpoint of the peer if
+                // it has two, or via the server if it relays:
+                endpoint_t altep(ep2int(destep) == ep2int(lanep) ? ep.ep
+                                                                 : lanep);
+                if(target_in_same_network && altep.sin_addr.s_addr &&
+                   (ep2int(altep) != ep2int(destep))) {
+                  fanout_dest_t& d(plan.dest[plan.ndest]);
+                  d.buf = nullptr;
+                  plan.crypt[plan.ndest] =
+                      encrypt ? peer_crypt(ep) : fanout_crypt_t();
+                  d.ep = altep;
+                  ++plan.ndest;
+                } else if(srv_relays_p2p) {
+                  sendtoserver = true;
+                }
+              }
+            }
+          } else if(!primary) {
+            sendtoserver = true;
+          }
+        } else if(primary) {
+          // ep is not B_PEER2PEER
+          sendtoserver = true;
+        }
+      }
+      ++ocid;
+    }
+  }
+  if(parity && (!srv_parity))
+    sendtoserver = false;
+  if(sendtoserver) {
+    if(primary)
+      ++plan.peers_total;
+    fanout_dest_t& d(plan.dest[plan.ndest]);
+    d.buf = nullptr;
+    plan.crypt[plan.ndest] = fanout_crypt_t();
+    // now check for encryption:
+    if(primary && (mode & B_ENCRYPTION) && snap.srv_has_pubkey) {
+      plan.crypt[plan.ndest].pubkey = snap.srv_pubkey;
+      ++plan.peers_encrypted;
+    }
+    d.ep = remote_server.get_destination();
+    d.ep.sin_port = htons(toport);
+    if(toport)
+      ++plan.ndest;
+  }
+  plan.version = snap.version;
+  plan.valid = true;
+}
+
+local_sender_t::local_sender_t() : cmsg(MAX_FANOUT * CMSGSIZE) {}
+
+void ovboxclient_t::forward_local(local_sender_t& sender, size_t len,
+                                  port_t destport, bool primary)
+{
+  // the message was received behind the header, so only the header
+  // needs to be packed:
+  size_t msglen_packed =
+      remote_server.packheader(sender.msg, BUFSIZE, destport, len);
+  if(msglen_packed)
+    send_packed(sender, sender.msg, msglen_packed, primary);
+}
+
+void ovboxclient_t::send_packed(local_sender_t& sender, const char* msg,
+                                size_t msglen, bool primary, bool parity)
+{
+  // the snapshot has to be held until all messages are sent, since
+  // the encryption parameters point into it:
+  auto snap(get_snapshot());
+  routing_plan_t& plan(parity ? sender.parity_plan : sender.plan);
+  update_routing_plan(*snap, plan, primary, parity);
+  // encrypt and send all copies, in parallel if workers are
+  // available. The worker pool is used only for the primary port:
+  encrypt_and_send(msg, msglen, plan.dest, plan.crypt, plan.ndest,
+                   sender.cmsg.data(), primary);
+  if(plan.nagg)
+    aggregate(msg, msglen, plan, sender.cmsg.data());
+  if(primary)
+    stream_tx_bytes += msglen;
+  if(primary && (!parity)) {
+    // parity messages are sent to fewer peers:
+    send_encrypt_any = (plan.peers_encrypted > 0);
+    send_encrypt_all =
+        send_encrypt_any && (plan.peers_encrypted == plan.peers_total);
+  }
+  size_t group(fec_group);
+  if(group && (msg_port(msg) > MAXSPECIALPORT)) {
+    // send the parity after the last message of a group. The header
+    // is packed directly, since special ports have no sequence number:
+    size_t plen(
+        sender.fec.add(msg, msglen, group, &(sender.parity[HEADERLEN])));
+    if(plen) {
+      msg_header_t hdr;
+      hdr.secret = remote_server.get_secret();
+      hdr.callerid = callerid;
+      hdr.port = PORT_FEC;
+      hdr.seq = 0;
+      hdr.store(sender.parity);
+      send_packed(sender, sender.parity, HEADERLEN + plen, primary, true);
+    }
+  }
+}
+
+void ovboxclient_t::send_local(char* buf, size_t len)
+{
+  if(!inproc_sender)
+    inproc_sender.reset(new local_sender_t());
+  // subtract port offset before forwarding to remote peers:
+  size_t msglen(remote_server.packheader(buf, BUFSIZE,
+                                         (port_t)(recport - portoffset), len));
+  if(msglen)
+    send_packed(*inproc_sender, buf, msglen, true);
+}
+
+void ovboxclient_t::send_local_cb(char* buf, size_t len, bool inplace,
+                                  void* data)
+{
+  if(len > BUFSIZE - HEADERLEN)
+    return;
+  if(!inplace)
+    memmove(buf + HEADERLEN, buf, len);
+  ((ovboxclient_t*)data)->send_local(buf, len);
+}
+
 // this thread receives local UDP messages and handles them:
 void ovboxclient_t::recsrv()
 {
   try {
     set_thread_prio(prio);
-    char buffer[BUFSIZE];
-    char msg[BUFSIZE];
-    char cmsg[BUFSIZE + crypto_box_SEALBYTES];
+    local_sender_t sender;
     endpoint_t sender_endpoint;
     log(recport, "listening");
     while(runsession) {
-      ssize_t n = local_server.recvfrom(buffer, BUFSIZE, sender_endpoint);
-      if(n > 0) {
+      ssize_t n = local_server.recvfrom(sender.payload(), BUFSIZE - HEADERLEN,
+                                        sender_endpoint);
+      if(n > 0)
         // subtract port offset before forwarding to remote peers:
-        size_t msglen_packed = remote_server.packmsg(
-            msg, BUFSIZE, (uint16_t)(recport - portoffset), buffer, n);
-        bool sendtoserver(!(mode & B_PEER2PEER));
-        uint32_t peers_total = 0;
-        uint32_t peers_encrypted = 0;
-        if(mode & B_PEER2PEER) {
-          // we are in peer-to-peer mode.
-          size_t ocid(0);
-          for(auto& ep : endpoints) {
-            if(ep.timeout) {
-              // target endpoint is active.
-              if(ocid != callerid) {
-                // not sending to ourself.
-                if(ep.mode & B_PEER2PEER) {
-                  // target/other end is in peer-to-peer mode.
-                  char* send_msg = msg;
-                  size_t send_len = msglen_packed;
-                  ++peers_total;
-                  // now check for encryption:
-                  if((mode & B_ENCRYPTION) && (ep.mode & B_ENCRYPTION) &&
-                     ep.has_pubkey) {
-                    send_len = encryptmsg(cmsg, BUFSIZE, msg, msglen_packed,
-                                          ep.pubkey);
-                    send_msg = cmsg;
-                    ++peers_encrypted;
-                  }
-		  // The destination is probably in the same network as this device if:
-		  // a) the external IP address is the same (tested below), and
-		  // b) the local IP addresses start with the three octets (not yet tested).
-		  // This test should be replaced by a test if the peer can be reached using local networking only.
-                  bool target_in_same_network(
-                      (endpoints[callerid].ep.sin_addr.s_addr ==
-                       ep.ep.sin_addr.s_addr) &&
-                      (ep.localep.sin_addr.s_addr != 0));
-                  if((!(bool)(ep.mode & B_DONOTSEND)) ||
-                     ((bool)(ep.mode & B_USINGPROXY) &&
-                      target_in_same_network)) {
-                    // sending is not deactivated.
-                    if((bool)(ep.mode & B_RECEIVEDOWNMIX_deprecated) ==
-                       (bool)(mode & B_SENDDOWNMIX_deprecated)) {
-                      // remote is receiving downmix and this is downmixer, or
-                      // remote is not expecting downmix and this is not a
-                      // downmixer (normal mode):
-                      if(sendlocal && target_in_same_network) {
-                        // same network.
-                        remote_server.send(send_msg, send_len, ep.localep);
-                      } else
-                        remote_server.send(send_msg, send_len, ep.ep);
-                    }
-                  }
-                } else {
-                  // ep is not B_PEER2PEER
-                  sendtoserver = true;
-                }
-              } // ocid != callerid
-            } // ep.timeout
-            ++ocid;
-          } // for( ep : endpoints )
-        } // this is not B_PEER2PEER
-        if(sendtoserver) {
-          // encrypt if needed:
-          char* send_msg = msg;
-          size_t send_len = msglen_packed;
-          ++peers_total;
-          // now check for encryption:
-          if((mode & B_ENCRYPTION) && srv_has_pubkey) {
-            send_len =
-                encryptmsg(cmsg, BUFSIZE, msg, msglen_packed, srv_pubkey);
-            send_msg = cmsg;
-            ++peers_encrypted;
-          }
-          remote_server.send(send_msg, send_len, toport);
-        }
-        send_encrypt_any = (peers_encrypted > 0);
-        send_encrypt_all = send_encrypt_any && (peers_encrypted == peers_total);
-      }
+        forward_local(sender, (size_t)n, (uint16_t)(recport - portoffset),
+                      true);
     }
   }
   catch(const std::exception& e) {
@@ -609,61 +1551,14 @@ void ovboxclient_t::xrecsrv(port_t srcport, port_t destport)
     // xlocal_server.bind(srcport, true);
     xlocal_server.bind(srcport, false);
     set_thread_prio(prio);
-    char buffer[BUFSIZE];
-    char msg[BUFSIZE];
-    char cmsg[BUFSIZE + crypto_box_SEALBYTES];
+    local_sender_t sender;
     endpoint_t sender_endpoint;
     log(recport, "listening");
     while(runsession) {
-      ssize_t n = xlocal_server.recvfrom(buffer, BUFSIZE, sender_endpoint);
-      if(n > 0) {
-        size_t msglen_packed =
-            remote_server.packmsg(msg, BUFSIZE, destport, buffer, n);
-        bool sendtoserver(!(mode & B_PEER2PEER));
-        if(mode & B_PEER2PEER) {
-          // we are in peer-to-peer mode.
-          size_t ocid(0);
-          for(auto& ep : endpoints) {
-            if(ep.timeout) {
-              // target endpoint is active.
-              if(ocid != callerid) {
-                // not sending to ourself.
-                if(ep.mode & B_PEER2PEER) {
-                  // target/other end is in peer-to-peer mode.
-                  char* send_msg = msg;
-                  size_t send_len = msglen_packed;
-                  // now check for encryption:
-                  if((mode & B_ENCRYPTION) && (ep.mode & B_ENCRYPTION) &&
-                     ep.has_pubkey) {
-                    send_len = encryptmsg(cmsg, BUFSIZE, msg, msglen_packed,
-                                          ep.pubkey);
-                    send_msg = cmsg;
-                  }
-                  bool target_in_same_network(
-                      (endpoints[callerid].ep.sin_addr.s_addr ==
-                       ep.ep.sin_addr.s_addr) &&
-                      (ep.localep.sin_addr.s_addr != 0));
-                  if((!(bool)(ep.mode & B_DONOTSEND)) ||
-                     ((bool)(ep.mode & B_USINGPROXY) &&
-                      target_in_same_network)) {
-                    if(sendlocal && target_in_same_network)
-                      // same network.
-                      remote_server.send(send_msg, send_len, ep.localep);
-                    else
-                      remote_server.send(send_msg, send_len, ep.ep);
-                  } else {
-                    sendtoserver = true;
-                  }
-                }
-              }
-            }
-            ++ocid;
-          }
-        }
-        if(sendtoserver) {
-          remote_server.send(msg, msglen_packed, toport);
-        }
-      }
+      ssize_t n = xlocal_server.recvfrom(sender.payload(), BUFSIZE - HEADERLEN,
+                                         sender_endpoint);
+      if(n > 0)
+        forward_local(sender, (size_t)n, destport, false);
     }
   }
   catch(const std::exception& e) {
@@ -672,7 +1567,138 @@ void ovboxclient_t::xrecsrv(port_t srcport, port_t destport)
   }
 }
 
+#ifdef HAS_REACTOR
+void ovboxclient_t::start_reactor(size_t nthreads)
+{
+  rstate = new reactor_state_t(nthreads > 1);
+  reactor_t& reactor(rstate->reactor);
+  // messages from relay server and peers:
+  reactor.add(remote_server.getsockfd(), [this]() {
+    size_t nmsg(remote_server.recv_sec_msg(rstate->msg, RECV_BATCHSIZE));
+    std::lock_guard<std::mutex> lk(rstate->msorter);
+    process_received(rstate->msg, nmsg);
+    arm_sorter_timer();
+  });
+  rstate->sortertimer = reactor.add_timer([this]() {
+    std::lock_guard<std::mutex> lk(rstate->msorter);
+    process_received(&(rstate->timermsg), 0);
+    arm_sorter_timer();
+  });
+  // messages from local primary port, port offset is subtracted
+  // before forwarding to remote peers:
+  reactor.add(local_server.getsockfd(), [this]() {
+    endpoint_t sender_endpoint;
+    ssize_t n(local_server.recvfrom(rstate->sender.payload(),
+                                    BUFSIZE - HEADERLEN, sender_endpoint));
+    if(n > 0)
+      forward_local(rstate->sender, (size_t)n,
+                    (uint16_t)(recport - portoffset), true);
+  });
+  // beacons of peers in the local network:
+  if(beacon)
+    reactor.add(beacon->getsockfd(), [this]() {
+      if(beacon->recv_sec_msg(rstate->beaconmsg))
+        answer_beacon(rstate->beaconmsg);
+    });
+  // periodic tasks:
+  rstate->pingtimer = reactor.add_timer([this]() {
+    send_pings();
+    update_reactor_timers();
+  });
+  rstate->statustimer = reactor.add_timer([this]() { update_status(); });
+  rstate->aggtimer = reactor.add_timer([this]() { flush_aggregates(); });
+  update_reactor_timers();
+  for(size_t k = 0; k < nthreads; ++k)
+    rstate->threads.emplace_back(std::thread([this]() {
+      try {
+        set_thread_prio(prio);
+        rstate->reactor.run(runsession);
+      }
+      catch(const std::exception& e) {
+        std::cerr << "Error: " << e.what() << std::endl;
+        runsession = false;
+      }
+    }));
+}
+
+void ovboxclient_t::arm_sorter_timer()
+{
+  int wait_usec(sorter.get_wait_usec(sorter_clock_t::now()));
+  if(wait_usec >= 0)
+    reactor_t::set_timer(rstate->sortertimer,
+                         (uint32_t)std::max(1, wait_usec), false);
+}
+
+void ovboxclient_t::update_reactor_timers()
+{
+  // the ping period can change at runtime, see set_hiresping():
+  int period(pingperiodms);
+  if(period != rstate->timerperiodms) {
+    rstate->timerperiodms = period;
+    reactor_t::set_timer(rstate->pingtimer, 1000u * (uint32_t)period, true);
+    reactor_t::set_timer(rstate->statustimer, 1000u * (uint32_t)period, true);
+  }
+}
+#endif
+
+message_sorter_t::stream_t* message_sorter_t::find_stream(const msgbuf_t& msg,
+                                                         bool& isnew)
+{
+  isnew = false;
+  if(msg.cid >= MAX_STAGE_ID)
+    return NULL;
+  stream_t* devstreams(streams[msg.cid]);
+  // linear probing, starting at the port modulo table size, since
+  // ports of a device are typically consecutive:
+  size_t idx(msg.destport % SORTER_PORTS);
+  for(size_t k = 0; k < SORTER_PORTS; ++k) {
+    stream_t& stream(devstreams[idx]);
+    if(!stream.used) {
+      stream.used = true;
+      stream.port = msg.destport;
+      stream.seq_in = 0;
+      stream.seq_out = 0;
+      stream.seen = 0;
+      isnew = true;
+      return &stream;
+    }
+    if(stream.port == msg.destport)
+      return &stream;
+    idx = (idx + 1) % SORTER_PORTS;
+  }
+  return NULL;
+}
+
+bool message_sorter_t::is_duplicate(stream_t& stream, sequence_t seq,
+                                    bool isnew)
+{
+  sequence_t d((sequence_t)(seq - stream.seq_top));
+  if(isnew || (d > 0)) {
+    // new highest sequence number:
+    stream.seen = (isnew || (d >= 32)) ? 1u : ((stream.seen << d) | 1u);
+    stream.seq_top = seq;
+    return false;
+  }
+  if(d <= -32)
+    // too old to tell, e.g., after a restart of the sender:
+    return false;
+  uint32_t bit(1u << (-d));
+  if(stream.seen & bit)
+    return true;
+  stream.seen |= bit;
+  return false;
+}
+
 bool message_sorter_t::process(msgbuf_t** ppmsg)
+{
+  // the time is needed only if a reorder window is used:
+  if(nheld || depth)
+    return process(ppmsg, sorter_clock_t::now());
+  return process(ppmsg, sorter_clock_t::time_point());
+}
+
+bool message_sorter_t::process(msgbuf_t** ppmsg,
+                               const sorter_clock_t::time_point& now)
 {
   if((*ppmsg)->valid) {
     msgbuf_t* pmsg(*ppmsg);
@@ -681,69 +1707,228 @@ bool message_sorter_t::process(msgbuf_t** ppmsg)
       pmsg->valid = false;
       return true;
     }
+    bool isnew(false);
+    stream_t* stream(find_stream(*pmsg, isnew));
+    if(!stream) {
+      // no sequence tracking possible, pass message unsorted:
+      pmsg->valid = false;
+      return true;
+    }
+    message_stat_t& st(stat[pmsg->cid]);
+    if(is_duplicate(*stream, pmsg->seq, isnew)) {
+      ++st.duplicates;
+      pmsg->valid = false;
+      return false;
+    }
     // we received a message, check for sequence order
-    ++stat[pmsg->cid].received;
-    bool notfirst(seq_in[pmsg->cid].find(pmsg->destport) !=
-                  seq_in[pmsg->cid].end());
+    ++st.received;
     // get input sequence difference:
-    sequence_t dseq_in(deltaseq(seq_in, *pmsg));
-    sequence_t dseq_io(deltaseq_const(seq_out, *pmsg));
-    if((dseq_in != 0) && notfirst)
-      stat[pmsg->cid].lost += dseq_in - 1;
+    sequence_t dseq_in((sequence_t)(pmsg->seq - stream->seq_in));
+    stream->seq_in = pmsg->seq;
+    st.seqerr_in += (dseq_in < 0);
+    if(depth || stream->nheld) {
+      if(isnew)
+        stream->seq_out = pmsg->seq;
+      return process_window(ppmsg, *stream, now);
+    }
+    sequence_t dseq_io((sequence_t)(pmsg->seq - stream->seq_out));
+    if((dseq_in != 0) && (!isnew))
+      st.lost += (size_t)(dseq_in - 1);
     // dropout:
     if((dseq_in > 1) && (dseq_io > 1)) {
-      buf1.copy(*pmsg);
-      (*ppmsg)->valid = false;
+      buf1.take(*pmsg);
       return false;
     }
-    stat[pmsg->cid].seqerr_in += (dseq_in < 0);
     if((dseq_in < -1) || ((dseq_io > 1) && (dseq_in > 0))) {
       if(buf1.valid && (buf1.cid == pmsg->cid) &&
          (buf1.destport == pmsg->destport) && (buf1.seq < pmsg->seq)) {
-        buf2.copy(*pmsg);
+        buf2.take(*pmsg);
         *ppmsg = &buf1;
         buf1.valid = false;
-        sequence_t dseq_out(deltaseq(seq_out, buf1));
-        stat[pmsg->cid].seqerr_out += (dseq_out < 0);
+        sequence_t dseq_out(deltaseq_out(*stream, buf1));
+        st.seqerr_out += (dseq_out < 0);
         return true;
       }
     }
-    sequence_t dseq_out(deltaseq(seq_out, *pmsg));
+    sequence_t dseq_out(deltaseq_out(*stream, *pmsg));
     pmsg->valid = false;
-    stat[pmsg->cid].seqerr_out += (dseq_out < 0);
+    st.seqerr_out += (dseq_out < 0);
     return true;
   }
+  // release buffered messages, their streams are already known:
+  bool isnew(false);
   if(buf1.valid) {
     *ppmsg = &buf1;
-    sequence_t dseq_out(deltaseq(seq_out, buf1));
     buf1.valid = false;
-    stat[buf1.cid].seqerr_out += (dseq_out < 0);
+    stream_t* stream(find_stream(buf1, isnew));
+    if(stream) {
+      sequence_t dseq_out(deltaseq_out(*stream, buf1));
+      stat[buf1.cid].seqerr_out += (dseq_out < 0);
+    }
     return true;
   }
   if(buf2.valid) {
-    sequence_t dseq_out(deltaseq(seq_out, buf2));
     *ppmsg = &buf2;
     buf2.valid = false;
-    stat[buf2.cid].seqerr_out += (dseq_out < 0);
+    stream_t* stream(find_stream(buf2, isnew));
+    if(stream) {
+      sequence_t dseq_out(deltaseq_out(*stream, buf2));
+      stat[buf2.cid].seqerr_out += (dseq_out < 0);
+    }
     return true;
   }
+  return release(ppmsg, now);
+}
+
+bool message_sorter_t::process_window(msgbuf_t** ppmsg, stream_t& stream,
+                                      const sorter_clock_t::time_point& now)
+{
+  msgbuf_t* pmsg(*ppmsg);
+  message_stat_t& st(stat[pmsg->cid]);
+  sequence_t dseq_out((sequence_t)(pmsg->seq - stream.seq_out));
+  pmsg->valid = false;
+  if(dseq_out == 1) {
+    // next message in sequence:
+    stream.seq_out = pmsg->seq;
+    return true;
+  }
+  if(dseq_out <= 0) {
+    // message arrived after it was skipped, or is a duplicate:
+    st.seqerr_out += (dseq_out < 0);
+    return true;
+  }
+  // there is a gap, so try to hold the message:
+  for(size_t k = 0; k < SORTER_MAXDEPTH; ++k)
+    if(held[k].valid && (held_stream[k] == &stream) &&
+       (held[k].seq == pmsg->seq))
+      // duplicate of a held message:
+      return false;
+  size_t free_idx(SORTER_MAXDEPTH);
+  if(stream.nheld < std::min(depth.load(), (size_t)SORTER_MAXDEPTH)) {
+    for(size_t k = 0; k < SORTER_MAXDEPTH; ++k)
+      if(!held[k].valid) {
+        free_idx = k;
+        break;
+      }
+  }
+  if((free_idx == SORTER_MAXDEPTH) && stream.nheld) {
+    // the window is full. If the oldest held message of this stream
+    // is before this message, then skip to it, and hold this message
+    // in its place:
+    size_t idx(first_held(stream));
+    if((sequence_t)(pmsg->seq - held[idx].seq) > 0) {
+      outbuf.take(*skip_to_held(idx));
+      *ppmsg = &outbuf;
+      free_idx = idx;
+    }
+  }
+  if(free_idx < SORTER_MAXDEPTH) {
+    held[free_idx].take(*pmsg);
+    held[free_idx].valid = true;
+    held_stream[free_idx] = &stream;
+    held_deadline[free_idx] = now + std::chrono::microseconds(deadline_usec);
+    ++stream.nheld;
+    ++nheld;
+    return (*ppmsg == &outbuf);
+  }
+  // no space, skip the gap and forward this message:
+  st.lost += (size_t)(dseq_out - 1);
+  stream.seq_out = pmsg->seq;
+  return true;
+}
+
+bool message_sorter_t::release(msgbuf_t** ppmsg,
+                               const sorter_clock_t::time_point& now)
+{
+  if(!nheld)
+    return false;
+  // release messages which are now in sequence:
+  for(size_t k = 0; k < SORTER_MAXDEPTH; ++k)
+    if(held[k].valid &&
+       ((sequence_t)(held[k].seq - held_stream[k]->seq_out) <= 1)) {
+      *ppmsg = skip_to_held(k);
+      return true;
+    }
+  // skip missing messages of streams with expired deadline:
+  for(size_t k = 0; k < SORTER_MAXDEPTH; ++k)
+    if(held[k].valid && (held_deadline[k] <= now)) {
+      *ppmsg = skip_to_held(first_held(*(held_stream[k])));
+      return true;
+    }
   return false;
 }
 
+size_t message_sorter_t::first_held(const stream_t& stream) const
+{
+  size_t idx(SORTER_MAXDEPTH);
+  for(size_t k = 0; k < SORTER_MAXDEPTH; ++k)
+    if(held[k].valid && (held_stream[k] == &stream) &&
+       ((idx == SORTER_MAXDEPTH) ||
+        ((sequence_t)(held[k].seq - held[idx].seq) < 0)))
+      idx = k;
+  return idx;
+}
+
+msgbuf_t* message_sorter_t::skip_to_held(size_t idx)
+{
+  msgbuf_t& msg(held[idx]);
+  stream_t& stream(*(held_stream[idx]));
+  sequence_t dseq_out((sequence_t)(msg.seq - stream.seq_out));
+  if(dseq_out > 1)
+    stat[msg.cid].lost += (size_t)(dseq_out - 1);
+  if(dseq_out > 0)
+    stream.seq_out = msg.seq;
+  --stream.nheld;
+  --nheld;
+  msg.valid = false;
+  return &msg;
+}
+
+void message_sorter_t::set_depth(size_t depth_)
+{
+  depth = std::min(depth_, (size_t)SORTER_MAXDEPTH);
+}
+
+void message_sorter_t::set_deadline_usec(uint32_t usec)
+{
+  deadline_usec = usec;
+}
+
+int message_sorter_t::get_wait_usec(const sorter_clock_t::time_point& now) const
+{
+  if(!nheld)
+    return -1;
+  sorter_clock_t::time_point next(sorter_clock_t::time_point::max());
+  for(size_t k = 0; k < SORTER_MAXDEPTH; ++k)
+    if(held[k].valid)
+      next = std::min(next, held_deadline[k]);
+  if(next <= now)
+    return 0;
+  return (int)std::chrono::duration_cast<std::chrono::microseconds>(next - now)
+      .count();
+}
+
 message_stat_t message_sorter_t::get_stat(stage_device_id_t id)
 {
-  return stat[id];
+  if(id < MAX_STAGE_ID)
+    return stat[id];
+  return message_stat_t();
 }
 
 ping_stat_collector_t::ping_stat_collector_t(size_t N)
-    : sent(0), received(0), data(N, 0.0), idx(0), filled(0), sum(0.0)
+    : received(0), data(N, 0.0), idx(0), filled(0), sum(0.0)
 {
 }
 
 void ping_stat_collector_t::add_value(float pt)
 {
+  std::lock_guard<std::mutex> lk(mtx);
   ++received;
   sum -= data[idx];
+  if(filled == data.size())
+    hist.remove(data[idx]);
+  hist.add(pt);
+  report_hist.add(pt);
   data[idx] = pt;
   sum += pt;
   ++idx;
@@ -753,35 +1938,135 @@ void ping_stat_collector_t::add_value(float pt)
     ++filled;
 }
 
-void ping_stat_collector_t::update_ping_stat(ping_stat_t& ps) const
+std::string to_string(path_t path)
+{
+  switch(path) {
+  case PATH_P2P:
+    return "p2p";
+  case PATH_SRV:
+    return "srv";
+  case PATH_LOC:
+    return "loc";
+  default:
+    return "";
+  }
+}
+
+bool path_selector_t::update(const ping_stat_t* const stat[PATH_NONE],
+                             uint8_t allowed)
+{
+  // cost of each path, negative if the path is not available:
+  float cost[PATH_NONE];
+  path_t best(PATH_NONE);
+  for(uint8_t k = 0; k < PATH_NONE; ++k) {
+    const ping_stat_t& ps(*(stat[k]));
+    cost[k] = -1.0f;
+    if(!(allowed & (1u << k)) || (ps.received == 0) || (ps.t_p99 < 0.0f))
+      continue;
+    // the reply to the last ping may still be on its way:
+    size_t lost(ps.lost - std::min((size_t)1, ps.lost));
+    float lossrate((float)lost / (float)(ps.received + lost));
+    cost[k] = ps.t_p99;
+    if(lossrate > PATH_MAXLOSS)
+      cost[k] += 1.0e4f;
+    if((best == PATH_NONE) || (cost[k] < cost[best]))
+      best = (path_t)k;
+  }
+  if(best == PATH_NONE) {
+    // no information, keep the current path:
+    count = 0;
+    return false;
+  }
+  if((path == PATH_NONE) || (cost[path] < 0.0f)) {
+    // first selection, or current path is not available:
+    count = 0;
+    path = best;
+    return true;
+  }
+  if((best == path) || (cost[best] + PATH_HYSTERESIS_MS > cost[path])) {
+    count = 0;
+    return false;
+  }
+  if(best != candidate)
+    count = 0;
+  candidate = best;
+  if(++count < PATH_SWITCHCOUNT)
+    return false;
+  count = 0;
+  path = best;
+  return true;
+}
+
+void ping_stat_collector_t::update_ping_stat(ping_stat_t& ps,
+                                             bool report_hist_)
+{
+  latency_histogram_t rhist;
+  {
+    std::lock_guard<std::mutex> lk(mtx);
+    get_stat(ps);
+    if(report_hist_) {
+      rhist = report_hist;
+      report_hist.clear();
+    }
+  }
+  if(!report_hist_)
+    return;
+  // the list of buckets is allocated only after releasing the lock,
+  // to avoid blocking the receiving thread:
+  ps.hist.clear();
+  for(size_t k = 0; k < HIST_BUCKETS; ++k)
+    if(rhist.get_count(k))
+      ps.hist.push_back({(uint16_t)k, rhist.get_count(k)});
+}
+
+void ping_stat_snapshot_t::read(ping_stat_collector_t& coll, ping_stat_t& ps,
+                                bool report_hist)
+{
+  std::lock_guard<std::mutex> lk(mtx);
+  coll.update_ping_stat(snap, report_hist);
+  ps.t_min = snap.t_min;
+  ps.t_med = snap.t_med;
+  ps.t_p99 = snap.t_p99;
+  ps.t_mean = snap.t_mean;
+  // counts since the previous read of this reader:
+  ps.received = snap.state_received - ps.state_received;
+  ps.lost = snap.state_sent - ps.state_sent;
+  ps.lost -= std::min(ps.received, ps.lost);
+  ps.state_sent = snap.state_sent;
+  ps.state_received = snap.state_received;
+  if(report_hist) {
+    ps.hist.swap(snap.hist);
+    snap.hist.clear();
+  }
+}
+
+void ping_stat_collector_t::get_stat(ping_stat_t& ps) const
 {
   ps.t_min = -1.0;
   ps.t_med = -1.0;
   ps.t_p99 = -1.0;
   ps.t_mean = -1.0;
+  size_t sent_(sent);
   ps.received = received - ps.state_received;
-  ps.lost = sent - ps.state_sent;
+  ps.lost = sent_ - ps.state_sent;
   ps.lost -= std::min(ps.received, ps.lost);
-  ps.state_sent = sent;
+  ps.state_sent = sent_;
   ps.state_received = received;
   if(!filled)
     return;
-  std::vector<float> sb(data);
-  sb.resize(filled);
-  std::sort(sb.begin(), sb.end());
   size_t idx_med((size_t)(std::round(0.5f * ((float)filled - 1.0))));
   size_t idx_99((size_t)(std::round(0.99f * ((float)filled - 1.0))));
-  ps.t_med = sb[idx_med];
+  ps.t_med = hist.get_rank(idx_med);
   if((filled & 1) == 0) {
     // even number of samples, median is mean of two neighbours
     if(idx_med)
-      ps.t_med += sb[idx_med - 1];
+      ps.t_med += hist.get_rank(idx_med - 1);
     else
-      ps.t_med += sb[idx_med + 1];
+      ps.t_med += hist.get_rank(idx_med + 1);
     ps.t_med *= 0.5f;
   }
-  ps.t_min = sb[0];
-  ps.t_p99 = sb[idx_99];
+  ps.t_min = hist.get_rank(0);
+  ps.t_p99 = hist.get_rank(idx_99);
   ps.t_mean = sum / (float)filled;
   return;
 }
@@ -807,7 +2092,10 @@ std::string to_string(const message_stat_t& ms)
   return "received=" + std::to_string(ms.received) +
          " lost=" + std::to_string(ms.lost) + ctmp +
          std::to_string(ms.seqerr_in) +
-         " recovered=" + std::to_string(ms.seqerr_in - ms.seqerr_out);
+         " recovered=" + std::to_string(ms.seqerr_in - ms.seqerr_out) +
+         " fec=" + std::to_string(ms.fec_overhead) +
+         " fecrecovered=" + std::to_string(ms.fec_recovered) +
+         " duplicates=" + std::to_string(ms.duplicates);
 }
 
 /*
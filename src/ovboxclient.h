@@ -22,65 +22,475 @@
 #define OVBOXCLIENT
 
 #include "callerlist.h"
+#include "fec.h"
+#include "histogram.h"
 #include "ovtcpsocket.h"
+#include "reactor.h"
+#include "workerpool.h"
+#include <chrono>
+#include <condition_variable>
 #include <functional>
+#include <memory>
+#include <mutex>
 
 std::string to_string(const ping_stat_t& ps);
 std::string to_string(const message_stat_t& ms);
 
+/**
+ * Collect ping times of the last N pings.
+ *
+ * Quantiles are computed from a histogram of the last N ping times,
+ * without sorting or memory allocation. Ping times are added by the
+ * receiving thread and read by the status and ping threads through a
+ * ping_stat_snapshot_t, so all access is guarded by a mutex.
+ */
 class ping_stat_collector_t {
 public:
   ping_stat_collector_t(size_t N = 2048);
   void add_value(float pt);
-  // std::vector<double> get_min_med_99_mean_lost() const;
-  void update_ping_stat(ping_stat_t& ps) const;
-  size_t sent;
-  size_t received;
+  /**
+   * Update ping statistics from a consistent copy of the collector.
+   *
+   * @param ps Statistics, which also hold the state of the previous
+   * update of this consumer
+   * @param report_hist Move the distribution of ping times received
+   * since the last report to ps.hist. Only one consumer should
+   * report histograms.
+   */
+  void update_ping_stat(ping_stat_t& ps, bool report_hist = false);
+  std::atomic<size_t> sent{0};
 
 private:
+  // update statistics, with locked mutex:
+  void get_stat(ping_stat_t& ps) const;
+  std::mutex mtx;
+  size_t received;
   std::vector<float> data;
   size_t idx;
   size_t filled;
   float sum;
+  latency_histogram_t hist;
+  // distribution of ping times received since the last report:
+  latency_histogram_t report_hist;
 };
 
+/**
+ * Shared snapshot of a ping statistics collector.
+ *
+ * The status report and the path selection read the ping times of a
+ * peer in different threads and at different intervals. Both read
+ * through one snapshot, which is the only consumer of the collector,
+ * so the counts since the previous update of the collector are not
+ * split between them. Each reader keeps its own state in its
+ * ping_stat_t.
+ */
+class ping_stat_snapshot_t {
+public:
+  /**
+   * Update the snapshot from the collector and copy it to the
+   * statistics of one reader.
+   *
+   * @param coll Collector of this snapshot
+   * @param ps Statistics of the reader, which also hold the state of
+   * its previous read
+   * @param report_hist Move the distribution of ping times to
+   * ps.hist, see ping_stat_collector_t::update_ping_stat()
+   */
+  void read(ping_stat_collector_t& coll, ping_stat_t& ps,
+            bool report_hist = false);
+
+private:
+  std::mutex mtx;
+  ping_stat_t snap;
+};
+
+/**
+ * Paths of messages to a peer
+ */
+enum path_t : uint8_t {
+  /// Directly to the public address of the peer
+  PATH_P2P,
+  /// Via the relay server
+  PATH_SRV,
+  /// Directly to the local address of a peer in the same network
+  PATH_LOC,
+  /// No path was selected, use the static choice
+  PATH_NONE
+};
+
+/// Name of a path, as used in the client statistics
+std::string to_string(path_t path);
+
+// a path is switched only if the p99 ping time of the new path is
+// lower by this margin in milliseconds:
+#define PATH_HYSTERESIS_MS 2.0f
+// ...in this number of consecutive updates:
+#define PATH_SWITCHCOUNT 3
+// paths with a higher ping loss rate are used only if no other path
+// is available:
+#define PATH_MAXLOSS 0.02f
+// interval of path selection updates in milliseconds:
+#define PATH_UPDATE_MS 5000
+
+/**
+ * Select the path to a peer from the ping statistics of all paths.
+ *
+ * The path with the lowest 99th percentile of the ping time is
+ * selected, among the paths with a ping loss rate below PATH_MAXLOSS.
+ * To avoid toggling between paths of similar latency, a better path
+ * is selected only if it is better by PATH_HYSTERESIS_MS in
+ * PATH_SWITCHCOUNT consecutive updates, unless the current path is
+ * not available anymore.
+ */
+class path_selector_t {
+public:
+  /**
+   * Update the selection.
+   *
+   * @param stat Ping statistics since last update, indexed by path_t
+   * @param allowed Bit mask of allowed paths, bit k is path k
+   * @return True if the selected path changed
+   */
+  bool update(const ping_stat_t* const stat[PATH_NONE], uint8_t allowed);
+  path_t get() const { return path; };
+
+private:
+  path_t path = PATH_NONE;
+  path_t candidate = PATH_NONE;
+  size_t count = 0;
+};
+
+// multicast group and port of beacons for discovery of peers in the
+// local network:
+#define LAN_BEACON_GROUP "239.255.79.86"
+#define LAN_BEACON_PORT 4458
+// a peer is not locally reachable anymore after this number of ping
+// periods without a local pong:
+#define LAN_MAXMISS 4
+
+/**
+ * Reachability of peers in the local network.
+ *
+ * A peer is locally reachable only if it answered a local ping, i.e.,
+ * a ping to its local address or a beacon to the multicast group
+ * LAN_BEACON_GROUP. The sender of the local pong is used as the local
+ * endpoint of the peer, so no assumptions about network masks are
+ * needed.
+ */
+class lan_probe_t {
+public:
+  lan_probe_t();
+  /**
+   * Register a local pong, called by the receiving thread.
+   *
+   * @param cid Device ID of the peer
+   * @param sender Sender of the pong
+   */
+  void add_pong(stage_device_id_t cid, const endpoint_t& sender);
+  /**
+   * Update reachability after a ping period, called by the ping
+   * thread.
+   *
+   * @param active Bit mask of the active peers
+   * @return True if reachability or a local endpoint changed
+   */
+  bool update(uint32_t active);
+  bool is_reachable(stage_device_id_t cid) const
+  {
+    return (cid < MAX_STAGE_ID) && (reachable & (1u << cid));
+  };
+  /**
+   * Return the local endpoint of a reachable peer.
+   */
+  endpoint_t get_endpoint(stage_device_id_t cid) const;
+  /**
+   * Return true if a message was sent from the local endpoint of a
+   * reachable peer.
+   */
+  bool is_local(stage_device_id_t cid, const endpoint_t& sender) const;
+
+private:
+  // address and port of the local endpoints:
+  std::atomic<uint64_t> ep[MAX_STAGE_ID];
+  std::atomic<uint32_t> pongs[MAX_STAGE_ID];
+  std::atomic<bool> ep_changed{false};
+  // accessed by the ping thread only:
+  uint32_t pongs_seen[MAX_STAGE_ID];
+  uint32_t missed[MAX_STAGE_ID];
+  std::atomic<uint32_t> reachable{0};
+};
+
+// the uplink budget is reduced if the ping loss rate of direct paths
+// exceeds this value:
+#define UPLINK_MAXLOSS 0.05f
+// factor of budget reduction on loss:
+#define UPLINK_DECREASE 0.85
+// budget increase per update without loss, relative to the limit:
+#define UPLINK_INCREASE 0.05
+
+/**
+ * Estimate of the achievable upstream rate.
+ *
+ * The budget starts at a configured limit. It is reduced to a
+ * fraction of the measured upstream rate whenever the loss rate of
+ * pings on direct paths indicates a congested uplink, and increased
+ * again slowly while there is no loss (additive increase,
+ * multiplicative decrease).
+ */
+class uplink_budget_t {
+public:
+  /**
+   * Set the maximum upstream rate.
+   *
+   * @param limit Rate in bit/s, or zero for no limit
+   */
+  void set_limit(double limit);
+  /**
+   * Update the estimate.
+   *
+   * @param txrate Measured upstream rate in bit/s
+   * @param lossrate Ping loss rate of direct paths
+   * @return True if the budget changed
+   */
+  bool update(double txrate, double lossrate);
+  /// Current budget in bit/s, or zero if there is no limit
+  double get() const { return budget; };
+  /**
+   * Return the number of peers which can receive a direct copy.
+   *
+   * @param streamrate Rate of one copy of the stream in bit/s
+   * @param npeers Number of peers which could receive a direct copy
+   * @param server A copy is sent to the server anyway
+   *
+   * If not all peers fit into the budget, then one copy is reserved
+   * for the server, which relays the stream to the remaining peers.
+   */
+  size_t get_direct(double streamrate, size_t npeers, bool server) const;
+
+private:
+  double limit = 0.0;
+  double budget = 0.0;
+};
+
+// number of streams (ports) per device which can be sorted:
+#define SORTER_PORTS 16
+// maximum number of messages held in the reorder window:
+#define SORTER_MAXDEPTH 16
+
+typedef std::chrono::steady_clock sorter_clock_t;
+
+// maximum length of an aggregated datagram, below the typical MTU:
+#define AGGREGATE_MAXLEN 1400
+
 /**
  * Sort out-of-order messages.
  *
- * This class tries to sort out-of-order messages. It can re-order
- * swapped messages (e.g., series like 1-2-4-3-5), if the missing
- * message is arriving within a certain time.
+ * This class tries to sort out-of-order messages. By default it can
+ * re-order swapped messages (e.g., series like 1-2-4-3-5), if the
+ * missing message is arriving before the next message.
+ *
+ * If a reorder window is configured with set_depth(), then up to
+ * depth messages per stream are held back until the missing messages
+ * arrive, or until the deadline of the held messages has passed.
+ * Missing messages are counted as lost only when they are skipped.
+ *
+ * Duplicates of the last 32 sequence numbers of a stream, e.g., the
+ * second copy of a message which was sent over two paths, are
+ * dropped before sorting, see ovboxclient_t::set_redundancy().
+ *
+ * Sequence numbers are stored in a fixed table per device, with a
+ * small open-addressed table of ports, so no memory is allocated
+ * while processing messages. Held messages are taken over by
+ * exchanging buffers with the caller, see msgbuf_t::take(), so
+ * messages are not copied. Messages of devices with an ID of
+ * MAX_STAGE_ID or higher, and of more than SORTER_PORTS ports of a
+ * device, are passed without sorting.
  */
 class message_sorter_t {
 public:
+  /**
+   * Process a received message, or release held messages.
+   *
+   * @param msg Pointer to the received message. If the message is
+   * valid, it is processed, otherwise held messages are released.
+   * On return, it points to the message to be forwarded.
+   * @return True if *msg should be forwarded, and process() should
+   * be called again
+   */
   bool process(msgbuf_t** msg);
+  bool process(msgbuf_t** msg, const sorter_clock_t::time_point& now);
   message_stat_t get_stat(stage_device_id_t id);
+  /**
+   * Set depth of the reorder window.
+   *
+   * @param depth Maximum number of held messages per stream, at most
+   * SORTER_MAXDEPTH, or zero to re-order only swapped pairs
+   *
+   * This function can be called while messages are processed.
+   */
+  void set_depth(size_t depth);
+  /**
+   * Set time after which held messages are released.
+   *
+   * @param usec Deadline in microseconds
+   */
+  void set_deadline_usec(uint32_t usec);
+  /**
+   * Return time until the next deadline of a held message.
+   *
+   * @return Time in microseconds, or -1 if no message is held
+   */
+  int get_wait_usec(const sorter_clock_t::time_point& now) const;
 
 private:
-  inline sequence_t deltaseq(std::map<stage_device_id_t, sequence_map_t>& seq,
-                             const msgbuf_t& msg)
-  {
-    sequence_t dseq_((sequence_t)(msg.seq - seq[msg.cid][msg.destport]));
-    seq[msg.cid][msg.destport] = msg.seq;
-    return dseq_;
+  /**
+   * Sequence state of one stream.
+   */
+  struct stream_t {
+    bool used = false;
+    port_t port = 0;
+    sequence_t seq_in = 0;
+    sequence_t seq_out = 0;
+    /// Number of messages held in the reorder window
+    size_t nheld = 0;
+    /// Highest received sequence number
+    sequence_t seq_top = 0;
+    /// Received sequence numbers, bit k is seq_top - k
+    uint32_t seen = 0;
   };
-  inline sequence_t
-  deltaseq_const(std::map<stage_device_id_t, sequence_map_t>& seq,
-                 const msgbuf_t& msg)
+  /**
+   * Find stream of a message, or add a new stream.
+   *
+   * @param msg Message
+   * @retval isnew True if the stream was added
+   * @return Stream, or NULL if the device ID is invalid or the port
+   * table of the device is full
+   */
+  stream_t* find_stream(const msgbuf_t& msg, bool& isnew);
+  /**
+   * Register a received sequence number of a stream.
+   *
+   * @return True if the sequence number was received before
+   */
+  bool is_duplicate(stream_t& stream, sequence_t seq, bool isnew);
+  inline sequence_t deltaseq_out(stream_t& stream, const msgbuf_t& msg)
   {
-    return (sequence_t)(msg.seq - seq[msg.cid][msg.destport]);
+    sequence_t dseq_((sequence_t)(msg.seq - stream.seq_out));
+    stream.seq_out = msg.seq;
+    return dseq_;
   };
-  std::map<stage_device_id_t, sequence_map_t> seq_in;
-  std::map<stage_device_id_t, sequence_map_t> seq_out;
+  bool process_window(msgbuf_t** ppmsg, stream_t& stream,
+                      const sorter_clock_t::time_point& now);
+  bool release(msgbuf_t** ppmsg, const sorter_clock_t::time_point& now);
+  /**
+   * Return index of the held message with the lowest sequence number
+   * of a stream.
+   */
+  size_t first_held(const stream_t& stream) const;
+  /**
+   * Skip to a held message, count the skipped messages as lost, and
+   * release the held message.
+   */
+  msgbuf_t* skip_to_held(size_t idx);
+  stream_t streams[MAX_STAGE_ID][SORTER_PORTS];
   msgbuf_t buf1;
   msgbuf_t buf2;
-  std::map<stage_device_id_t, message_stat_t> stat;
+  message_stat_t stat[MAX_STAGE_ID];
+  std::atomic_size_t depth{0};
+  std::atomic_uint32_t deadline_usec{5000};
+  // reorder window, shared by all streams:
+  msgbuf_t held[SORTER_MAXDEPTH];
+  stream_t* held_stream[SORTER_MAXDEPTH];
+  sorter_clock_t::time_point held_deadline[SORTER_MAXDEPTH];
+  size_t nheld = 0;
+  // buffer for messages released when the window is full:
+  msgbuf_t outbuf;
+};
+
+/**
+ * Encryption parameters of one fan-out destination
+ */
+struct fanout_crypt_t {
+  /// Public key for sealed box encryption, or NULL for no encryption
+  const uint8_t* pubkey = nullptr;
+  /// Session key, or NULL to use a sealed box
+  const uint8_t* sessionkey = nullptr;
+};
+
+// maximum number of destinations of one message: two paths to each
+// peer, and the server:
+#define MAX_FANOUT (2 * MAX_STAGE_ID + 1)
+
+/**
+ * Destinations of messages from one local port.
+ *
+ * The plan is derived from an endpoint table snapshot, and rebuilt
+ * only if the snapshot version changes.
+ */
+struct routing_plan_t {
+  /// True if the plan was built from a snapshot
+  bool valid = false;
+  /// Version of the snapshot used to build this plan
+  uint64_t version = 0;
+  /// Number of destinations
+  size_t ndest = 0;
+  fanout_dest_t dest[MAX_FANOUT];
+  fanout_crypt_t crypt[MAX_FANOUT];
+  /// Number of receivers, for encryption state reporting
+  uint32_t peers_total = 0;
+  /// Number of encrypted receivers
+  uint32_t peers_encrypted = 0;
+  /// Aggregation was enabled when the plan was built
+  bool aggregate = false;
+  /// Number of peers which receive aggregated messages, see
+  /// ovboxclient_t::set_aggregation()
+  size_t nagg = 0;
+  stage_device_id_t aggcid[MAX_STAGE_ID];
+  endpoint_t aggep[MAX_STAGE_ID];
+  fanout_crypt_t aggcrypt[MAX_STAGE_ID];
+  /// Redundant transmission was enabled when the plan was built
+  bool redundant = false;
+  /// Version of the path selection used to build this plan
+  uint64_t path_version = 0;
+  /// The server relayed between peer-to-peer devices when the plan
+  /// was built, see ovboxclient_t::srv_relays_p2p
+  bool srv_relays_p2p = false;
+};
+
+/**
+ * Buffers and routing plan for forwarding messages from one local port.
+ */
+struct local_sender_t {
+  local_sender_t();
+  /// Start of the received message, the header is packed in front of it
+  char* payload() { return &(msg[HEADERLEN]); };
+  // packed message:
+  char msg[BUFSIZE];
+  // one encryption buffer per destination, since all copies are sent
+  // with a single call:
+  std::vector<char> cmsg;
+  routing_plan_t plan;
+  // parity of sent messages, packed parity message and its routing
+  // plan:
+  fec_encoder_t fec;
+  char parity[BUFSIZE];
+  routing_plan_t parity_plan;
 };
 
 typedef std::function<void(stage_device_id_t, const std::string&,
                            const ping_stat_t&, void*)>
     latreport_cb_t;
 
+/**
+ * Receiver of messages for local ports within the same process.
+ *
+ * Arguments are the local destination port, the message, the length
+ * of the message and the user data. The return value is true if the
+ * message was consumed, otherwise it is delivered via UDP.
+ */
+typedef std::function<bool(port_t, const char*, size_t, void*)>
+    local_receiver_cb_t;
+
 /**
    Main communication between ovboxclient and relay server.
 
@@ -105,16 +515,24 @@ public:
      (not yet fully implemented)
      \param sendlocal allow sending to local IP address if in same network
      \param senddownmix send downmix to downmix layer, no physical inputs
+     \param reactor_threads number of threads of the event-driven mode,
+     or zero to use one thread per socket and task. The event-driven
+     mode is available on Linux only.
+     \param use_uring use io_uring for the network and local sockets
+     (Linux only, not combined with the event-driven mode). This is
+     experimental and not faster than the default, see uring_t.
    */
   ovboxclient_t(std::string desthost, port_t destport, port_t recport,
                 port_t portoffset, int prio, secret_t secret,
                 stage_device_id_t callerid, bool peer2peer, bool donotsend,
                 bool receivedownmix, bool sendlocal, double deadline,
                 bool senddownmix, bool usingproxy, bool use_tcp_tunnel,
-                bool encryption);
+                bool encryption, size_t reactor_threads = 0,
+                bool use_uring = false);
   virtual ~ovboxclient_t();
   void announce_new_connection(stage_device_id_t cid, const ep_desc_t& ep);
   void announce_connection_lost(stage_device_id_t cid);
+  void announce_caps(stage_device_id_t cid, epcaps_t caps);
   void announce_latency(stage_device_id_t cid, double lmin, double lmean,
                         double lmax, uint32_t received, uint32_t lost);
   void add_extraport(port_t dest);
@@ -130,44 +548,367 @@ public:
      own audio will be forwarded to the proxy clients.
    */
   void add_proxy_client(stage_device_id_t cid, const std::string& host);
+  /**
+     \brief Distribute messages to proxy clients via multicast
+     \ingroup proxymode
+
+     \param group Multicast group of the session, or empty to send to
+     each proxy client separately
+     \param proxy This device is the proxy
+
+     The proxy sends each forwarded message once to the group, on the
+     destination port of the message, instead of once per proxy
+     client. Proxy clients join the group, so that their local
+     receivers, which are bound to all interfaces, receive these
+     messages. This function should be called only once.
+   */
+  void set_proxy_multicast(const std::string& group, bool proxy);
   void add_receiverport(port_t srcport_t, port_t destport_t);
   void set_ping_callback(std::function<void(stage_device_id_t, port_t, double,
                                             const endpoint_t&, void*)>
                              f,
                          void* d);
   void set_latreport_callback(latreport_cb_t f, void* d);
+  /**
+   * Set the features of this device which are announced to the peers,
+   * see epcaps_t. CAP_FEC is always announced.
+   */
+  void set_caps(epcaps_t caps);
+  /**
+   * Set a callback which is called after the first ping of a peer and
+   * whenever the features of a peer change. The callback is called
+   * from the receiving thread.
+   */
+  void set_caps_callback(
+      std::function<void(stage_device_id_t, epcaps_t, void*)> f, void* d);
   void getbitrate(double& txrate, double& rxrate);
   void set_seqerr_callback(std::function<void(stage_device_id_t, sequence_t,
                                               sequence_t, port_t, void*)>
                                cb,
                            void* data);
   void update_client_stats(stage_device_id_t cid, client_stats_t& stats);
+  /**
+   * Read the ping statistics of all paths to a peer from the shared
+   * snapshots.
+   *
+   * @param cid Stage device ID of peer
+   * @param ps Statistics of the reader, indexed by path_t
+   * @param report_hist Move the distributions of ping times to the
+   * statistics; only the status report does
+   */
+  void read_ping_stats(stage_device_id_t cid, ping_stat_t* const ps[PATH_NONE],
+                       bool report_hist);
   /**
    * Set the deadline to wait for packages in case reordering is
    * required.
    */
   void set_reorder_deadline(double t_ms);
+  /**
+   * Set the number of messages per stream which can be held back
+   * until missing messages arrive. Zero re-orders only swapped pairs.
+   */
+  void set_reorder_depth(size_t depth);
+  /**
+   * Pass received messages for local ports to a receiver in the same
+   * process, e.g., a netaudio_receiver_t, instead of sending them to
+   * other processes.
+   *
+   * @param cb Receiver function, called from the thread which
+   * processes received messages
+   * @param data User data of receiver function
+   *
+   * This function can be called only once, and the receiver must stay
+   * valid until the ovboxclient_t is deleted.
+   */
+  void set_local_receiver_callback(local_receiver_cb_t cb, void* data);
+  /**
+   * Aggregate messages to peers into fewer datagrams.
+   *
+   * @param window_ms Time window in milliseconds, or zero to send
+   * each message in its own datagram
+   *
+   * Messages of all local ports which are sent within the time
+   * window are combined into one datagram per peer of up to
+   * AGGREGATE_MAXLEN bytes, which reduces the packet rate. Messages
+   * are aggregated only for peer-to-peer destinations which can
+   * receive aggregated messages (B_AGGREGATE), and each message is
+   * delayed by up to the time window.
+   */
+  void set_aggregation(double window_ms);
+  /**
+   * Send parity messages for forward error correction.
+   *
+   * @param group Number of data messages per parity message, see
+   * fec_valid_group(), or zero to switch off parity messages
+   *
+   * One lost message per group can be recovered by the receivers,
+   * for the cost of 1/group additional traffic. Parity messages are
+   * sent only to peers which announce CAP_FEC, and via the server
+   * only if all peers announce it.
+   */
+  void set_fec(size_t group);
+  /**
+   * Send messages of the primary port over two paths.
+   *
+   * @param enable Send a second copy of each direct peer-to-peer
+   * message over another path
+   *
+   * The second copy is sent to the local endpoint of a peer if the
+   * first one was sent to its public endpoint, or vice versa. If the
+   * peer has only one endpoint, the second copy is sent via the relay
+   * server, but only if the server was seen to relay messages between
+   * peer-to-peer devices (see srv_relays_p2p), since the stock server
+   * does not. The receivers keep the first copy of each message and
+   * drop the second one, see message_sorter_t, so a message is lost
+   * only if it is lost on both paths. This doubles the upstream
+   * bandwidth.
+   */
+  void set_redundancy(bool enable);
+  /**
+   * Select the path to each peer from the ping statistics.
+   *
+   * @param enable Select the path with the lowest latency, see
+   * path_selector_t, otherwise the path is chosen from the operation
+   * modes and the network addresses only
+   *
+   * The paths are updated every PATH_UPDATE_MS milliseconds. The
+   * relay server is selected for a peer-to-peer device only if the
+   * server relays between peer-to-peer devices, see srv_relays_p2p.
+   */
+  void set_path_selection(bool enable);
+  /**
+   * Return the path of messages to a peer.
+   */
+  path_t get_path(stage_device_id_t cid);
+  /**
+   * Set the upstream rate limit.
+   *
+   * @param kbps Maximum upstream rate in kbit/s, or zero for no limit
+   *
+   * If the direct copies of the primary stream to all peer-to-peer
+   * peers exceed the uplink budget (see uplink_budget_t), then the
+   * peers with the highest ping times receive the stream via the
+   * relay server instead, which needs a single copy. Peers are
+   * relayed only if the server relays between peer-to-peer devices
+   * (see srv_relays_p2p), otherwise all copies are sent directly.
+   */
+  void set_uplink_limit(double kbps);
+  /**
+   * Send a message of a sender in the same process to all peers, as
+   * if it was received on the local port.
+   *
+   * @param buf Buffer of BUFSIZE bytes. The message starts at buf +
+   * HEADERLEN, the header is packed into the first HEADERLEN bytes, so
+   * the message is not copied.
+   * @param len Length of message
+   *
+   * This function must be called from one thread only, and not while
+   * another process sends to the local port.
+   */
+  void send_local(char* buf, size_t len);
+  /**
+   * Send a message of a sender in the same process, see send_local().
+   *
+   * @param buf Buffer of BUFSIZE bytes, the message is copied into
+   * the first BUFSIZE - HEADERLEN bytes.
+   * @param len Length of message
+   * @param inplace The message starts at buf + HEADERLEN, otherwise
+   * at buf, i.e., the message is moved to make space for the header
+   * @param data Pointer to ovboxclient_t
+   */
+  static void send_local_cb(char* buf, size_t len, bool inplace, void* data);
   /**
    * Set flags for low loss, low latency, low jitter, assured
    * bandwidth, end-to-end service according to RFC2598 on outgoing
    * socket
    */
   void set_expedited_forwarding_PHB();
+  /**
+   * Start worker threads for parallel encryption of peer-to-peer
+   * messages.
+   *
+   * @param nthreads Number of worker threads
+   *
+   * The workers run with the same real-time priority as the sending
+   * and receiving threads. This is only helpful for peers which use
+   * sealed boxes, and can be called only once.
+   */
+  void set_encryption_workers(size_t nthreads);
 
   uint8_t get_encrypt_state() const
   {
     return (uint8_t)(send_encrypt_any + send_encrypt_all);
   };
 
+protected:
+  /**
+   * Rebuild a routing plan if the endpoint table has changed.
+   *
+   * @param snap Current snapshot of endpoint table
+   * @param plan Routing plan to update
+   * @param primary Routing of primary port (true) or of extra ports
+   * @param parity Routing of parity messages, only to peers with CAP_FEC
+   *
+   * The encryption keys in the plan point into the snapshot, thus the
+   * plan can be used only while the snapshot is held. Parity messages
+   * are sent over one path only.
+   */
+  void update_routing_plan(const endpoint_snapshot_t& snap,
+                           routing_plan_t& plan, bool primary,
+                           bool parity = false) const;
+  /**
+   * Forward a data message from outside the local network to the
+   * proxy clients (proxy mode).
+   *
+   * Messages of proxy clients are sent to each other client, the
+   * multicast group is used only for the messages of other peers.
+   */
+  void forward_to_proxy_clients(const msgbuf_t& msg);
+  // reachability of peers in the local network:
+  lan_probe_t lan;
+
 private:
   void sendsrv();
   void recsrv();
   void xrecsrv(port_t srcport, port_t destport);
   void pingservice();
+  void send_pings();
+  /**
+   * Answer beacons of peers in the local network (thread mode).
+   */
+  void beaconsrv();
+  /**
+   * Answer a beacon of a peer in the local network.
+   *
+   * @param msg Message received from the beacon socket
+   */
+  void answer_beacon(msgbuf_t& msg);
+  /**
+   * Update the path selection of all peers, if due.
+   */
+  void update_paths(const endpoint_snapshot_t& snap);
+  /**
+   * Update the uplink budget and the peers which receive messages
+   * via the server, see set_uplink_limit().
+   */
+  void update_uplink(const endpoint_snapshot_t& snap);
+  /**
+   * Sort and process received messages, and release held messages.
+   */
+  void process_received(msgbuf_t* msg, size_t nmsg);
+  /**
+   * Decrypt a received message, recover lost messages from parity
+   * messages, and sort and process the messages.
+   */
+  void receive_msg(msgbuf_t& msg);
+  /**
+   * Decrypt a received data or parity message in place. Messages
+   * which can not be decrypted remain unchanged.
+   */
+  void decrypt_msg(msgbuf_t& msg);
+  /**
+   * Sort a received message and process all messages which are ready.
+   */
+  void sort_msg(msgbuf_t& msg);
+  /**
+   * Deliver a message to a local receiver, in the same process or via
+   * UDP.
+   */
+  void deliver_local(const char* msg, size_t len, port_t port);
+  /**
+   * Send all pending local messages.
+   */
+  void flush_local();
+  /**
+   * Pack a message from a local port and send it to all destinations.
+   *
+   * @param sender Buffers and routing plan of local port, the message
+   * was received into local_sender_t::payload()
+   * @param len Length of message
+   * @param destport Destination port
+   * @param primary Message is from primary port
+   */
+  void forward_local(local_sender_t& sender, size_t len, port_t destport,
+                     bool primary);
+  /**
+   * Send a packed message to all destinations.
+   *
+   * @param sender Buffers and routing plan of local port
+   * @param msg Packed message
+   * @param msglen Length of packed message
+   * @param primary Message is from primary port
+   * @param parity Message is a parity message (PORT_FEC)
+   */
+  void send_packed(local_sender_t& sender, const char* msg, size_t msglen,
+                   bool primary, bool parity = false);
+#ifdef HAS_REACTOR
+  /**
+   * Start event-driven mode.
+   *
+   * @param nthreads Number of threads
+   */
+  void start_reactor(size_t nthreads);
+  void arm_sorter_timer();
+  void update_reactor_timers();
+#endif
   void handle_endpoint_list_update(stage_device_id_t cid, const endpoint_t& ep);
   void process_msg(msgbuf_t& msg);
+  /**
+   * Split an aggregated message and sort and process its messages.
+   */
+  void process_aggregate(const msgbuf_t& msg);
   void process_ping_msg(msgbuf_t& msg);
   void process_pong_msg(msgbuf_t& msg);
+  /**
+   * Return encryption parameters of a peer, using the session key if
+   * possible, or a sealed box otherwise.
+   */
+  fanout_crypt_t peer_crypt(const ep_desc_t& ep) const;
+  /**
+   * Encrypt the copies of a packed message and send them to all
+   * destinations.
+   *
+   * @param msg Packed message
+   * @param msglen Length of packed message
+   * @param dest Destinations, payload overrides are updated
+   * @param crypt Encryption parameters, one entry per destination
+   * @param ndest Number of destinations
+   * @param cmsg Buffer for encrypted copies, ndest*CMSGSIZE bytes
+   * @param parallel Use encryption worker pool, if available
+   */
+  void encrypt_and_send(const char* msg, size_t msglen, fanout_dest_t* dest,
+                        const fanout_crypt_t* crypt, size_t ndest, char* cmsg,
+                        bool parallel);
+  /**
+   * Encrypt a copy of a packed message.
+   *
+   * @param msg Packed message
+   * @param msglen Length of packed message
+   * @param crypt Encryption parameters, must have a public key
+   * @param cbuf Buffer of CMSGSIZE bytes for the encrypted copy
+   * @return Length of encrypted copy
+   */
+  size_t encrypt_copy(const char* msg, size_t msglen,
+                      const fanout_crypt_t& crypt, char* cbuf);
+  /**
+   * Append a packed message to the aggregated messages of the peers
+   * in a routing plan, encrypted if required.
+   *
+   * @param msg Packed message
+   * @param msglen Length of packed message
+   * @param plan Routing plan
+   * @param cbuf Buffer of CMSGSIZE bytes for encrypted copies
+   */
+  void aggregate(const char* msg, size_t msglen, const routing_plan_t& plan,
+                 char* cbuf);
+  /**
+   * Send all aggregated messages.
+   */
+  void flush_aggregates();
+  /**
+   * Send aggregated messages after the time window (thread mode).
+   */
+  void aggsrv();
 
   // real time priority:
   const int prio;
@@ -184,6 +925,10 @@ private:
    * \ingroup proxymode
    */
   std::map<stage_device_id_t, endpoint_t> proxyclients;
+  // multicast socket of proxy mode, see set_proxy_multicast():
+  std::unique_ptr<udpsocket_t> proxy_mc;
+  endpoint_t proxy_mc_ep;
+  std::atomic<bool> proxy_mc_send{false};
   // destination port of relay server:
   port_t toport;
   // receiver ports:
@@ -207,6 +952,8 @@ private:
   void* cb_ping_data = nullptr;
   latreport_cb_t cb_latreport = nullptr;
   void* cb_latreport_data = nullptr;
+  std::function<void(stage_device_id_t, epcaps_t, void*)> cb_caps = nullptr;
+  void* cb_caps_data = nullptr;
   bool sendlocal;
   size_t last_tx;
   size_t last_rx;
@@ -218,17 +965,86 @@ private:
   // msgbuf_t* msgbuffers;
   message_sorter_t sorter;
   // std::map<stage_device_id_t, message_stat_t> stats;
-  std::map<stage_device_id_t, ping_stat_collector_t> ping_stat_collecors_p2p;
-  std::map<stage_device_id_t, ping_stat_collector_t> ping_stat_collecors_srv;
-  std::map<stage_device_id_t, ping_stat_collector_t> ping_stat_collecors_local;
+  // ping statistics per peer and path, allocated in advance to avoid
+  // allocations in the receiver thread:
+  ping_stat_collector_t ping_stat_collecors_p2p[MAX_STAGE_ID];
+  ping_stat_collector_t ping_stat_collecors_srv[MAX_STAGE_ID];
+  ping_stat_collector_t ping_stat_collecors_local[MAX_STAGE_ID];
+  // snapshots of the collectors, indexed by peer and path_t:
+  ping_stat_snapshot_t ping_snapshots[MAX_STAGE_ID][PATH_NONE];
   std::map<stage_device_id_t, client_stats_t> client_stats_announce;
 
   ovtcpsocket_t* tcp_tunnel = nullptr;
 
   msgbuf_t decrypted_msg;
+  // group size of sent parity messages, or zero:
+  std::atomic<size_t> fec_group{0};
+  // send a second copy of primary messages, see set_redundancy():
+  std::atomic<bool> redundant{false};
+  // a data message of a peer-to-peer device was received from the
+  // server, so the server relays between peer-to-peer devices. The
+  // stock server does not, and messages sent to it for another
+  // peer-to-peer device would be lost:
+  std::atomic<bool> srv_relays_p2p{false};
+  // automatic path selection, accessed by the ping thread only:
+  std::atomic<bool> select_paths{false};
+  path_selector_t path_selector[MAX_STAGE_ID];
+  ping_stat_t path_stats[MAX_STAGE_ID][PATH_NONE];
+  int path_update_ms = 0;
+  // selected path per peer, and version which is incremented on change:
+  std::atomic<uint8_t> peer_path[MAX_STAGE_ID];
+  std::atomic<uint64_t> path_version{0};
+  // uplink budget, accessed by the ping thread only:
+  uplink_budget_t uplink;
+  size_t uplink_tx = 0;
+  size_t uplink_stream_tx = 0;
+  std::chrono::steady_clock::time_point t_uplink;
+  // bytes of one copy of the primary stream:
+  std::atomic<size_t> stream_tx_bytes{0};
+  // peers which receive messages via the server due to the budget:
+  std::atomic<uint32_t> relay_mask{0};
+  fec_decoder_t fec;
+  msgbuf_t recovered_msg;
+  local_receiver_cb_t cb_localrec = nullptr;
+  void* cb_localrec_data = nullptr;
+  // set after the local receiver callback was assigned:
+  std::atomic<bool> has_localrec{false};
+  // routing plan of messages from senders in the same process:
+  std::unique_ptr<local_sender_t> inproc_sender;
+  /**
+   * Aggregated messages to one peer
+   */
+  struct aggregate_t {
+    char buf[AGGREGATE_MAXLEN];
+    size_t len = 0;
+    endpoint_t ep;
+  };
+  // aggregation time window in microseconds, or zero:
+  std::atomic<uint32_t> aggregate_usec{0};
+  // aggregated messages per peer, allocated on first use:
+  std::vector<aggregate_t> aggregates;
+  // aggregated messages are pending and will be sent at aggregate_due:
+  bool aggregate_pending = false;
+  std::chrono::steady_clock::time_point aggregate_due;
+  std::mutex mtx_aggregate;
+  std::condition_variable cond_aggregate;
+  std::thread aggthread;
+  // socket for beacons of peers in the local network, and its
+  // thread in thread mode:
+  std::unique_ptr<ovbox_udpsocket_t> beacon;
+  std::thread beaconthread;
+  endpoint_t beacon_ep;
+  // message of an aggregated message, see process_aggregate():
+  msgbuf_t aggregated_msg;
 
   std::atomic<bool> send_encrypt_any{false};
   std::atomic<bool> send_encrypt_all{false};
+  // nonce counter for session key encryption, shared by all sending threads:
+  std::atomic<uint64_t> sessionkey_counter{0};
+  std::atomic<worker_pool_t*> cryptpool{nullptr};
+  // state of event-driven mode, or NULL:
+  struct reactor_state_t;
+  reactor_state_t* rstate = nullptr;
 };
 
 #endif
@@ -0,0 +1,125 @@
+/*
+ * This file is part of the ovbox software tool, see <http://orlandoviols.com/>.
+ *
+ * Copyright (c) 2021 Giso Grimm
+ */
+/*
+ * ovbox is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published
+ * by the Free Software Foundation, version 3 of the License.
+ *
+ * ovbox is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License, version 3 for more details.
+ *
+ * You should have received a copy of the GNU General Public License,
+ * Version 3 along with ovbox. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "reactor.h"
+
+#ifdef HAS_REACTOR
+
+#include "errmsg.h"
+#include <errno.h>
+#include <stdint.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+
+// maximum number of events handled per epoll_wait call:
+#define REACTOR_MAXEVENTS 16
+
+reactor_t::reactor_t(bool multithreaded_)
+    : epfd(epoll_create1(EPOLL_CLOEXEC)), multithreaded(multithreaded_)
+{
+  if(epfd < 0)
+    throw ErrMsg("Unable to create epoll instance: ", errno);
+}
+
+reactor_t::~reactor_t()
+{
+  for(auto& h : handlers)
+    if(h->is_timer)
+      ::close(h->fd);
+  ::close(epfd);
+}
+
+void reactor_t::add_handler(handler_t* h)
+{
+  std::lock_guard<std::mutex> lk(mtx);
+  handlers.emplace_back(h);
+  struct epoll_event ev;
+  ev.events = EPOLLIN;
+  // with more than one thread, each event is delivered only once,
+  // and the descriptor is re-armed after the handler returns:
+  if(multithreaded)
+    ev.events |= EPOLLONESHOT;
+  ev.data.ptr = h;
+  if(epoll_ctl(epfd, EPOLL_CTL_ADD, h->fd, &ev) != 0)
+    throw ErrMsg("Unable to add file descriptor to epoll instance: ", errno);
+}
+
+void reactor_t::add(int fd, std::function<void()> handler)
+{
+  add_handler(new handler_t{fd, false, handler});
+}
+
+int reactor_t::add_timer(std::function<void()> handler)
+{
+  int fd(timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC));
+  if(fd < 0)
+    throw ErrMsg("Unable to create timer: ", errno);
+  add_handler(new handler_t{fd, true, handler});
+  return fd;
+}
+
+void reactor_t::set_timer(int fd, uint32_t usec, bool periodic)
+{
+  struct itimerspec ts;
+  ts.it_value.tv_sec = usec / 1000000u;
+  ts.it_value.tv_nsec = 1000 * (long)(usec % 1000000u);
+  if(periodic)
+    ts.it_interval = ts.it_value;
+  else
+    ts.it_interval.tv_sec = ts.it_interval.tv_nsec = 0;
+  timerfd_settime(fd, 0, &ts, NULL);
+}
+
+void reactor_t::run(const bool& running)
+{
+  struct epoll_event events[REACTOR_MAXEVENTS];
+  while(running) {
+    int n(epoll_wait(epfd, events, REACTOR_MAXEVENTS, 100));
+    for(int k = 0; k < n; ++k) {
+      handler_t* h((handler_t*)(events[k].data.ptr));
+      if(h->is_timer) {
+        // read number of expirations to reset the timer state:
+        uint64_t expirations(0);
+        if(::read(h->fd, &expirations, sizeof(expirations)) !=
+           sizeof(expirations))
+          expirations = 0;
+        if(expirations)
+          h->fun();
+      } else {
+        h->fun();
+      }
+      if(multithreaded) {
+        struct epoll_event ev;
+        ev.events = EPOLLIN | EPOLLONESHOT;
+        ev.data.ptr = h;
+        epoll_ctl(epfd, EPOLL_CTL_MOD, h->fd, &ev);
+      }
+    }
+  }
+}
+
+#endif
+
+/*
+ * Local Variables:
+ * mode: c++
+ * compile-command: "make -C .."
+ * End:
+ */
@@ -0,0 +1,101 @@
+/*
+ * This file is part of the ovbox software tool, see <http://orlandoviols.com/>.
+ *
+ * Copyright (c) 2021 Giso Grimm
+ */
+/*
+ * ovbox is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published
+ * by the Free Software Foundation, version 3 of the License.
+ *
+ * ovbox is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License, version 3 for more details.
+ *
+ * You should have received a copy of the GNU General Public License,
+ * Version 3 along with ovbox. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef REACTOR_H
+#define REACTOR_H
+
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#if defined(__linux__)
+#define HAS_REACTOR
+#endif
+
+/**
+ * Event loop which dispatches readable sockets and timers to
+ * handlers, based on epoll and timerfd (Linux only).
+ *
+ * The loop can be run by several threads. In that case each file
+ * descriptor is handled by only one thread at a time, so handlers of
+ * the same descriptor do not need to be thread-safe.
+ */
+class reactor_t {
+public:
+  /**
+   * @param multithreaded Prepare for running the loop in more than
+   * one thread
+   */
+  reactor_t(bool multithreaded);
+  ~reactor_t();
+  reactor_t(const reactor_t&) = delete;
+  /**
+   * Register a file descriptor.
+   *
+   * @param fd File descriptor, owned by the caller
+   * @param handler Function which is called when fd is readable
+   *
+   * This function can be called while the loop is running.
+   */
+  void add(int fd, std::function<void()> handler);
+  /**
+   * Create a timer.
+   *
+   * @param handler Function which is called when the timer expires
+   * @return File descriptor of the timer, owned by the reactor
+   */
+  int add_timer(std::function<void()> handler);
+  /**
+   * Start or stop a timer.
+   *
+   * @param fd File descriptor of timer
+   * @param usec Time until expiration in microseconds, or zero to stop
+   * @param periodic Restart the timer after expiration
+   */
+  static void set_timer(int fd, uint32_t usec, bool periodic);
+  /**
+   * Run the loop until a flag is cleared.
+   *
+   * @param running Flag, checked at least every 100 ms
+   */
+  void run(const bool& running);
+
+private:
+  struct handler_t {
+    int fd;
+    bool is_timer;
+    std::function<void()> fun;
+  };
+  void add_handler(handler_t* h);
+  int epfd;
+  bool multithreaded;
+  std::mutex mtx;
+  std::vector<std::unique_ptr<handler_t>> handlers;
+};
+
+#endif
+
+/*
+ * Local Variables:
+ * mode: c++
+ * compile-command: "make -C .."
+ * End:
+ */
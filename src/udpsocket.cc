@@ -25,17 +25,21 @@
 #define MSG_CONFIRM 0
 
 #elif defined(LINUX) || defined(linux) || defined(__APPLE__)
+#include <arpa/inet.h>
 #include <ifaddrs.h>
 #include <net/if.h>
 #include <netdb.h>
 #include <netinet/in.h>
 #include <sys/ioctl.h>
+#include <sys/select.h>
 #include <unistd.h>
 #endif
 
 #include "MACAddressUtility.h"
 #include "errmsg.h"
 #include "udpsocket.h"
+#include "uring.h"
+#include <algorithm>
 #include <errno.h>
 
 #include <stdio.h>
@@ -58,7 +62,8 @@
 const size_t
     pingbufsize(HEADERLEN +
                 sizeof(std::chrono::high_resolution_clock::time_point) +
-                sizeof(stage_device_id_t) + sizeof(endpoint_t) + 100);
+                sizeof(stage_device_id_t) + sizeof(endpoint_t) +
+                sizeof(epcaps_t) + 100);
 
 endpoint_t ovgethostbyname(const std::string& host)
 {
@@ -85,7 +90,9 @@ endpoint_t ovgethostbyname(const std::string& host)
   return serv_addr;
 }
 
-udpsocket_t::udpsocket_t() : tx_bytes(0), rx_bytes(0)
+udpsocket_t::udpsocket_t(bool use_uring)
+    : timeout_usec(0), uring(nullptr), sendqueue_len(0), tx_bytes(0),
+      rx_bytes(0), syscalls(0)
 {
   // linux part, sets value pointed to by &serv_addr to 0 value:
   // bzero((char*)&serv_addr, sizeof(serv_addr));
@@ -117,6 +124,19 @@ udpsocket_t::udpsocket_t() : tx_bytes(0), rx_bytes(0)
 
   set_netpriority(6);
   isopen = true;
+#ifdef HAS_URING
+  if(use_uring) {
+    try {
+      uring = new uring_t(sockfd, syscalls);
+    }
+    catch(const std::exception& e) {
+      TASCAR::console_log(std::string(e.what()) + " Using system calls.");
+    }
+  }
+#else
+  if(use_uring)
+    TASCAR::console_log("io_uring is not available. Using system calls.");
+#endif
 }
 
 void udpsocket_t::set_netpriority(int priority)
@@ -154,6 +174,7 @@ udpsocket_t::~udpsocket_t()
 
 void udpsocket_t::set_timeout_usec(int usec)
 {
+  timeout_usec = usec;
   struct timeval tv;
   tv.tv_sec = 0;
   tv.tv_usec = usec;
@@ -167,6 +188,10 @@ void udpsocket_t::set_timeout_usec(int usec)
 
 void udpsocket_t::close()
 {
+#ifdef HAS_URING
+  delete uring;
+  uring = nullptr;
+#endif
   if(isopen)
 #if defined(WIN32) || defined(UNDER_CE)
     ::closesocket(sockfd);
@@ -221,6 +246,30 @@ port_t udpsocket_t::bind(port_t port, bool loopback)
   return ntohs(my_addr.sin_port);
 }
 
+void udpsocket_t::join_multicast(const char* group)
+{
+  struct ip_mreq mreq;
+  memset(&mreq, 0, sizeof(mreq));
+  mreq.imr_multiaddr.s_addr = inet_addr(group);
+  mreq.imr_interface.s_addr = htonl(INADDR_ANY);
+  if(setsockopt(sockfd, IPPROTO_IP, IP_ADD_MEMBERSHIP,
+                reinterpret_cast<const char*>(&mreq), sizeof(mreq)) == -1)
+    throw ErrMsg("Joining the multicast group " + std::string(group) +
+                     " failed: ",
+                 errno);
+}
+
+void udpsocket_t::set_multicast_loop(bool loop)
+{
+#if defined(WIN32) || defined(UNDER_CE)
+  DWORD optval(loop);
+#else
+  unsigned char optval(loop);
+#endif
+  setsockopt(sockfd, IPPROTO_IP, IP_MULTICAST_LOOP,
+             reinterpret_cast<const char*>(&optval), sizeof(optval));
+}
+
 endpoint_t udpsocket_t::getsockep()
 {
   endpoint_t my_addr;
@@ -237,6 +286,7 @@ ssize_t udpsocket_t::send(const char* buf, size_t len, uint16_t portno)
   serv_addr.sin_port = htons(portno);
   ssize_t tx(sendto(sockfd, buf, len, MSG_CONFIRM, (struct sockaddr*)&serv_addr,
                     sizeof(serv_addr)));
+  ++syscalls;
   if(tx > 0)
     tx_bytes += tx;
   return tx;
@@ -246,23 +296,187 @@ ssize_t udpsocket_t::send(const char* buf, size_t len, const endpoint_t& ep)
 {
   ssize_t tx(
       sendto(sockfd, buf, len, MSG_CONFIRM, (struct sockaddr*)&ep, sizeof(ep)));
+  ++syscalls;
   if(tx > 0)
     tx_bytes += tx;
   return tx;
 }
 
+size_t udpsocket_t::sendmmsg(const char* buf, size_t len,
+                             const fanout_dest_t* dest, size_t ndest)
+{
+  size_t nsent(0);
+#ifdef HAS_URING
+  if(uring) {
+    size_t txbytes(0);
+    nsent = uring->sendmmsg(buf, len, dest, ndest, txbytes);
+    tx_bytes += txbytes;
+    return nsent;
+  }
+#endif
+#if defined(__linux__)
+  struct mmsghdr msgs[MAX_STAGE_ID];
+  struct iovec iovecs[MAX_STAGE_ID];
+  size_t nproc(0);
+  while(nproc < ndest) {
+    size_t nmsg(std::min(ndest - nproc, (size_t)MAX_STAGE_ID));
+    memset(msgs, 0, sizeof(msgs));
+    for(size_t k = 0; k < nmsg; ++k) {
+      const fanout_dest_t& d(dest[nproc + k]);
+      if(d.buf) {
+        iovecs[k].iov_base = const_cast<char*>(d.buf);
+        iovecs[k].iov_len = d.len;
+      } else {
+        iovecs[k].iov_base = const_cast<char*>(buf);
+        iovecs[k].iov_len = len;
+      }
+      msgs[k].msg_hdr.msg_iov = &(iovecs[k]);
+      msgs[k].msg_hdr.msg_iovlen = 1;
+      msgs[k].msg_hdr.msg_name = const_cast<endpoint_t*>(&(d.ep));
+      msgs[k].msg_hdr.msg_namelen = sizeof(endpoint_t);
+    }
+    int tx(::sendmmsg(sockfd, msgs, (unsigned int)nmsg, MSG_CONFIRM));
+    ++syscalls;
+    if(tx <= 0) {
+      // skip the failing destination and continue with the next one,
+      // like individual sendto() calls would do:
+      ++nproc;
+      continue;
+    }
+    for(size_t k = 0; k < (size_t)tx; ++k)
+      tx_bytes += msgs[k].msg_len;
+    nproc += (size_t)tx;
+    nsent += (size_t)tx;
+  }
+  return nsent;
+#else
+  for(size_t k = 0; k < ndest; ++k) {
+    if(dest[k].buf) {
+      if(send(dest[k].buf, dest[k].len, dest[k].ep) > 0)
+        ++nsent;
+    } else {
+      if(send(buf, len, dest[k].ep) > 0)
+        ++nsent;
+    }
+  }
+  return nsent;
+#endif
+}
+
+void udpsocket_t::queue(const char* buf, size_t len, uint16_t portno)
+{
+  if(portno == 0)
+    return;
+  if(sendqueue_len == SEND_QUEUE_LEN)
+    flush();
+  // the storage is allocated on first use:
+  if(sendqueue_buf.empty())
+    sendqueue_buf.resize(SEND_QUEUE_LEN * BUFSIZE);
+  len = std::min(len, (size_t)BUFSIZE);
+  fanout_dest_t& d(sendqueue[sendqueue_len]);
+  char* qbuf(&(sendqueue_buf[sendqueue_len * BUFSIZE]));
+  memcpy(qbuf, buf, len);
+  d.ep = serv_addr;
+  d.ep.sin_port = htons(portno);
+  d.buf = qbuf;
+  d.len = len;
+  ++sendqueue_len;
+}
+
+size_t udpsocket_t::flush()
+{
+  size_t nsent(0);
+  if(sendqueue_len)
+    nsent = sendmmsg(NULL, 0, sendqueue, sendqueue_len);
+  sendqueue_len = 0;
+  return nsent;
+}
+
 ssize_t udpsocket_t::recvfrom(char* buf, size_t len, endpoint_t& addr)
 {
+#ifdef HAS_URING
+  if(uring) {
+    size_t rxlen(0);
+    if(recvmmsg(&buf, len, &rxlen, &addr, 1) == 0)
+      return -1;
+    return (ssize_t)rxlen;
+  }
+#endif
   memset(&addr, 0, sizeof(endpoint_t));
   addr.sin_family = AF_INET;
   socklen_t socklen(sizeof(endpoint_t));
   ssize_t rx(
       ::recvfrom(sockfd, buf, len, 0, (struct sockaddr*)&addr, &socklen));
+  ++syscalls;
   if(rx > 0)
     rx_bytes += rx;
   return rx;
 }
 
+bool udpsocket_t::wait_readable(int usec)
+{
+#ifdef HAS_URING
+  if(uring)
+    return uring->wait_readable(usec);
+#endif
+  ++syscalls;
+  fd_set fds;
+  FD_ZERO(&fds);
+  FD_SET(sockfd, &fds);
+  struct timeval tv;
+  tv.tv_sec = usec / 1000000;
+  tv.tv_usec = usec % 1000000;
+  return select(sockfd + 1, &fds, NULL, NULL, &tv) > 0;
+}
+
+size_t udpsocket_t::recvmmsg(char* const* bufs, size_t len, size_t* rxlens,
+                             endpoint_t* addrs, size_t nmsg)
+{
+  nmsg = std::min(nmsg, (size_t)RECV_BATCHSIZE);
+  if(!nmsg)
+    return 0;
+#ifdef HAS_URING
+  if(uring) {
+    size_t rxbytes(0);
+    size_t rx(
+        uring->recvmmsg(bufs, len, rxlens, addrs, nmsg, timeout_usec, rxbytes));
+    rx_bytes += rxbytes;
+    return rx;
+  }
+#endif
+#if defined(__linux__)
+  struct mmsghdr msgs[RECV_BATCHSIZE];
+  struct iovec iovecs[RECV_BATCHSIZE];
+  memset(msgs, 0, sizeof(msgs));
+  for(size_t k = 0; k < nmsg; ++k) {
+    memset(&(addrs[k]), 0, sizeof(endpoint_t));
+    addrs[k].sin_family = AF_INET;
+    iovecs[k].iov_base = bufs[k];
+    iovecs[k].iov_len = len;
+    msgs[k].msg_hdr.msg_iov = &(iovecs[k]);
+    msgs[k].msg_hdr.msg_iovlen = 1;
+    msgs[k].msg_hdr.msg_name = &(addrs[k]);
+    msgs[k].msg_hdr.msg_namelen = sizeof(endpoint_t);
+  }
+  // wait for the first message, then collect all pending ones:
+  int rx(::recvmmsg(sockfd, msgs, (unsigned int)nmsg, MSG_WAITFORONE, NULL));
+  ++syscalls;
+  if(rx <= 0)
+    return 0;
+  for(size_t k = 0; k < (size_t)rx; ++k) {
+    rxlens[k] = msgs[k].msg_len;
+    rx_bytes += msgs[k].msg_len;
+  }
+  return (size_t)rx;
+#else
+  ssize_t rx(recvfrom(bufs[0], len, addrs[0]));
+  if(rx < 0)
+    return 0;
+  rxlens[0] = (size_t)rx;
+  return 1;
+#endif
+}
+
 std::string addr2str(const struct in_addr& addr)
 {
   return std::to_string(addr.s_addr & 0xff) + "." +
@@ -281,8 +495,9 @@ std::string ep2ipstr(const endpoint_t& ep)
   return addr2str(ep.sin_addr);
 }
 
-ovbox_udpsocket_t::ovbox_udpsocket_t(secret_t secret, stage_device_id_t cid)
-    : secret(secret), callerid(cid)
+ovbox_udpsocket_t::ovbox_udpsocket_t(secret_t secret, stage_device_id_t cid,
+                                     bool use_uring)
+    : udpsocket_t(use_uring), secret(secret), callerid(cid)
 {
   t_start = std::chrono::high_resolution_clock::now();
   // create key pair:
@@ -320,9 +535,23 @@ void ovbox_udpsocket_t::send_ping(const endpoint_t& ep,
   double t1 = time_since_start();
   n = addmsg(buffer, pingbufsize, n, (const char*)(&t1), sizeof(t1));
   n = addmsg(buffer, pingbufsize, n, (char*)(&ep), sizeof(ep));
+  // features of this device, older peers only echo them:
+  epcaps_t caps_(caps);
+  n = addmsg(buffer, pingbufsize, n, (const char*)(&caps_), sizeof(caps_));
   send(buffer, n, ep);
 }
 
+epcaps_t ovbox_udpsocket_t::get_ping_caps(const char* msg, size_t len,
+                                         port_t proto)
+{
+  size_t ofs(sizeof(double) + sizeof(endpoint_t));
+  if(proto == PORT_PING_SRV)
+    ofs += sizeof(stage_device_id_t);
+  if(len < ofs + sizeof(epcaps_t))
+    return 0;
+  return msg_load<epcaps_t>(msg, ofs);
+}
+
 double ovbox_udpsocket_t::get_pingtime(char*& msg, size_t& msglen)
 {
   if(msglen >= sizeof(double)) {
@@ -382,16 +611,37 @@ void ovbox_udpsocket_t::send_pubkey(const endpoint_t& ep)
   send(buffer, n, ep);
 }
 
+bool ovbox_udpsocket_t::derive_sessionkey(const uint8_t* pubkey,
+                                          uint8_t* key) const
+{
+  // both ends derive the same key from own secret and peer public key:
+  return crypto_box_beforenm(key, pubkey, recipient_secret) == 0;
+}
+
 size_t ovbox_udpsocket_t::packmsg(char* destbuf, size_t maxlen, port_t destport,
                                   const char* msg, size_t msglen)
+{
+  size_t len(packheader(destbuf, maxlen, destport, msglen));
+  if(len)
+    memcpy(&(destbuf[HEADERLEN]), msg, msglen);
+  return len;
+}
+
+size_t ovbox_udpsocket_t::packheader(char* destbuf, size_t maxlen,
+                                     port_t destport, size_t msglen)
 {
   sequence_t& seq(seqmap[destport]);
-  if(destport >= MAXSPECIALPORT) {
+  if(destport >= MAXSPECIALPORT)
     seq++;
-    return ::packmsg(destbuf, maxlen, secret, callerid, destport, seq, msg,
-                     msglen);
-  }
-  return ::packmsg(destbuf, maxlen, secret, callerid, destport, 0, msg, msglen);
+  if(maxlen < HEADERLEN + msglen)
+    return 0;
+  msg_header_t hdr;
+  hdr.secret = secret;
+  hdr.callerid = callerid;
+  hdr.port = destport;
+  hdr.seq = (destport >= MAXSPECIALPORT) ? seq : 0;
+  hdr.store(destbuf);
+  return HEADERLEN + msglen;
 }
 
 bool ovbox_udpsocket_t::pack_and_send(port_t destport, const char* msg,
@@ -419,13 +669,14 @@ char* ovbox_udpsocket_t::recv_sec_msg(char* inputbuf, size_t& ilen, size_t& len,
   ilen = ilens;
   if(ilen < HEADERLEN)
     return NULL;
+  msg_header_t hdr(msg_header_t::load(inputbuf));
   // check secret:
-  if(msg_secret(inputbuf) != secret) {
+  if(hdr.secret != secret) {
     return NULL;
   }
-  cid = msg_callerid(inputbuf);
-  destport = msg_port(inputbuf);
-  seq = msg_seq(inputbuf);
+  cid = hdr.callerid;
+  destport = hdr.port;
+  seq = hdr.seq;
   len = ilen - HEADERLEN;
   return &(inputbuf[HEADERLEN]);
 }
@@ -439,13 +690,37 @@ bool ovbox_udpsocket_t::recv_sec_msg(msgbuf_t& msg)
   size_t ilen(ilens);
   if(ilen < HEADERLEN)
     return false;
-  // check secret:
-  if(msg_secret(msg.rawbuffer) != secret)
+  // decode header once and check secret:
+  msg_header_t hdr(msg_header_t::load(msg.rawbuffer));
+  if(hdr.secret != secret)
     return false;
-  msg.unpack(ilen);
+  msg.unpack(hdr, ilen);
   return msg.valid;
 }
 
+size_t ovbox_udpsocket_t::recv_sec_msg(msgbuf_t* msgs, size_t nmsg)
+{
+  nmsg = std::min(nmsg, (size_t)RECV_BATCHSIZE);
+  char* bufs[RECV_BATCHSIZE];
+  size_t rxlens[RECV_BATCHSIZE];
+  endpoint_t addrs[RECV_BATCHSIZE];
+  for(size_t k = 0; k < nmsg; ++k) {
+    msgs[k].valid = false;
+    bufs[k] = msgs[k].rawbuffer;
+  }
+  size_t rx(recvmmsg(bufs, BUFSIZE, rxlens, addrs, nmsg));
+  for(size_t k = 0; k < rx; ++k) {
+    msgs[k].sender = addrs[k];
+    // check header length, decode header once and check secret:
+    if(rxlens[k] < HEADERLEN)
+      continue;
+    msg_header_t hdr(msg_header_t::load(msgs[k].rawbuffer));
+    if(hdr.secret == secret)
+      msgs[k].unpack(hdr, rxlens[k]);
+  }
+  return rx;
+}
+
 #if defined(__linux__)
 std::string getmacaddr()
 {
@@ -625,11 +900,56 @@ std::vector<std::string> getnetworkdevices()
   return devices;
 }
 
+msgbuf_pool_t& msgbuf_pool_t::get()
+{
+  static msgbuf_pool_t pool;
+  return pool;
+}
+
+msgbuf_pool_t::~msgbuf_pool_t()
+{
+  for(auto chunk : chunks)
+    delete[] chunk;
+}
+
+char* msgbuf_pool_t::alloc()
+{
+  std::lock_guard<std::mutex> lk(mtx);
+  if(freelist.empty()) {
+    char* chunk(new char[MSGBUF_POOL_CHUNK * BUFSIZE]);
+    chunks.push_back(chunk);
+    freelist.reserve(chunks.size() * MSGBUF_POOL_CHUNK);
+    for(size_t k = MSGBUF_POOL_CHUNK; k > 0; --k)
+      freelist.push_back(&(chunk[(k - 1) * BUFSIZE]));
+  }
+  char* buf(freelist.back());
+  freelist.pop_back();
+  return buf;
+}
+
+void msgbuf_pool_t::release(char* buf)
+{
+  std::lock_guard<std::mutex> lk(mtx);
+  freelist.push_back(buf);
+}
+
+size_t msgbuf_pool_t::available()
+{
+  std::lock_guard<std::mutex> lk(mtx);
+  return freelist.size();
+}
+
+size_t msgbuf_pool_t::capacity()
+{
+  std::lock_guard<std::mutex> lk(mtx);
+  return chunks.size() * MSGBUF_POOL_CHUNK;
+}
+
 msgbuf_t::msgbuf_t()
     : valid(false), cid(0), destport(0), seq(0), size(0),
-      rawbuffer(new char[BUFSIZE]), msg(rawbuffer)
+      rawbuffer(msgbuf_pool_t::get().alloc()), msg(rawbuffer)
 {
-  memset(rawbuffer, 0, BUFSIZE);
+  memset(rawbuffer, 0, HEADERLEN);
 }
 
 void msgbuf_t::copy(const msgbuf_t& src)
@@ -639,13 +959,29 @@ void msgbuf_t::copy(const msgbuf_t& src)
   destport = src.destport;
   seq = src.seq;
   size = src.size;
-  memcpy(rawbuffer, src.rawbuffer, BUFSIZE);
+  sender = src.sender;
+  t = src.t;
+  memcpy(rawbuffer, src.rawbuffer, std::min(HEADERLEN + size, (size_t)BUFSIZE));
   msg = &(rawbuffer[HEADERLEN]);
 }
 
+void msgbuf_t::take(msgbuf_t& src)
+{
+  valid = src.valid;
+  cid = src.cid;
+  destport = src.destport;
+  seq = src.seq;
+  size = src.size;
+  sender = src.sender;
+  t = src.t;
+  std::swap(rawbuffer, src.rawbuffer);
+  std::swap(msg, src.msg);
+  src.valid = false;
+}
+
 msgbuf_t::~msgbuf_t()
 {
-  delete[] rawbuffer;
+  msgbuf_pool_t::get().release(rawbuffer);
 }
 
 void msgbuf_t::pack(secret_t secret, stage_device_id_t callerid,
@@ -658,12 +994,19 @@ void msgbuf_t::pack(secret_t secret, stage_device_id_t callerid,
 }
 
 void msgbuf_t::unpack(size_t msglen)
+{
+  valid = false;
+  if(msglen >= HEADERLEN)
+    unpack(msg_header_t::load(rawbuffer), msglen);
+}
+
+void msgbuf_t::unpack(const msg_header_t& hdr, size_t msglen)
 {
   valid = false;
   if((msglen >= HEADERLEN) && (msglen <= BUFSIZE)) {
-    cid = msg_callerid(rawbuffer);
-    destport = msg_port(rawbuffer);
-    seq = msg_seq(rawbuffer);
+    cid = hdr.callerid;
+    destport = hdr.port;
+    seq = hdr.seq;
     size = msglen - HEADERLEN;
     msg = &(rawbuffer[HEADERLEN]);
     valid = true;
@@ -25,6 +25,7 @@
 // include sodium for encryption:
 #include <atomic>
 #include <sodium.h>
+#include <vector>
 #if defined(LINUX) || defined(linux) || defined(__APPLE__)
 #include <netinet/ip.h>
 #include <sys/socket.h>
@@ -42,6 +43,29 @@
 
 typedef struct sockaddr_in endpoint_t;
 
+/**
+ * Maximum number of datagrams fetched by a single batched receive call.
+ */
+#define RECV_BATCHSIZE 16
+
+/**
+ * Maximum number of messages in the send queue, see udpsocket_t::queue()
+ */
+#define SEND_QUEUE_LEN 32
+
+/**
+ * Destination of a fan-out message, see udpsocket_t::sendmmsg()
+ */
+struct fanout_dest_t {
+  /// Destination address and port
+  endpoint_t ep;
+  /// Payload override (e.g., encrypted copy), or NULL to send the
+  /// common payload
+  const char* buf = nullptr;
+  /// Length of payload override in bytes
+  size_t len = 0;
+};
+
 endpoint_t ovgethostbyname(const std::string& host);
 
 std::string addr2str(const struct in_addr& addr);
@@ -58,6 +82,8 @@ inline bool is_same_network(const endpoint_t& a, const endpoint_t& b)
          (a.sin_addr.s_addr != 0) && (b.sin_addr.s_addr != 0);
 };
 
+class uring_t;
+
 /**
  * Send and receive UDP messages
  */
@@ -73,8 +99,13 @@ public:
    *
    * On Linux and Windows the type of service (IPTOS) is set to CS6
    * and socket priority is set to 5.
+   *
+   * @param use_uring Use io_uring for batched sending and for
+   * receiving (Linux only). If io_uring is not available, system
+   * calls are used, see has_uring(). The backend saves system calls
+   * but is not faster than sendmmsg()/recvmmsg(), see uring_t.
    */
-  udpsocket_t();
+  udpsocket_t(bool use_uring = false);
   /**
    * Deconstructor. This will close the socket.
    */
@@ -108,6 +139,19 @@ public:
    * of type ErrMsg with an appropriate error message is thrown.
    */
   port_t bind(port_t port, bool loopback = false);
+  /**
+   * Join an IPv4 multicast group on the default interface.
+   *
+   * @param group Address of the multicast group
+   *
+   * Upon error, an exception of type ErrMsg is thrown.
+   */
+  void join_multicast(const char* group);
+  /**
+   * Enable or disable the delivery of sent multicast messages to
+   * receivers on the same host (IP_MULTICAST_LOOP).
+   */
+  void set_multicast_loop(bool loop);
   /**
    * Set destination host or IP address.
    * @param host Host name or IP address of destination.
@@ -141,6 +185,39 @@ public:
    * @return The number of bytes sent, or -1 in case of failure
    */
   ssize_t send(const char* buf, size_t len, const endpoint_t& ep);
+  /**
+   * Send a message to multiple destinations with a single system call.
+   *
+   * Upon success, the tx_bytes counter is increased by the number of
+   * bytes sent. On systems without sendmmsg() one system call per
+   * destination is used.
+   *
+   * @param buf Start of memory area containing the common message
+   * @param len Length of common message in bytes
+   * @param dest Array of destinations, optionally with payload override
+   * @param ndest Number of destinations
+   * @return The number of messages sent
+   */
+  size_t sendmmsg(const char* buf, size_t len, const fanout_dest_t* dest,
+                  size_t ndest);
+  /**
+   * Append a copy of a message to the send queue.
+   *
+   * The queue is sent with flush(), which is called automatically
+   * if the queue is full.
+   *
+   * @param buf Start of memory area containing the message
+   * @param len Length of message in bytes, at most BUFSIZE
+   * @param portno Destination port number at the previously
+   * configured destination
+   */
+  void queue(const char* buf, size_t len, uint16_t portno);
+  /**
+   * Send all messages of the send queue with one system call.
+   *
+   * @return The number of messages sent
+   */
+  size_t flush();
   /**
    * Receive a message.
    *
@@ -153,12 +230,48 @@ public:
    * @return Number of bytes received, or -1 in case of failure
    */
   ssize_t recvfrom(char* buf, size_t len, endpoint_t& addr);
+  /**
+   * Receive multiple messages with a single system call.
+   *
+   * The call blocks (up to the receive timeout) until at least one
+   * message is available, and then returns all further messages
+   * which are already queued, up to nmsg. On systems without
+   * recvmmsg() only one message is received per call.
+   *
+   * Upon success, the rx_bytes counter is increased by the number of
+   * bytes received.
+   *
+   * @param bufs Array of nmsg memory areas where the messages should be stored
+   * @param len Length of each provided memory area in bytes
+   * @param[out] rxlens Array of nmsg sizes, filled with the number of
+   * bytes received per message
+   * @param[out] addrs Array of nmsg addresses, filled with sender addresses
+   * @param nmsg Number of provided slots, at most RECV_BATCHSIZE are used
+   * @return Number of messages received, or zero in case of timeout or failure
+   */
+  size_t recvmmsg(char* const* bufs, size_t len, size_t* rxlens,
+                  endpoint_t* addrs, size_t nmsg);
+  /**
+   * Wait until a message can be received, or until a timeout.
+   *
+   * @param usec Timeout in microseconds
+   * @return True if a message is available
+   */
+  bool wait_readable(int usec);
   /**
    * Return the address where the socket is currently bound to.
    *
    * @return Address
    */
   endpoint_t getsockep();
+  /**
+   * Return file descriptor of the socket, e.g., for event loops.
+   */
+  int getsockfd() const { return sockfd; };
+  /**
+   * Return true if io_uring is used.
+   */
+  bool has_uring() const { return uring != nullptr; };
   /**
    * Close the socket.
    */
@@ -176,6 +289,11 @@ private:
   int sockfd;
   endpoint_t serv_addr;
   bool isopen;
+  int timeout_usec;
+  uring_t* uring;
+  fanout_dest_t sendqueue[SEND_QUEUE_LEN];
+  size_t sendqueue_len;
+  std::vector<char> sendqueue_buf;
 
 public:
   /**
@@ -186,6 +304,10 @@ public:
    * Number of bytes received through this socket.
    */
   std::atomic_size_t rx_bytes;
+  /**
+   * Number of system calls used for sending and receiving.
+   */
+  std::atomic_size_t syscalls;
 };
 
 class sequence_map_t : public std::map<port_t, sequence_t> {
@@ -200,20 +322,80 @@ public:
   };
 };
 
+/**
+ * Number of buffers which are allocated at once by msgbuf_pool_t
+ */
+#define MSGBUF_POOL_CHUNK 64
+
+/**
+ * Process-wide pool of message buffers of BUFSIZE bytes.
+ *
+ * Buffers are allocated in chunks of MSGBUF_POOL_CHUNK buffers and
+ * are kept in a free list when they are released, so message
+ * buffers can be created without large allocations. Memory is
+ * returned to the system only at program exit.
+ */
+class msgbuf_pool_t {
+public:
+  /**
+   * Return the pool instance.
+   */
+  static msgbuf_pool_t& get();
+  /**
+   * Take a buffer of BUFSIZE bytes from the pool.
+   */
+  char* alloc();
+  /**
+   * Return a buffer to the pool.
+   */
+  void release(char* buf);
+  /**
+   * Return the number of unused buffers.
+   */
+  size_t available();
+  /**
+   * Return the total number of buffers.
+   */
+  size_t capacity();
+
+private:
+  msgbuf_pool_t(){};
+  ~msgbuf_pool_t();
+  std::mutex mtx;
+  std::vector<char*> chunks;
+  std::vector<char*> freelist;
+};
+
 /**
  * @ingroup networkprotocol
  * Container for an unpacked message buffer.
+ *
+ * The buffer memory is taken from msgbuf_pool_t. The content of a
+ * message can be passed on without copying with take().
  */
 class msgbuf_t {
 public:
   /**
-   * Default constructor, invalidates and allocates BUFSIZE bytes in
-   * buffer
+   * Default constructor, invalidates and takes a buffer of BUFSIZE
+   * bytes from the pool
    */
   msgbuf_t();
   ~msgbuf_t();
   msgbuf_t(const msgbuf_t&) = delete;
+  /**
+   * Copy a message. Only the packed message, i.e., header and
+   * payload, is copied, not the whole buffer.
+   *
+   * @param src Source message
+   */
   void copy(const msgbuf_t& src);
+  /**
+   * Take over a message by exchanging the buffers.
+   *
+   * @param src Source message, contains the previous buffer of this
+   * message and is invalid on return
+   */
+  void take(msgbuf_t& src);
   /**
    * @ingroup networkprotocol
    * Serialize header and original message info a destination buffer for
@@ -237,6 +419,13 @@ public:
    * updated, otherwise valid is set to false.
    */
   void unpack(size_t msglen);
+  /**
+   * Unpack a packed message with an already decoded header.
+   *
+   * @param hdr Header of the message in the raw buffer
+   * @param msglen Length of packed source message
+   */
+  void unpack(const msg_header_t& hdr, size_t msglen);
   /**
    * Return age of a message in Milliseconds.
    * The age is measured since it was unpacked.
@@ -264,9 +453,31 @@ private:
  */
 class ovbox_udpsocket_t : public udpsocket_t {
 public:
-  ovbox_udpsocket_t(secret_t secret, stage_device_id_t id);
+  ovbox_udpsocket_t(secret_t secret, stage_device_id_t id,
+                    bool use_uring = false);
+  /**
+   * @ingroup networkprotocol
+   * Send a ping message.
+   *
+   * The payload contains the destination ID (only for PORT_PING_SRV),
+   * the send time, the destination endpoint, and the features of this
+   * device, see set_caps().
+   */
   void send_ping(const endpoint_t& ep, stage_device_id_t destid = 0,
                  port_t proto = PORT_PING);
+  /**
+   * Set the features of this device which are sent with pings.
+   */
+  void set_caps(epcaps_t c) { caps = c; };
+  /**
+   * Extract the features of the sender from a ping message.
+   *
+   * @param msg Payload of ping message
+   * @param len Length of payload
+   * @param proto Port of ping message
+   * @return Features, zero if the sender did not send them
+   */
+  static epcaps_t get_ping_caps(const char* msg, size_t len, port_t proto);
   double time_since_start() const;
   /**
    * @ingroup networkprotocol
@@ -314,7 +525,18 @@ public:
    *
    */
   bool recv_sec_msg(msgbuf_t& msg);
+  /**
+   * Receive a batch of messages, extract headers and validate secret.
+   *
+   * @param msgs Array of message buffers to be updated
+   * @param nmsg Number of message buffers, at most RECV_BATCHSIZE are used
+   *
+   * @return Number of received messages. Only message buffers with a
+   * valid header and matching secret are marked as valid.
+   */
+  size_t recv_sec_msg(msgbuf_t* msgs, size_t nmsg);
   void set_secret(secret_t s);
+  secret_t get_secret() const { return secret; };
   /**
    * Pack a message with current secret, caller id and sequence number.
    *
@@ -332,6 +554,20 @@ public:
    */
   size_t packmsg(char* destbuf, size_t maxlen, port_t destport, const char* msg,
                  size_t msglen);
+  /**
+   * Pack the header of a message which is already stored after the
+   * header, i.e., at destbuf + HEADERLEN, without copying the message.
+   *
+   * @param destbuf Start of memory area of header and message
+   * @param maxlen Size of the data memory in bytes.
+   * @param destport Destination port of message
+   * @param msglen Length of original message
+   * @return Size of the packed message, or zero if it does not fit
+   *
+   * The sequence number is incremented as in packmsg().
+   */
+  size_t packheader(char* destbuf, size_t maxlen, port_t destport,
+                    size_t msglen);
   /**
    * Pack and send message
    *
@@ -348,12 +584,21 @@ public:
    */
   void send_pubkey(port_t port);
   void send_pubkey(const endpoint_t& ep);
+  /**
+   * Derive the shared session key for communication with a peer.
+   *
+   * @param[in] pubkey Public key of the peer
+   * @param[out] key Session key, crypto_box_BEFORENMBYTES bytes
+   * @return True on success, false if the public key is invalid
+   */
+  bool derive_sessionkey(const uint8_t* pubkey, uint8_t* key) const;
 
 protected:
   secret_t secret;
   stage_device_id_t callerid;
   sequence_map_t seqmap;
   std::chrono::high_resolution_clock::time_point t_start;
+  std::atomic<epcaps_t> caps{0};
 
 public:
   uint8_t recipient_public[crypto_box_PUBLICKEYBYTES];
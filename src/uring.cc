@@ -0,0 +1,483 @@
+/*
+ * This file is part of the ovbox software tool, see <http://orlandoviols.com/>.
+ *
+ * Copyright (c) 2021 Giso Grimm
+ */
+/*
+ * ovbox is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published
+ * by the Free Software Foundation, version 3 of the License.
+ *
+ * ovbox is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License, version 3 for more details.
+ *
+ * You should have received a copy of the GNU General Public License,
+ * Version 3 along with ovbox. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "uring.h"
+
+#ifdef HAS_URING
+
+#include "errmsg.h"
+#include <algorithm>
+#include <errno.h>
+#include <linux/io_uring.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+// id of the group of receive buffers:
+#define URING_BGID 0
+// user data of the multishot receive request:
+#define URING_RECV 1
+// user data of the cancel request:
+#define URING_CANCEL 2
+// user data of requests which return buffers to the kernel:
+#define URING_PROVIDE 3
+// size of one receive buffer, including the message header and the
+// sender address written by the kernel:
+#define URING_RXBUFSIZE                                                        \
+  (sizeof(struct io_uring_recvmsg_out) + sizeof(endpoint_t) + BUFSIZE)
+
+/**
+ * Submission and completion queue of one io_uring instance, with the
+ * socket registered as fixed file 0.
+ *
+ * Without kernel side polling, submission queue entries are read by
+ * the kernel only in io_uring_enter, so entries can be filled after
+ * they are appended to the queue.
+ */
+class uring_queue_t {
+public:
+  uring_queue_t(unsigned entries, unsigned cqentries, int sockfd);
+  ~uring_queue_t();
+  /**
+   * Append a cleared submission queue entry, or return NULL if the
+   * queue is full.
+   */
+  struct io_uring_sqe* get_sqe();
+  /**
+   * Submit all pending entries and optionally wait for completions.
+   *
+   * @param min_complete Number of completions to wait for
+   * @param timeout_usec Timeout in microseconds, or -1 to wait
+   * without timeout
+   * @return Result of the system call
+   */
+  int enter(unsigned min_complete, int timeout_usec);
+  /**
+   * Return the oldest completion queue entry, or NULL if the
+   * completion queue is empty.
+   */
+  struct io_uring_cqe* peek();
+  /**
+   * Remove the oldest entry from the completion queue.
+   */
+  void advance();
+  int fd;
+  unsigned pending;
+  bool skip_success;
+
+private:
+  void cleanup();
+  void* sqmem;
+  void* cqmem;
+  size_t sqsize;
+  size_t cqsize;
+  struct io_uring_sqe* sqes;
+  size_t sqesize;
+  unsigned* sq_head;
+  unsigned* sq_tail;
+  unsigned sq_mask;
+  unsigned sq_entries;
+  unsigned* sq_array;
+  unsigned* cq_head;
+  unsigned* cq_tail;
+  unsigned cq_mask;
+  struct io_uring_cqe* cqes;
+};
+
+uring_queue_t::uring_queue_t(unsigned entries, unsigned cqentries,
+                             int sockfd)
+    : fd(-1), pending(0), skip_success(false), sqmem(MAP_FAILED),
+      cqmem(MAP_FAILED), sqsize(0), cqsize(0),
+      sqes((struct io_uring_sqe*)MAP_FAILED), sqesize(0)
+{
+  struct io_uring_params p;
+  memset(&p, 0, sizeof(p));
+  p.flags = IORING_SETUP_CQSIZE;
+  p.cq_entries = cqentries;
+  fd = (int)syscall(__NR_io_uring_setup, entries, &p);
+  if(fd < 0)
+    throw ErrMsg("Unable to create io_uring instance: ", errno);
+  if(!(p.features & IORING_FEAT_EXT_ARG)) {
+    cleanup();
+    throw ErrMsg("io_uring does not support timeouts.");
+  }
+  skip_success = p.features & IORING_FEAT_CQE_SKIP;
+  sqsize = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  cqsize = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  if(p.features & IORING_FEAT_SINGLE_MMAP)
+    sqsize = cqsize = std::max(sqsize, cqsize);
+  sqmem = mmap(NULL, sqsize, PROT_READ | PROT_WRITE,
+               MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+  if(sqmem == MAP_FAILED) {
+    int err(errno);
+    cleanup();
+    throw ErrMsg("Unable to map io_uring submission queue: ", err);
+  }
+  if(p.features & IORING_FEAT_SINGLE_MMAP)
+    cqmem = sqmem;
+  else {
+    cqmem = mmap(NULL, cqsize, PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+    if(cqmem == MAP_FAILED) {
+      int err(errno);
+      cleanup();
+      throw ErrMsg("Unable to map io_uring completion queue: ", err);
+    }
+  }
+  sqesize = p.sq_entries * sizeof(struct io_uring_sqe);
+  sqes = (struct io_uring_sqe*)mmap(NULL, sqesize, PROT_READ | PROT_WRITE,
+                                    MAP_SHARED | MAP_POPULATE, fd,
+                                    IORING_OFF_SQES);
+  if(sqes == MAP_FAILED) {
+    int err(errno);
+    cleanup();
+    throw ErrMsg("Unable to map io_uring submission queue entries: ", err);
+  }
+  char* sq((char*)sqmem);
+  sq_head = (unsigned*)(sq + p.sq_off.head);
+  sq_tail = (unsigned*)(sq + p.sq_off.tail);
+  sq_mask = *(unsigned*)(sq + p.sq_off.ring_mask);
+  sq_entries = p.sq_entries;
+  sq_array = (unsigned*)(sq + p.sq_off.array);
+  char* cq((char*)cqmem);
+  cq_head = (unsigned*)(cq + p.cq_off.head);
+  cq_tail = (unsigned*)(cq + p.cq_off.tail);
+  cq_mask = *(unsigned*)(cq + p.cq_off.ring_mask);
+  cqes = (struct io_uring_cqe*)(cq + p.cq_off.cqes);
+  // register the socket, to avoid file lookups per request:
+  if(syscall(__NR_io_uring_register, fd, IORING_REGISTER_FILES, &sockfd, 1) <
+     0) {
+    int err(errno);
+    cleanup();
+    throw ErrMsg("Unable to register socket with io_uring: ", err);
+  }
+}
+
+uring_queue_t::~uring_queue_t()
+{
+  cleanup();
+}
+
+void uring_queue_t::cleanup()
+{
+  if(sqes != MAP_FAILED)
+    munmap(sqes, sqesize);
+  if((cqmem != MAP_FAILED) && (cqmem != sqmem))
+    munmap(cqmem, cqsize);
+  if(sqmem != MAP_FAILED)
+    munmap(sqmem, sqsize);
+  if(fd >= 0)
+    ::close(fd);
+  fd = -1;
+}
+
+struct io_uring_sqe* uring_queue_t::get_sqe()
+{
+  unsigned tail(*sq_tail);
+  if(tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) >= sq_entries)
+    return NULL;
+  unsigned idx(tail & sq_mask);
+  sq_array[idx] = idx;
+  struct io_uring_sqe* sqe(&(sqes[idx]));
+  memset(sqe, 0, sizeof(*sqe));
+  __atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+  ++pending;
+  return sqe;
+}
+
+int uring_queue_t::enter(unsigned min_complete, int timeout_usec)
+{
+  unsigned flags(min_complete ? IORING_ENTER_GETEVENTS : 0u);
+  struct __kernel_timespec ts;
+  struct io_uring_getevents_arg arg;
+  void* parg(NULL);
+  size_t argsize(0);
+  if(min_complete && (timeout_usec >= 0)) {
+    ts.tv_sec = timeout_usec / 1000000;
+    ts.tv_nsec = 1000ll * (timeout_usec % 1000000);
+    memset(&arg, 0, sizeof(arg));
+    arg.ts = (uint64_t)(uintptr_t)(&ts);
+    flags |= IORING_ENTER_EXT_ARG;
+    parg = &arg;
+    argsize = sizeof(arg);
+  }
+  int r((int)syscall(__NR_io_uring_enter, fd, pending, min_complete, flags,
+                     parg, argsize));
+  if(r > 0)
+    pending -= std::min((unsigned)r, pending);
+  return r;
+}
+
+struct io_uring_cqe* uring_queue_t::peek()
+{
+  unsigned head(*cq_head);
+  if(head == __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE))
+    return NULL;
+  return &(cqes[head & cq_mask]);
+}
+
+void uring_queue_t::advance()
+{
+  __atomic_store_n(cq_head, *cq_head + 1, __ATOMIC_RELEASE);
+}
+
+uring_t::uring_t(int sockfd, std::atomic_size_t& syscalls_)
+    : syscalls(syscalls_), tx(NULL), rx(NULL), rx_armed(false), sqe_flags(0),
+      rxbuffers(URING_RXBUFS * URING_RXBUFSIZE)
+{
+  memset(txhdr, 0, sizeof(txhdr));
+  memset(txvec, 0, sizeof(txvec));
+  memset(&rxhdr, 0, sizeof(rxhdr));
+  rxhdr.msg_namelen = sizeof(endpoint_t);
+  try {
+    tx = new uring_queue_t(URING_ENTRIES, 2 * URING_ENTRIES, sockfd);
+    // the completion queue needs space for one entry per buffer, for
+    // the final entry of the multishot request and for the entries of
+    // returned buffers:
+    rx = new uring_queue_t(2 * RECV_BATCHSIZE, 4 * URING_RXBUFS, sockfd);
+    if(rx->skip_success)
+      sqe_flags = IOSQE_CQE_SKIP_SUCCESS;
+    recycle(0, URING_RXBUFS);
+    // submit the receive request now, to find out if multishot
+    // receive is supported:
+    arm_receiver();
+    rx->enter(0, -1);
+    ++syscalls;
+    struct io_uring_cqe* cqe(NULL);
+    while((cqe = rx->peek())) {
+      if(cqe->res < 0)
+        throw ErrMsg("Multishot receive is not supported by io_uring: ",
+                     -cqe->res);
+      rx->advance();
+    }
+  }
+  catch(...) {
+    delete tx;
+    delete rx;
+    throw;
+  }
+}
+
+uring_t::~uring_t()
+{
+  // cancel the receive request, to make sure that the kernel does not
+  // write to the buffers after they are released:
+  struct io_uring_sqe* sqe(NULL);
+  if(rx_armed && (sqe = rx->get_sqe())) {
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = URING_RECV;
+    sqe->user_data = URING_CANCEL;
+    for(int k = 0; (k < 10) && rx_armed; ++k) {
+      rx->enter(1, 10000);
+      struct io_uring_cqe* cqe(NULL);
+      while((cqe = next_cqe())) {
+        if(!(cqe->flags & IORING_CQE_F_MORE))
+          rx_armed = false;
+        rx->advance();
+      }
+    }
+  }
+  delete rx;
+  delete tx;
+}
+
+struct io_uring_sqe* uring_t::get_rx_sqe()
+{
+  struct io_uring_sqe* sqe(rx->get_sqe());
+  if(!sqe) {
+    // submission queue is full, submit now:
+    rx->enter(0, -1);
+    ++syscalls;
+    sqe = rx->get_sqe();
+  }
+  return sqe;
+}
+
+void uring_t::arm_receiver()
+{
+  struct io_uring_sqe* sqe(get_rx_sqe());
+  if(!sqe)
+    return;
+  sqe->opcode = IORING_OP_RECVMSG;
+  sqe->fd = 0;
+  sqe->flags = IOSQE_FIXED_FILE | IOSQE_BUFFER_SELECT;
+  sqe->ioprio = IORING_RECV_MULTISHOT;
+  sqe->addr = (uint64_t)(uintptr_t)(&rxhdr);
+  sqe->len = 1;
+  sqe->buf_group = URING_BGID;
+  sqe->user_data = URING_RECV;
+  rx_armed = true;
+}
+
+void uring_t::recycle(uint16_t bid, uint16_t nbufs)
+{
+  struct io_uring_sqe* sqe(get_rx_sqe());
+  if(!sqe)
+    return;
+  sqe->opcode = IORING_OP_PROVIDE_BUFFERS;
+  sqe->fd = nbufs;
+  sqe->flags = sqe_flags;
+  sqe->addr = (uint64_t)(uintptr_t)(&(rxbuffers[bid * URING_RXBUFSIZE]));
+  sqe->len = URING_RXBUFSIZE;
+  sqe->buf_group = URING_BGID;
+  sqe->off = bid;
+  sqe->user_data = URING_PROVIDE;
+}
+
+struct io_uring_cqe* uring_t::next_cqe()
+{
+  // skip completions of other requests than the receive request:
+  struct io_uring_cqe* cqe(NULL);
+  while((cqe = rx->peek()) && (cqe->user_data != URING_RECV))
+    rx->advance();
+  return cqe;
+}
+
+size_t uring_t::sendmmsg(const char* buf, size_t len,
+                         const fanout_dest_t* dest, size_t ndest,
+                         size_t& txbytes)
+{
+  std::lock_guard<std::mutex> lk(mtx);
+  txbytes = 0;
+  size_t nsent(0);
+  size_t nproc(0);
+  while(nproc < ndest) {
+    size_t nmsg(std::min(ndest - nproc, (size_t)URING_ENTRIES));
+    for(size_t k = 0; k < nmsg; ++k) {
+      const fanout_dest_t& d(dest[nproc + k]);
+      txvec[k].iov_base = const_cast<char*>(d.buf ? d.buf : buf);
+      txvec[k].iov_len = d.buf ? d.len : len;
+      txhdr[k].msg_iov = &(txvec[k]);
+      txhdr[k].msg_iovlen = 1;
+      txhdr[k].msg_name = const_cast<endpoint_t*>(&(d.ep));
+      txhdr[k].msg_namelen = sizeof(endpoint_t);
+      struct io_uring_sqe* sqe(tx->get_sqe());
+      sqe->opcode = IORING_OP_SENDMSG;
+      sqe->fd = 0;
+      sqe->flags = IOSQE_FIXED_FILE;
+      sqe->addr = (uint64_t)(uintptr_t)(&(txhdr[k]));
+      sqe->len = 1;
+      sqe->msg_flags = MSG_CONFIRM;
+      sqe->user_data = k;
+    }
+    // submit all messages and wait for their completion with one
+    // system call, the message headers must stay valid until then:
+    size_t ncomplete(0);
+    while(ncomplete < nmsg) {
+      int r(tx->enter((unsigned)(nmsg - ncomplete), -1));
+      ++syscalls;
+      if((r < 0) && (errno != EINTR) && (errno != EAGAIN) &&
+         (errno != EBUSY))
+        throw ErrMsg("Unable to submit to io_uring: ", errno);
+      struct io_uring_cqe* cqe(NULL);
+      while((cqe = tx->peek())) {
+        if(cqe->res > 0) {
+          txbytes += (size_t)(cqe->res);
+          ++nsent;
+        }
+        tx->advance();
+        ++ncomplete;
+      }
+    }
+    nproc += nmsg;
+  }
+  return nsent;
+}
+
+size_t uring_t::recvmmsg(char* const* bufs, size_t len, size_t* rxlens,
+                         endpoint_t* addrs, size_t nmsg, int timeout_usec,
+                         size_t& rxbytes)
+{
+  rxbytes = 0;
+  nmsg = std::min(nmsg, (size_t)RECV_BATCHSIZE);
+  if(!nmsg)
+    return 0;
+  size_t n(0);
+  bool retry(true);
+  while(retry && (n == 0)) {
+    retry = false;
+    if(!next_cqe()) {
+      rx->enter(1, (timeout_usec > 0) ? timeout_usec : -1);
+      ++syscalls;
+    }
+    struct io_uring_cqe* cqe(NULL);
+    while((n < nmsg) && (cqe = next_cqe())) {
+      int res(cqe->res);
+      uint32_t flags(cqe->flags);
+      rx->advance();
+      if(!(flags & IORING_CQE_F_MORE)) {
+        // the request was terminated, e.g., because there were no
+        // more buffers available; wait again after re-arming:
+        rx_armed = false;
+        retry = true;
+      }
+      if(!(flags & IORING_CQE_F_BUFFER))
+        continue;
+      uint16_t bid((uint16_t)(flags >> IORING_CQE_BUFFER_SHIFT));
+      const size_t hlen(sizeof(struct io_uring_recvmsg_out) +
+                        rxhdr.msg_namelen + rxhdr.msg_controllen);
+      if(res >= (int)hlen) {
+        const char* rbuf(&(rxbuffers[bid * URING_RXBUFSIZE]));
+        const struct io_uring_recvmsg_out* out(
+            (const struct io_uring_recvmsg_out*)rbuf);
+        const char* name(rbuf + sizeof(struct io_uring_recvmsg_out));
+        size_t plen(
+            std::min({(size_t)(out->payloadlen), (size_t)res - hlen, len}));
+        memset(&(addrs[n]), 0, sizeof(endpoint_t));
+        addrs[n].sin_family = AF_INET;
+        memcpy(&(addrs[n]), name,
+               std::min((size_t)(out->namelen), sizeof(endpoint_t)));
+        memcpy(bufs[n], rbuf + hlen, plen);
+        rxlens[n] = plen;
+        rxbytes += plen;
+        ++n;
+      }
+      recycle(bid, 1);
+    }
+    // re-arm after the buffers are returned, the request is
+    // submitted with the next system call:
+    if(!rx_armed)
+      arm_receiver();
+  }
+  return n;
+}
+
+bool uring_t::wait_readable(int usec)
+{
+  if(next_cqe())
+    return true;
+  if(!rx_armed)
+    arm_receiver();
+  if((usec > 0) || rx->pending) {
+    rx->enter((usec > 0) ? 1u : 0u, usec);
+    ++syscalls;
+  }
+  return next_cqe() != NULL;
+}
+
+#endif
+
+/*
+ * Local Variables:
+ * mode: c++
+ * compile-command: "make -C .."
+ * End:
+ */
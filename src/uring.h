@@ -0,0 +1,145 @@
+/*
+ * This file is part of the ovbox software tool, see <http://orlandoviols.com/>.
+ *
+ * Copyright (c) 2021 Giso Grimm
+ */
+/*
+ * ovbox is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published
+ * by the Free Software Foundation, version 3 of the License.
+ *
+ * ovbox is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License, version 3 for more details.
+ *
+ * You should have received a copy of the GNU General Public License,
+ * Version 3 along with ovbox. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef URING_H
+#define URING_H
+
+#include "udpsocket.h"
+#include <atomic>
+#include <mutex>
+#include <vector>
+
+// the backend needs multishot receive (Linux 6.0) and skipped
+// completions (Linux 5.17). Older kernel headers, e.g. of Ubuntu
+// 22.04 or Debian bullseye, lack them, and udpsocket_t then uses
+// sendmmsg()/recvmmsg() only:
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#if defined(IORING_RECV_MULTISHOT) && defined(IOSQE_CQE_SKIP_SUCCESS) &&      \
+    defined(IORING_FEAT_CQE_SKIP)
+#define HAS_URING
+#endif
+#endif
+#endif
+
+#ifdef HAS_URING
+
+#include <sys/uio.h>
+
+/**
+ * Number of submission queue entries, i.e., maximum number of
+ * messages sent with one submission.
+ */
+#define URING_ENTRIES 64
+/**
+ * Number of receive buffers provided to the kernel.
+ */
+#define URING_RXBUFS 64
+
+class uring_queue_t;
+
+/**
+ * io_uring based send and receive backend of a UDP socket, see
+ * udpsocket_t.
+ *
+ * Sending and receiving use separate rings, the socket is registered
+ * with both. Messages are received with a multishot receive request
+ * into a group of buffers which are provided to the kernel, i.e., the
+ * receive request is submitted only once and stays active, and
+ * buffers are returned to the kernel together with the next
+ * submission. A fan-out is submitted with a single system call.
+ *
+ * Limits: the receive buffers are provided buffers, not registered
+ * buffers, so each message is copied into the msgbuf_t of the
+ * caller. The fan-out to the peers and the forwarding to local
+ * receivers are separate submissions, not one per audio period. In
+ * the benchmark of the unit tests the backend is not faster than
+ * sendmmsg()/recvmmsg() (about 59 us versus 48 us per period on the
+ * reference machine), so it is off by default.
+ *
+ * Sending is thread-safe, receiving must be done from one thread
+ * only.
+ */
+class uring_t {
+public:
+  /**
+   * @param sockfd UDP socket, owned by the caller
+   * @param syscalls Counter which is incremented by the number of
+   * system calls
+   *
+   * Throws an exception of type ErrMsg if io_uring or multishot
+   * receive is not supported by the kernel.
+   */
+  uring_t(int sockfd, std::atomic_size_t& syscalls);
+  ~uring_t();
+  uring_t(const uring_t&) = delete;
+  /**
+   * Send a message to multiple destinations, see udpsocket_t::sendmmsg()
+   *
+   * @param[out] txbytes Number of bytes sent
+   * @return Number of messages sent
+   */
+  size_t sendmmsg(const char* buf, size_t len, const fanout_dest_t* dest,
+                  size_t ndest, size_t& txbytes);
+  /**
+   * Receive multiple messages, see udpsocket_t::recvmmsg()
+   *
+   * @param timeout_usec Timeout in microseconds, or zero to block
+   * @param[out] rxbytes Number of bytes received
+   * @return Number of messages received
+   */
+  size_t recvmmsg(char* const* bufs, size_t len, size_t* rxlens,
+                  endpoint_t* addrs, size_t nmsg, int timeout_usec,
+                  size_t& rxbytes);
+  /**
+   * Wait until a message can be received, or until a timeout.
+   *
+   * @param usec Timeout in microseconds
+   * @return True if a message is available
+   */
+  bool wait_readable(int usec);
+
+private:
+  struct io_uring_sqe* get_rx_sqe();
+  void arm_receiver();
+  void recycle(uint16_t bid, uint16_t nbufs);
+  struct io_uring_cqe* next_cqe();
+  std::atomic_size_t& syscalls;
+  uring_queue_t* tx;
+  uring_queue_t* rx;
+  std::mutex mtx;
+  struct msghdr txhdr[URING_ENTRIES];
+  struct iovec txvec[URING_ENTRIES];
+  struct msghdr rxhdr;
+  bool rx_armed;
+  uint8_t sqe_flags;
+  std::vector<char> rxbuffers;
+};
+
+#endif
+
+#endif
+
+/*
+ * Local Variables:
+ * mode: c++
+ * compile-command: "make -C .."
+ * End:
+ */
@@ -0,0 +1,122 @@
+/*
+ * This file is part of the ovbox software tool, see <http://orlandoviols.com/>.
+ *
+ * Copyright (c) 2021 Giso Grimm
+ */
+/*
+ * ovbox is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published
+ * by the Free Software Foundation, version 3 of the License.
+ *
+ * ovbox is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License, version 3 for more details.
+ *
+ * You should have received a copy of the GNU General Public License,
+ * Version 3 along with ovbox. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "workerpool.h"
+#include "common.h"
+#if defined(__linux__)
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+worker_pool_t::worker_pool_t(size_t nthreads, int prio_) : prio(prio_)
+{
+  for(size_t k = 0; k < nthreads; ++k)
+    threads.emplace_back(std::thread(&worker_pool_t::worker, this, k + 1));
+}
+
+worker_pool_t::~worker_pool_t()
+{
+  {
+    std::lock_guard<std::mutex> lk(mtx);
+    runpool = false;
+  }
+  cond_start.notify_all();
+  for(auto& th : threads)
+    if(th.joinable())
+      th.join();
+}
+
+void worker_pool_t::run(size_t njobs, const std::function<void(size_t)>& job)
+{
+  if(threads.empty() || (njobs < 2)) {
+    for(size_t k = 0; k < njobs; ++k)
+      job(k);
+    return;
+  }
+  {
+    std::unique_lock<std::mutex> lk(mtx);
+    // workers of the previous call may still be leaving process():
+    cond_done.wait(lk, [this] { return workers_active == 0u; });
+    current_job = &job;
+    num_jobs = njobs;
+    next_job = 0;
+    jobs_done = 0;
+    ++generation;
+  }
+  cond_start.notify_all();
+  // the calling thread takes part in the processing:
+  process();
+  // wait until all jobs are completed; late workers find no job left
+  // and do not access the job after returning:
+  std::unique_lock<std::mutex> lk(mtx);
+  cond_done.wait(lk, [this, njobs] { return jobs_done == njobs; });
+}
+
+void worker_pool_t::process()
+{
+  size_t k(0);
+  while((k = next_job++) < num_jobs) {
+    (*current_job)(k);
+    if(++jobs_done == num_jobs) {
+      std::lock_guard<std::mutex> lk(mtx);
+      cond_done.notify_all();
+    }
+  }
+}
+
+void worker_pool_t::worker(size_t core)
+{
+#if defined(__linux__)
+  // pin to one core, keep core 0 for the calling thread:
+  size_t ncores(std::thread::hardware_concurrency());
+  if(ncores > 1) {
+    cpu_set_t cpuset;
+    CPU_ZERO(&cpuset);
+    CPU_SET(core % ncores, &cpuset);
+    pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &cpuset);
+  }
+#endif
+  set_thread_prio((unsigned int)prio);
+  uint64_t seen_generation(0);
+  while(true) {
+    {
+      std::unique_lock<std::mutex> lk(mtx);
+      cond_start.wait(lk, [this, &seen_generation] {
+        return (!runpool) || (generation != seen_generation);
+      });
+      if(!runpool)
+        return;
+      seen_generation = generation;
+      ++workers_active;
+    }
+    process();
+    {
+      std::lock_guard<std::mutex> lk(mtx);
+      --workers_active;
+      if(workers_active == 0u)
+        cond_done.notify_all();
+    }
+  }
+}
+
+/*
+ * Local Variables:
+ * compile-command: "make -C .."
+ * End:
+ */
@@ -0,0 +1,93 @@
+/*
+ * This file is part of the ovbox software tool, see <http://orlandoviols.com/>.
+ *
+ * Copyright (c) 2021 Giso Grimm
+ */
+/*
+ * ovbox is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published
+ * by the Free Software Foundation, version 3 of the License.
+ *
+ * ovbox is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License, version 3 for more details.
+ *
+ * You should have received a copy of the GNU General Public License,
+ * Version 3 along with ovbox. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef WORKERPOOL_H
+#define WORKERPOOL_H
+
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/**
+ * Pool of real-time worker threads for short parallel jobs.
+ *
+ * The calling thread takes part in the processing, i.e., with N
+ * worker threads up to N+1 jobs are processed in parallel. Each
+ * worker thread is pinned to its own CPU core (Linux only) and runs
+ * with the given real-time priority.
+ */
+class worker_pool_t {
+public:
+  /**
+   * Start worker threads.
+   *
+   * @param nthreads Number of worker threads
+   * @param prio Real-time priority of worker threads, or zero to use
+   * normal scheduling
+   */
+  worker_pool_t(size_t nthreads, int prio);
+  ~worker_pool_t();
+  worker_pool_t(const worker_pool_t&) = delete;
+  /**
+   * Process jobs in parallel.
+   *
+   * @param njobs Number of jobs
+   * @param job Function to be called once for each job index in [0, njobs)
+   *
+   * The function returns as soon as all jobs are completed, without
+   * waiting for workers which did not pick up a job.
+   */
+  void run(size_t njobs, const std::function<void(size_t)>& job);
+  /**
+   * Return number of worker threads.
+   */
+  size_t size() const { return threads.size(); };
+
+private:
+  void worker(size_t core);
+  void process();
+  std::vector<std::thread> threads;
+  std::mutex mtx;
+  std::condition_variable cond_start;
+  std::condition_variable cond_done;
+  const std::function<void(size_t)>* current_job = nullptr;
+  size_t num_jobs = 0;
+  // incremented for each call of run(), to wake up the workers:
+  uint64_t generation = 0;
+  std::atomic_size_t next_job{0};
+  // number of completed jobs of the current call of run():
+  std::atomic_size_t jobs_done{0};
+  // number of workers inside process(); run() waits for them to
+  // leave before the job state is reset:
+  size_t workers_active = 0;
+  bool runpool = true;
+  const int prio;
+};
+
+#endif
+
+/*
+ * Local Variables:
+ * mode: c++
+ * compile-command: "make -C .."
+ * End:
+ */
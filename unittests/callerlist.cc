@@ -0,0 +1,78 @@
+#include <gtest/gtest.h>
+
+#include "callerlist.h"
+#include <string.h>
+
+class test_endpoint_list_t : public endpoint_list_t {
+public:
+  void reg(stage_device_id_t cid, uint16_t port)
+  {
+    endpoint_t ep;
+    memset(&ep, 0, sizeof(ep));
+    ep.sin_family = AF_INET;
+    ep.sin_port = htons(port);
+    cid_register(cid, (char*)(&ep), B_PEER2PEER, "test");
+  };
+  void set_caps(stage_device_id_t cid, epcaps_t caps)
+  {
+    cid_set_caps(cid, caps);
+  };
+  void announce_caps(stage_device_id_t cid, epcaps_t caps)
+  {
+    announced.push_back(caps);
+  };
+  std::vector<epcaps_t> announced;
+};
+
+TEST(endpointlist, snapshot)
+{
+  test_endpoint_list_t eplist;
+  {
+    auto snap(eplist.get_snapshot());
+    EXPECT_EQ(MAX_STAGE_ID, snap->endpoints.size());
+    EXPECT_EQ(0u, snap->endpoints[3].timeout);
+  }
+  eplist.reg(3, 9000);
+  auto snap1(eplist.get_snapshot());
+  EXPECT_EQ(CALLERLIST_TIMEOUT, snap1->endpoints[3].timeout);
+  EXPECT_EQ(htons(9000), snap1->endpoints[3].ep.sin_port);
+  uint64_t version(snap1->version);
+  // repeated registration without change does not publish a new
+  // snapshot:
+  eplist.reg(3, 9000);
+  EXPECT_EQ(version, eplist.get_snapshot()->version);
+  // changes do not affect snapshots which are in use:
+  for(uint16_t k = 0; k < 2 * ENDPOINT_SNAPSHOTS; ++k)
+    eplist.reg(4, (uint16_t)(9100 + k));
+  EXPECT_EQ(version, snap1->version);
+  EXPECT_EQ(0u, snap1->endpoints[4].timeout);
+  auto snap2(eplist.get_snapshot());
+  EXPECT_LT(version, snap2->version);
+  EXPECT_EQ(htons(9100 + 2 * ENDPOINT_SNAPSHOTS - 1),
+            snap2->endpoints[4].ep.sin_port);
+}
+
+TEST(endpointlist, caps)
+{
+  test_endpoint_list_t eplist;
+  eplist.reg(3, 9000);
+  EXPECT_FALSE(eplist.get_snapshot()->endpoints[3].caps_known);
+  // the first ping is announced, even without features:
+  eplist.set_caps(3, 0);
+  eplist.set_caps(3, 0);
+  eplist.set_caps(3, CAP_NETAUDIO_RX);
+  eplist.set_caps(3, CAP_NETAUDIO_RX);
+  ASSERT_EQ(2u, eplist.announced.size());
+  EXPECT_EQ(0u, eplist.announced[0]);
+  EXPECT_EQ(CAP_NETAUDIO_RX, eplist.announced[1]);
+  auto snap(eplist.get_snapshot());
+  EXPECT_TRUE(snap->endpoints[3].caps_known);
+  EXPECT_EQ(CAP_NETAUDIO_RX, snap->endpoints[3].caps);
+}
+
+// Local Variables:
+// compile-command: "make -C .. unit-tests"
+// coding: utf-8-unix
+// c-basic-offset: 2
+// indent-tabs-mode: nil
+// End:
@@ -1,6 +1,8 @@
 #include <gtest/gtest.h>
 
 #include "common.h"
+#include <sodium.h>
+#include <string.h>
 
 TEST(packmsg, packget)
 {
@@ -20,6 +22,103 @@ TEST(packmsg, packget)
   EXPECT_EQ(0u, len);
 }
 
+TEST(packmsg, header)
+{
+  // headers at unaligned positions:
+  char buf[BUFSIZE];
+  for(size_t offs = 0; offs < 4; ++offs) {
+    char* m(buf + offs);
+    size_t len(packmsg(m, BUFSIZE - offs, 12345678, 13, 9876, -2, "", 0));
+    EXPECT_EQ(HEADERLEN, len);
+    msg_header_t hdr(msg_header_t::load(m));
+    EXPECT_EQ(12345678u, hdr.secret);
+    EXPECT_EQ(13, hdr.callerid);
+    EXPECT_EQ(9876, hdr.port);
+    EXPECT_EQ(-2, hdr.seq);
+    msg_set_port(m, 9877);
+    msg_set_callerid(m, 14);
+    EXPECT_EQ(9877, msg_port(m));
+    EXPECT_EQ(14, msg_callerid(m));
+    EXPECT_EQ(-2, msg_seq(m));
+    hdr.seq = 17;
+    char m2[HEADERLEN];
+    hdr.store(m2);
+    EXPECT_EQ(17, msg_seq(m2));
+    EXPECT_EQ(9876, msg_port(m2));
+  }
+}
+
+TEST(packmsg, aggregate)
+{
+  char buf[64];
+  char msg1[BUFSIZE];
+  char msg2[BUFSIZE];
+  size_t len1(packmsg(msg1, BUFSIZE, 1234, 13, 9876, 7, "abc", 3));
+  size_t len2(packmsg(msg2, BUFSIZE, 1234, 13, 9877, 8, "de", 2));
+  size_t len(HEADERLEN);
+  len = aggregate_add(buf, sizeof(buf), len, msg1, len1);
+  EXPECT_EQ(HEADERLEN + 2 + len1, len);
+  len = aggregate_add(buf, sizeof(buf), len, msg2, len2);
+  EXPECT_EQ(HEADERLEN + 4 + len1 + len2, len);
+  // maximum length is exceeded:
+  EXPECT_EQ(0u, aggregate_add(buf, 40, len, msg1, len1));
+  const char* payload(buf + HEADERLEN);
+  size_t size(len - HEADERLEN);
+  size_t pos(0);
+  size_t msglen(0);
+  const char* msg(aggregate_next(payload, size, pos, msglen));
+  ASSERT_TRUE(msg != NULL);
+  EXPECT_EQ(len1, msglen);
+  EXPECT_EQ(9876, msg_port(msg));
+  EXPECT_EQ(0, memcmp(msg + HEADERLEN, "abc", 3));
+  msg = aggregate_next(payload, size, pos, msglen);
+  ASSERT_TRUE(msg != NULL);
+  EXPECT_EQ(len2, msglen);
+  EXPECT_EQ(8, msg_seq(msg));
+  EXPECT_TRUE(aggregate_next(payload, size, pos, msglen) == NULL);
+  // truncated entries are rejected:
+  pos = 0;
+  EXPECT_TRUE(aggregate_next(payload, len1 + 1, pos, msglen) == NULL);
+}
+
+TEST(encryptmsg, sessionkey)
+{
+  // two peers derive the same session key:
+  uint8_t pk1[crypto_box_PUBLICKEYBYTES];
+  uint8_t sk1[crypto_box_SECRETKEYBYTES];
+  uint8_t pk2[crypto_box_PUBLICKEYBYTES];
+  uint8_t sk2[crypto_box_SECRETKEYBYTES];
+  crypto_box_keypair(pk1, sk1);
+  crypto_box_keypair(pk2, sk2);
+  uint8_t key1[crypto_box_BEFORENMBYTES];
+  uint8_t key2[crypto_box_BEFORENMBYTES];
+  EXPECT_EQ(0, crypto_box_beforenm(key1, pk2, sk1));
+  EXPECT_EQ(0, crypto_box_beforenm(key2, pk1, sk2));
+  EXPECT_EQ(0, memcmp(key1, key2, crypto_box_BEFORENMBYTES));
+  char buf[BUFSIZE];
+  size_t len(packmsg(buf, BUFSIZE, 12345678, 13, 9876, 42, "hello", 5));
+  char cbuf[BUFSIZE];
+  size_t clen(encryptmsg_sessionkey(cbuf, BUFSIZE, buf, len, key1, 1));
+  EXPECT_EQ(len + SESSIONKEY_OVERHEAD, clen);
+  // header remains readable:
+  EXPECT_EQ(12345678u, msg_secret(cbuf));
+  EXPECT_EQ(13, msg_callerid(cbuf));
+  EXPECT_EQ(9876, msg_port(cbuf));
+  EXPECT_EQ(42, msg_seq(cbuf));
+  char dbuf[BUFSIZE];
+  EXPECT_EQ(len, decryptmsg_sessionkey(dbuf, cbuf, clen, key2));
+  EXPECT_EQ(0, memcmp(buf, dbuf, len));
+  // different counter results in different cipher text:
+  char cbuf2[BUFSIZE];
+  EXPECT_EQ(clen, encryptmsg_sessionkey(cbuf2, BUFSIZE, buf, len, key1, 2));
+  EXPECT_NE(0, memcmp(cbuf, cbuf2, clen));
+  // tampered header is rejected:
+  msg_set_seq(cbuf, 43);
+  EXPECT_EQ(0u, decryptmsg_sessionkey(dbuf, cbuf, clen, key2));
+  // too small destination buffer:
+  EXPECT_EQ(0u, encryptmsg_sessionkey(cbuf, len, buf, len, key1, 3));
+}
+
 // Local Variables:
 // compile-command: "make -C .. unit-tests"
 // coding: utf-8-unix
@@ -0,0 +1,88 @@
+#include <gtest/gtest.h>
+
+#include "fec.h"
+#include <string>
+
+class fec_test_t {
+public:
+  // send a data message, return true if a parity message was created:
+  bool send(sequence_t seq, const std::string& payload, bool lost)
+  {
+    char buf[BUFSIZE];
+    size_t len(packmsg(buf, BUFSIZE, 1234, 3, 4464, seq, payload.c_str(),
+                       payload.size()));
+    if(!lost) {
+      msg.pack(1234, 3, 4464, seq, payload.c_str(), payload.size());
+      dec.add(msg);
+    }
+    size_t plen(enc.add(buf, len, 4, parity_payload));
+    if(plen)
+      parity.pack(1234, 3, PORT_FEC, 0, parity_payload, plen);
+    return plen > 0;
+  }
+  bool recover() { return dec.recover(parity, 1234, rec); }
+  fec_encoder_t enc;
+  fec_decoder_t dec;
+  msgbuf_t msg;
+  msgbuf_t parity;
+  msgbuf_t rec;
+  char parity_payload[BUFSIZE];
+};
+
+TEST(fec, recover)
+{
+  EXPECT_TRUE(fec_valid_group(4));
+  EXPECT_FALSE(fec_valid_group(3));
+  EXPECT_FALSE(fec_valid_group(32));
+  fec_test_t t;
+  // the first parity message only starts collecting payloads:
+  EXPECT_FALSE(t.send(4, "a", false));
+  EXPECT_FALSE(t.send(5, "bcd", true));
+  EXPECT_FALSE(t.send(6, "", false));
+  EXPECT_TRUE(t.send(7, "ef", false));
+  EXPECT_FALSE(t.recover());
+  // one lost message of different length is recovered:
+  EXPECT_FALSE(t.send(8, "first", false));
+  EXPECT_FALSE(t.send(9, "the lost message", true));
+  EXPECT_FALSE(t.send(10, "x", false));
+  EXPECT_TRUE(t.send(11, "last message", false));
+  ASSERT_TRUE(t.recover());
+  EXPECT_TRUE(t.rec.valid);
+  EXPECT_EQ(3u, t.rec.cid);
+  EXPECT_EQ(4464u, t.rec.destport);
+  EXPECT_EQ(9, t.rec.seq);
+  EXPECT_EQ(std::string("the lost message"),
+            std::string(t.rec.msg, t.rec.size));
+  EXPECT_EQ(1234, msg_secret(t.rec.rawbuffer));
+  // a recovered message is recovered only once:
+  EXPECT_FALSE(t.recover());
+  // two lost messages can not be recovered:
+  EXPECT_FALSE(t.send(12, "a", true));
+  EXPECT_FALSE(t.send(13, "b", true));
+  EXPECT_FALSE(t.send(14, "c", false));
+  EXPECT_TRUE(t.send(15, "d", false));
+  EXPECT_FALSE(t.recover());
+  // no lost message:
+  for(sequence_t seq = 16; seq < 19; ++seq)
+    EXPECT_FALSE(t.send(seq, "abc", false));
+  EXPECT_TRUE(t.send(19, "abc", false));
+  EXPECT_FALSE(t.recover());
+  message_stat_t stat;
+  t.dec.get_stat(3, stat);
+  // one parity message was processed twice:
+  EXPECT_EQ(5u, stat.fec_overhead);
+  EXPECT_EQ(1u, stat.fec_recovered);
+  // after a sequence jump the parity contains only the sent messages:
+  EXPECT_FALSE(t.send(20, "a", false));
+  EXPECT_FALSE(t.send(25, "b", false));
+  EXPECT_FALSE(t.send(26, "c", false));
+  EXPECT_TRUE(t.send(27, "d", false));
+  EXPECT_EQ(0x0e, msg_load<uint16_t>(t.parity.msg, 4));
+}
+
+// Local Variables:
+// compile-command: "make -C .. unit-tests"
+// coding: utf-8-unix
+// c-basic-offset: 2
+// indent-tabs-mode: nil
+// End:
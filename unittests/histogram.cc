@@ -0,0 +1,82 @@
+#include <gtest/gtest.h>
+
+#include "histogram.h"
+#include <algorithm>
+#include <vector>
+
+TEST(histogram, bucket)
+{
+  EXPECT_EQ(0u, latency_histogram_t::bucket(-1.0f));
+  EXPECT_EQ(0u, latency_histogram_t::bucket(0.0f));
+  EXPECT_EQ(1u, latency_histogram_t::bucket(1.0f / 128.0f));
+  EXPECT_EQ(HIST_BUCKETS - 1u, latency_histogram_t::bucket(1e5f));
+  // buckets are monotonic:
+  size_t b(0);
+  for(float v = 0.001f; v < 20000.0f; v *= 1.01f) {
+    size_t b2(latency_histogram_t::bucket(v));
+    EXPECT_LE(b, b2);
+    EXPECT_LT(b2, (size_t)HIST_BUCKETS);
+    b = b2;
+  }
+}
+
+TEST(histogram, rank)
+{
+  latency_histogram_t hist;
+  EXPECT_EQ(0u, hist.size());
+  EXPECT_EQ(-1.0f, hist.get_rank(0));
+  std::vector<float> data;
+  for(size_t k = 0; k < 1000; ++k)
+    data.push_back(10.0f + 0.37f * (float)((k * 7919u) % 1000u));
+  for(auto v : data)
+    hist.add(v);
+  EXPECT_EQ(data.size(), hist.size());
+  std::sort(data.begin(), data.end());
+  for(size_t rank : {0u, 10u, 500u, 990u, 999u})
+    EXPECT_NEAR(data[rank], hist.get_rank(rank),
+                data[rank] / HIST_SUBBUCKETS);
+  EXPECT_EQ(-1.0f, hist.get_rank(data.size()));
+  // remove all values but one, results are exact again:
+  for(size_t k = 1; k < data.size(); ++k)
+    hist.remove(data[k]);
+  EXPECT_EQ(1u, hist.size());
+  EXPECT_EQ(data[0], hist.get_rank(0));
+  hist.clear();
+  EXPECT_EQ(0u, hist.size());
+}
+
+TEST(histogram, merge)
+{
+  latency_histogram_t h1;
+  latency_histogram_t h2;
+  h1.add(2.0f);
+  h1.add(4.0f);
+  h2.add(3.0f);
+  h2.add(100.0f);
+  latency_histogram_t sum(h1);
+  sum += h2;
+  EXPECT_EQ(4u, sum.size());
+  EXPECT_EQ(2.0f, sum.get_rank(0));
+  EXPECT_EQ(3.0f, sum.get_rank(1));
+  EXPECT_EQ(100.0f, sum.get_rank(3));
+  EXPECT_EQ(2u, sum.get_count(latency_histogram_t::bucket(100.0f)) +
+                    sum.get_count(latency_histogram_t::bucket(2.0f)));
+  sum -= h1;
+  EXPECT_EQ(2u, sum.size());
+  EXPECT_EQ(3.0f, sum.get_rank(0));
+  EXPECT_EQ(100.0f, sum.get_rank(1));
+  // bucket limits:
+  size_t b(latency_histogram_t::bucket(100.0f));
+  EXPECT_LE(latency_histogram_t::bucket_lower(b), 100.0f);
+  EXPECT_GT(latency_histogram_t::bucket_upper(b), 100.0f);
+  EXPECT_EQ(latency_histogram_t::bucket_upper(b),
+            latency_histogram_t::bucket_lower(b + 1));
+  EXPECT_EQ(0.0f, latency_histogram_t::bucket_lower(0));
+}
+
+// Local Variables:
+// compile-command: "make -C .. unit-tests"
+// coding: utf-8-unix
+// c-basic-offset: 2
+// indent-tabs-mode: nil
+// End:
@@ -0,0 +1,268 @@
+#include <gtest/gtest.h>
+
+#include "errmsg.h"
+#include "netaudio.h"
+#include <unistd.h>
+#include <vector>
+
+TEST(netaudio, codec)
+{
+  EXPECT_EQ(NETAUDIO_24BIT, netaudio_format("24bit"));
+  EXPECT_THROW(netaudio_format("8bit"), ErrMsg);
+  std::vector<float> ch1 = {0.0f, 0.5f, -0.5f, 1.0f, -1.0f, 2.0f};
+  std::vector<float> ch2 = {0.25f, -0.25f, 0.125f, 0.0f, 0.0f, -2.0f};
+  const float* audio[2] = {ch1.data(), ch2.data()};
+  char buf[256];
+  for(auto fmt : {NETAUDIO_16BIT, NETAUDIO_24BIT, NETAUDIO_FLOAT}) {
+    size_t len(
+        netaudio_encode(buf, sizeof(buf), fmt, 2, 6, 1234, 48000, audio));
+    EXPECT_EQ(NETAUDIO_HEADERLEN + 12 * netaudio_sample_size(fmt), len);
+    netaudio_packet_t pkt;
+    ASSERT_TRUE(netaudio_decode(buf, len, pkt));
+    EXPECT_EQ(fmt, pkt.format);
+    EXPECT_EQ(2u, pkt.channels);
+    EXPECT_EQ(6u, pkt.frames);
+    EXPECT_EQ(1234u, pkt.frame);
+    EXPECT_EQ(48000u, pkt.srate);
+    // truncated messages are invalid:
+    EXPECT_FALSE(netaudio_decode(buf, len - 1, pkt));
+    netaudio_jitterbuffer_t jb(2, 0);
+    float out1[6];
+    float out2[6];
+    float* out[2] = {out1, out2};
+    // the first message starts the stream at its end:
+    jb.put(pkt);
+    jb.get(out, 6);
+    pkt.frame += 6;
+    jb.put(pkt);
+    jb.get(out, 6);
+    float tol(fmt == NETAUDIO_16BIT ? 1e-4f : 1e-6f);
+    // integer formats are clipped:
+    float lim(fmt == NETAUDIO_FLOAT ? 2.0f : 1.0f);
+    for(size_t k = 0; k < 6; ++k) {
+      EXPECT_NEAR(std::min(lim, std::max(-lim, ch1[k])), out1[k], tol);
+      EXPECT_NEAR(std::min(lim, std::max(-lim, ch2[k])), out2[k], tol);
+    }
+  }
+  // buffer too short:
+  EXPECT_EQ(0u, netaudio_encode(buf, 40, NETAUDIO_FLOAT, 2, 6, 0, 0, audio));
+  buf[0] = 0;
+  netaudio_packet_t pkt;
+  EXPECT_FALSE(netaudio_decode(buf, sizeof(buf), pkt));
+}
+
+class jitterbuffer_test_t {
+public:
+  jitterbuffer_test_t(uint32_t target) : jb(1, target) {}
+  void put(uint32_t frame)
+  {
+    float data[32];
+    for(uint32_t k = 0; k < 32; ++k)
+      data[k] = (float)(frame + k);
+    const float* audio[1] = {data};
+    size_t len(netaudio_encode(buf, sizeof(buf), NETAUDIO_FLOAT, 1, 32, frame,
+                               48000, audio));
+    netaudio_packet_t pkt;
+    netaudio_decode(buf, len, pkt);
+    jb.put(pkt);
+  }
+  std::vector<float> get()
+  {
+    std::vector<float> v(32);
+    float* out[1] = {v.data()};
+    jb.get(out, 32);
+    return v;
+  }
+  netaudio_jitterbuffer_t jb;
+  char buf[1024];
+};
+
+TEST(netaudio, jitterbuffer)
+{
+  jitterbuffer_test_t t(64);
+  // silence before the first message:
+  EXPECT_EQ(0.0f, t.get()[0]);
+  std::vector<float> v;
+  // the first message starts the stream:
+  uint32_t frame(1000);
+  t.put(frame);
+  frame += 32;
+  for(size_t k = 0; k < 8; ++k) {
+    t.put(frame);
+    frame += 32;
+    v = t.get();
+  }
+  // playback is delayed by the buffer length:
+  EXPECT_EQ((float)(frame - 64), v[0]);
+  EXPECT_EQ((float)(frame - 64 + 31), v[31]);
+  // swapped messages are sorted:
+  t.put(frame + 32);
+  t.put(frame);
+  frame += 64;
+  v = t.get();
+  EXPECT_EQ((float)(frame - 96), v[0]);
+  v = t.get();
+  EXPECT_EQ((float)(frame - 64), v[0]);
+  EXPECT_EQ(0u, t.jb.late);
+  // lost messages are replaced by silence:
+  t.put(frame + 32);
+  frame += 64;
+  v = t.get();
+  EXPECT_EQ((float)(frame - 96), v[0]);
+  v = t.get();
+  EXPECT_EQ(0.0f, v[0]);
+  EXPECT_EQ(0.0f, v[31]);
+  // the lost message arrives too late:
+  t.put(frame - 64);
+  EXPECT_EQ(1u, t.jb.late);
+  // missing messages cause an underrun:
+  v = t.get();
+  EXPECT_EQ((float)(frame - 32), v[0]);
+  EXPECT_EQ(0u, t.jb.underruns);
+  v = t.get();
+  EXPECT_EQ(1u, t.jb.underruns);
+  EXPECT_EQ(0u, t.jb.resets);
+  // restart of the sender:
+  t.put(100000);
+  EXPECT_EQ(1u, t.jb.resets);
+  t.put(100032);
+  v = t.get();
+  EXPECT_EQ(0.0f, v[0]);
+  for(frame = 100064; frame < 100192; frame += 32) {
+    t.put(frame);
+    v = t.get();
+  }
+  EXPECT_EQ((float)(frame - 64), v[0]);
+  EXPECT_EQ(1u, t.jb.resets);
+}
+
+TEST(netaudio, drift)
+{
+  jitterbuffer_test_t t(128);
+  uint32_t frame(0);
+  // the sender is faster by one block every 100 blocks:
+  for(size_t k = 0; k < 3000; ++k) {
+    t.put(frame);
+    frame += 32;
+    if(k % 100 == 0) {
+      t.put(frame);
+      frame += 32;
+    }
+    std::vector<float> v(t.get());
+    if(k > 1000) {
+      // the delay stays close to the target:
+      float delay((float)frame - v[0]);
+      EXPECT_LT(128.0f, delay);
+      EXPECT_GT(128.0f + 4.0f * 32.0f, delay);
+    }
+  }
+  EXPECT_EQ(0u, t.jb.underruns);
+  EXPECT_EQ(0u, t.jb.resets);
+}
+
+TEST(netaudio, receiver)
+{
+  netaudio_receiver_t rec;
+  EXPECT_EQ(0u, rec.add_stream(4464, 2, 0.0, 48000));
+  EXPECT_EQ(2u, rec.add_stream(4466, 1, 0.0, 48000));
+  EXPECT_EQ(3u, rec.get_channels());
+  char buf[256];
+  float data[4] = {0.5f, 0.5f, 0.5f, 0.5f};
+  const float* audio[2] = {data, data};
+  size_t len(
+      netaudio_encode(buf, sizeof(buf), NETAUDIO_FLOAT, 2, 4, 0, 48000, audio));
+  EXPECT_FALSE(rec.receive(4468, buf, len));
+  EXPECT_TRUE(netaudio_receiver_t::receive_cb(4464, buf, len, &rec));
+  // wrong sampling rate:
+  len =
+      netaudio_encode(buf, sizeof(buf), NETAUDIO_FLOAT, 1, 4, 0, 44100, audio);
+  EXPECT_TRUE(rec.receive(4466, buf, len));
+  EXPECT_EQ(1u, rec.invalid);
+  float out[3][4];
+  float* pout[3] = {out[0], out[1], out[2]};
+  // the first message starts the stream:
+  rec.process(pout, 4);
+  len =
+      netaudio_encode(buf, sizeof(buf), NETAUDIO_FLOAT, 2, 4, 4, 48000, audio);
+  EXPECT_TRUE(rec.receive(4464, buf, len));
+  rec.process(pout, 4);
+  EXPECT_EQ(0.5f, out[0][0]);
+  EXPECT_EQ(0.5f, out[1][3]);
+  EXPECT_EQ(0.0f, out[2][0]);
+}
+
+struct send_log_t {
+  std::mutex mtx;
+  std::vector<netaudio_packet_t> pkts;
+  std::vector<std::vector<char>> msgs;
+  static void send(char* buf, size_t len, bool inplace, void* data)
+  {
+    send_log_t* self((send_log_t*)data);
+    std::lock_guard<std::mutex> lock(self->mtx);
+    if(inplace)
+      buf += HEADERLEN;
+    self->msgs.push_back(std::vector<char>(buf, buf + len));
+    netaudio_packet_t pkt;
+    EXPECT_TRUE(netaudio_decode(buf, len, pkt));
+    self->pkts.push_back(pkt);
+  }
+  size_t size()
+  {
+    std::lock_guard<std::mutex> lock(mtx);
+    return pkts.size();
+  }
+};
+
+TEST(netaudio, sender)
+{
+  for(bool inplace : {true, false}) {
+    netaudio_sender_t snd(2, NETAUDIO_16BIT, 48000, inplace);
+    send_log_t log;
+    std::vector<float> ch1(1000, 0.25f);
+    std::vector<float> ch2(1000, -0.25f);
+    const float* in[2] = {ch1.data(), ch2.data()};
+    // blocks are dropped while the sender is not running:
+    snd.process(in, 64);
+    EXPECT_EQ(1u, snd.dropped);
+    snd.start(&send_log_t::send, &log, 0);
+    snd.process(in, 64);
+    // large blocks are split to avoid IP fragmentation:
+    snd.process(in, 1000);
+    for(size_t k = 0; (k < 1000) && (log.size() < 4); ++k)
+      usleep(1000);
+    snd.stop();
+    ASSERT_EQ(4u, log.pkts.size());
+    EXPECT_EQ(64u, log.pkts[0].frame);
+    EXPECT_EQ(64u, log.pkts[0].frames);
+    EXPECT_EQ(128u, log.pkts[1].frame);
+    EXPECT_EQ(350u, log.pkts[1].frames);
+    EXPECT_EQ(478u, log.pkts[2].frame);
+    EXPECT_EQ(828u, log.pkts[3].frame);
+    EXPECT_EQ(300u, log.pkts[3].frames);
+    EXPECT_EQ(48000u, log.pkts[0].srate);
+    EXPECT_EQ(NETAUDIO_HEADERLEN + 1400u, log.msgs[1].size());
+    // the messages can be received:
+    netaudio_jitterbuffer_t jb(2, 0);
+    float out1[350];
+    float out2[350];
+    float* out[2] = {out1, out2};
+    for(auto& msg : log.msgs) {
+      netaudio_packet_t pkt;
+      if(netaudio_decode(msg.data(), msg.size(), pkt))
+        jb.put(pkt);
+      if(&msg == &(log.msgs[0]))
+        // start the stream:
+        jb.get(out, 350);
+    }
+    jb.get(out, 350);
+    EXPECT_NEAR(0.25f, out1[0], 1e-4f);
+    EXPECT_NEAR(-0.25f, out2[349], 1e-4f);
+  }
+}
+
+// Local Variables:
+// compile-command: "make -C .. unit-tests"
+// coding: utf-8-unix
+// c-basic-offset: 2
+// indent-tabs-mode: nil
+// End:
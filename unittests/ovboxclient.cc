@@ -1,6 +1,9 @@
 #include <gtest/gtest.h>
 
 #include "ovboxclient.h"
+#include <chrono>
+#include <memory>
+#include <stdio.h>
 
 TEST(sorter, processSameMsg)
 {
@@ -282,25 +285,54 @@ TEST(sorter, processSameSeq)
   res = sorter.process(&pmsg);
   EXPECT_EQ(true, res);
   EXPECT_EQ(2, pmsg->seq);
+  // duplicates are dropped:
   msg.pack(sec, id, port, 2, "", 0);
   pmsg = &msg;
   res = sorter.process(&pmsg);
-  EXPECT_EQ(true, res);
-  EXPECT_EQ(2, pmsg->seq);
+  EXPECT_EQ(false, res);
   msg.pack(sec, id, port, 2, "", 0);
   pmsg = &msg;
   res = sorter.process(&pmsg);
-  EXPECT_EQ(true, res);
-  EXPECT_EQ(2, pmsg->seq);
+  EXPECT_EQ(false, res);
   res = sorter.process(&pmsg);
   EXPECT_EQ(false, res);
   message_stat_t stat(sorter.get_stat(id));
-  EXPECT_EQ(4u, stat.received);
+  EXPECT_EQ(2u, stat.received);
+  EXPECT_EQ(2u, stat.duplicates);
   EXPECT_EQ(0u, stat.lost);
   EXPECT_EQ(0u, stat.seqerr_in);
   EXPECT_EQ(0u, stat.seqerr_out);
 }
 
+TEST(sorter, redundant)
+{
+  // two copies of each message arrive over paths with different
+  // delays, and some messages are lost on one of the paths:
+  message_sorter_t sorter;
+  msgbuf_t msg;
+  std::vector<sequence_t> out;
+  auto receive = [&](sequence_t seq) {
+    msg.pack(1234567, 13, 1234, seq, "", 0);
+    msgbuf_t* pmsg(&msg);
+    while(sorter.process(&pmsg))
+      out.push_back(pmsg->seq);
+  };
+  for(sequence_t seq = 100; seq < 140; ++seq) {
+    if(seq % 7)
+      receive(seq);
+    if((seq >= 103) && ((seq - 3) % 5))
+      receive((sequence_t)(seq - 3));
+  }
+  message_stat_t stat(sorter.get_stat(13));
+  // only message 105 is lost on both paths:
+  EXPECT_EQ(39u, out.size());
+  EXPECT_EQ(1u, stat.lost);
+  for(size_t k = 1; k < out.size(); ++k)
+    EXPECT_NE(out[k - 1], out[k]);
+  EXPECT_EQ(out.size(), stat.received);
+  EXPECT_EQ(25u, stat.duplicates);
+}
+
 TEST(sorter, processJumpFirst)
 {
   secret_t sec(1234567);
@@ -333,6 +365,262 @@ TEST(sorter, processJumpFirst)
   EXPECT_EQ(0u, stat.seqerr_out);
 }
 
+// process a message and return sequence numbers of all forwarded
+// messages:
+static std::vector<sequence_t>
+process_window(message_sorter_t& sorter, msgbuf_t& msg, sequence_t seq,
+               const sorter_clock_t::time_point& t)
+{
+  std::vector<sequence_t> res;
+  msg.pack(1234567, 13, 1234, seq, "", 0);
+  msgbuf_t* pmsg(&msg);
+  while(sorter.process(&pmsg, t))
+    res.push_back(pmsg->seq);
+  return res;
+}
+
+static std::vector<sequence_t>
+release_window(message_sorter_t& sorter, msgbuf_t& msg,
+               const sorter_clock_t::time_point& t)
+{
+  std::vector<sequence_t> res;
+  msg.valid = false;
+  msgbuf_t* pmsg(&msg);
+  while(sorter.process(&pmsg, t))
+    res.push_back(pmsg->seq);
+  return res;
+}
+
+TEST(sorter, windowReorder)
+{
+  message_sorter_t sorter;
+  sorter.set_depth(4);
+  sorter.set_deadline_usec(5000);
+  msgbuf_t msg;
+  auto t(sorter_clock_t::now());
+  typedef std::vector<sequence_t> sv;
+  EXPECT_EQ(sv({1}), process_window(sorter, msg, 1, t));
+  EXPECT_EQ(sv({2}), process_window(sorter, msg, 2, t));
+  // three messages are reordered:
+  EXPECT_EQ(sv(), process_window(sorter, msg, 5, t));
+  EXPECT_EQ(sv(), process_window(sorter, msg, 4, t));
+  EXPECT_EQ(5000, sorter.get_wait_usec(t));
+  EXPECT_EQ(sv({3, 4, 5}), process_window(sorter, msg, 3, t));
+  EXPECT_EQ(-1, sorter.get_wait_usec(t));
+  EXPECT_EQ(sv({6}), process_window(sorter, msg, 6, t));
+  message_stat_t stat(sorter.get_stat(13));
+  EXPECT_EQ(6u, stat.received);
+  EXPECT_EQ(0u, stat.lost);
+  EXPECT_EQ(2u, stat.seqerr_in);
+  EXPECT_EQ(0u, stat.seqerr_out);
+}
+
+TEST(sorter, windowDeadline)
+{
+  message_sorter_t sorter;
+  sorter.set_depth(4);
+  sorter.set_deadline_usec(5000);
+  msgbuf_t msg;
+  auto t(sorter_clock_t::now());
+  typedef std::vector<sequence_t> sv;
+  EXPECT_EQ(sv({1}), process_window(sorter, msg, 1, t));
+  EXPECT_EQ(sv(), process_window(sorter, msg, 3, t));
+  EXPECT_EQ(sv(), process_window(sorter, msg, 4, t));
+  EXPECT_EQ(sv(),
+            release_window(sorter, msg, t + std::chrono::milliseconds(1)));
+  EXPECT_EQ(0, sorter.get_wait_usec(t + std::chrono::milliseconds(6)));
+  // deadline has passed, skip the missing message:
+  EXPECT_EQ(sv({3, 4}),
+            release_window(sorter, msg, t + std::chrono::milliseconds(6)));
+  // a late message is forwarded:
+  EXPECT_EQ(sv({2}), process_window(sorter, msg, 2, t));
+  message_stat_t stat(sorter.get_stat(13));
+  EXPECT_EQ(4u, stat.received);
+  EXPECT_EQ(1u, stat.lost);
+  EXPECT_EQ(1u, stat.seqerr_in);
+  EXPECT_EQ(1u, stat.seqerr_out);
+}
+
+TEST(sorter, windowFull)
+{
+  message_sorter_t sorter;
+  sorter.set_depth(2);
+  sorter.set_deadline_usec(5000);
+  msgbuf_t msg;
+  auto t(sorter_clock_t::now());
+  typedef std::vector<sequence_t> sv;
+  EXPECT_EQ(sv({1}), process_window(sorter, msg, 1, t));
+  EXPECT_EQ(sv(), process_window(sorter, msg, 3, t));
+  EXPECT_EQ(sv(), process_window(sorter, msg, 4, t));
+  // window is full, skip the missing message:
+  EXPECT_EQ(sv({3, 4, 5}), process_window(sorter, msg, 5, t));
+  EXPECT_EQ(-1, sorter.get_wait_usec(t));
+  message_stat_t stat(sorter.get_stat(13));
+  EXPECT_EQ(4u, stat.received);
+  EXPECT_EQ(1u, stat.lost);
+  EXPECT_EQ(0u, stat.seqerr_in);
+  EXPECT_EQ(0u, stat.seqerr_out);
+}
+
+TEST(sorter, benchmark)
+{
+  // sequence patterns of the scenarios above, repeated with a period
+  // of eight messages: in-order, swapped pair, lost message
+  const std::vector<std::pair<std::string, std::vector<sequence_t>>>
+      scenarios = {{"inc", {1, 2, 3, 4, 5, 6, 7, 8}},
+                   {"swap", {1, 2, 4, 3, 5, 6, 7, 8}},
+                   {"skip", {1, 2, 3, 5, 6, 7, 8}}};
+  secret_t sec(1234567);
+  const size_t ndevices(16);
+  const size_t nports(2);
+  const size_t nperiods(2000);
+  msgbuf_t msg;
+  for(const auto& scen : scenarios) {
+    message_sorter_t sorter;
+    size_t nmsg(0);
+    auto t0 = std::chrono::high_resolution_clock::now();
+    for(size_t period = 0; period < nperiods; ++period) {
+      for(auto seq : scen.second) {
+        for(stage_device_id_t id = 0; id < ndevices; ++id) {
+          for(port_t port = 4464; port < 4464 + nports; ++port) {
+            msg.pack(sec, id, port, (sequence_t)(seq + 8 * period), "", 0);
+            msgbuf_t* pmsg(&msg);
+            while(sorter.process(&pmsg))
+              ;
+            ++nmsg;
+          }
+        }
+      }
+    }
+    double t(std::chrono::duration<double>(
+                 std::chrono::high_resolution_clock::now() - t0)
+                 .count());
+    EXPECT_EQ(ndevices * nports * nperiods * scen.second.size(),
+              sorter.get_stat(3).received * ndevices);
+    printf("sorter %s: %zu messages, %g ns per message\n",
+           scen.first.c_str(), nmsg, 1e9 * t / (double)nmsg);
+  }
+}
+
+TEST(pathselector, update)
+{
+  ping_stat_t ps[PATH_NONE];
+  const ping_stat_t* const stat[PATH_NONE] = {&(ps[PATH_P2P]), &(ps[PATH_SRV]),
+                                              &(ps[PATH_LOC])};
+  auto set = [&](path_t path, float p99, size_t received, size_t lost) {
+    ps[path].t_p99 = p99;
+    ps[path].received = received;
+    ps[path].lost = lost;
+  };
+  const uint8_t all((1u << PATH_P2P) | (1u << PATH_SRV) | (1u << PATH_LOC));
+  path_selector_t sel;
+  EXPECT_EQ(PATH_NONE, sel.get());
+  // no pings received:
+  EXPECT_FALSE(sel.update(stat, all));
+  EXPECT_EQ(PATH_NONE, sel.get());
+  set(PATH_P2P, 20.0f, 100, 0);
+  set(PATH_SRV, 30.0f, 100, 0);
+  EXPECT_TRUE(sel.update(stat, all));
+  EXPECT_EQ(PATH_P2P, sel.get());
+  // a slightly faster path is not selected:
+  set(PATH_SRV, 19.0f, 100, 0);
+  for(size_t k = 0; k < 10; ++k)
+    EXPECT_FALSE(sel.update(stat, all));
+  // a faster path is selected after some updates:
+  set(PATH_SRV, 15.0f, 100, 0);
+  for(size_t k = 1; k < PATH_SWITCHCOUNT; ++k)
+    EXPECT_FALSE(sel.update(stat, all));
+  EXPECT_TRUE(sel.update(stat, all));
+  EXPECT_EQ(PATH_SRV, sel.get());
+  // lossy paths are avoided:
+  set(PATH_LOC, 1.0f, 90, 10);
+  for(size_t k = 0; k < 10; ++k)
+    EXPECT_FALSE(sel.update(stat, all));
+  // ...unless they are the only ones, and a single lost reply is
+  // tolerated:
+  set(PATH_LOC, 1.0f, 10, 1);
+  for(size_t k = 1; k < PATH_SWITCHCOUNT; ++k)
+    EXPECT_FALSE(sel.update(stat, all));
+  EXPECT_TRUE(sel.update(stat, all));
+  EXPECT_EQ(PATH_LOC, sel.get());
+  // the path is switched immediately if it is not available anymore:
+  EXPECT_TRUE(sel.update(stat, (1u << PATH_P2P) | (1u << PATH_SRV)));
+  EXPECT_EQ(PATH_SRV, sel.get());
+  set(PATH_SRV, 15.0f, 0, 10);
+  EXPECT_TRUE(sel.update(stat, all));
+  EXPECT_EQ(PATH_LOC, sel.get());
+  EXPECT_EQ(std::string("loc"), to_string(PATH_LOC));
+}
+
+TEST(uplinkbudget, update)
+{
+  uplink_budget_t ub;
+  // no limit:
+  EXPECT_FALSE(ub.update(1e6, 0.5));
+  EXPECT_EQ(10u, ub.get_direct(1e5, 10, false));
+  ub.set_limit(1e6);
+  EXPECT_EQ(1e6, ub.get());
+  // all peers fit into the budget:
+  EXPECT_EQ(10u, ub.get_direct(1e5, 10, false));
+  EXPECT_EQ(9u, ub.get_direct(1e5, 9, true));
+  // one copy is reserved for the server:
+  EXPECT_EQ(9u, ub.get_direct(1e5, 12, false));
+  EXPECT_EQ(1u, ub.get_direct(4e5, 12, false));
+  EXPECT_EQ(0u, ub.get_direct(6e5, 12, false));
+  // loss reduces the budget below the measured rate:
+  EXPECT_TRUE(ub.update(8e5, 0.1));
+  EXPECT_NEAR(UPLINK_DECREASE * 8e5, ub.get(), 1.0);
+  EXPECT_EQ(5u, ub.get_direct(1e5, 12, false));
+  // ...and it recovers slowly without loss:
+  EXPECT_TRUE(ub.update(6e5, 0.0));
+  EXPECT_NEAR(UPLINK_DECREASE * 8e5 + UPLINK_INCREASE * 1e6, ub.get(), 1.0);
+  for(size_t k = 0; k < 100; ++k)
+    ub.update(6e5, 0.0);
+  EXPECT_EQ(1e6, ub.get());
+  EXPECT_FALSE(ub.update(6e5, 0.0));
+}
+
+TEST(lanprobe, update)
+{
+  lan_probe_t lan;
+  endpoint_t ep;
+  memset(&ep, 0, sizeof(ep));
+  ep.sin_family = AF_INET;
+  ep.sin_addr.s_addr = htonl(0x0a010203);
+  ep.sin_port = htons(45678);
+  const uint32_t active((1u << 2) | (1u << 5));
+  // peers are not reachable without local pong:
+  EXPECT_FALSE(lan.update(active));
+  EXPECT_FALSE(lan.is_reachable(2));
+  EXPECT_FALSE(lan.is_local(2, ep));
+  lan.add_pong(2, ep);
+  EXPECT_TRUE(lan.update(active));
+  EXPECT_TRUE(lan.is_reachable(2));
+  EXPECT_FALSE(lan.is_reachable(5));
+  EXPECT_TRUE(lan.is_local(2, ep));
+  EXPECT_EQ(ep2str(ep), ep2str(lan.get_endpoint(2)));
+  // the peer stays reachable for some missed pongs:
+  for(size_t k = 1; k < LAN_MAXMISS; ++k)
+    EXPECT_FALSE(lan.update(active));
+  EXPECT_TRUE(lan.is_reachable(2));
+  lan.add_pong(2, ep);
+  EXPECT_FALSE(lan.update(active));
+  for(size_t k = 1; k < LAN_MAXMISS; ++k)
+    EXPECT_FALSE(lan.update(active));
+  EXPECT_TRUE(lan.update(active));
+  EXPECT_FALSE(lan.is_reachable(2));
+  // a changed local endpoint is reported:
+  lan.add_pong(2, ep);
+  EXPECT_TRUE(lan.update(active));
+  ep.sin_port = htons(45679);
+  lan.add_pong(2, ep);
+  EXPECT_TRUE(lan.update(active));
+  EXPECT_EQ(ep2str(ep), ep2str(lan.get_endpoint(2)));
+  // inactive peers are not reachable:
+  EXPECT_TRUE(lan.update(1u << 5));
+  EXPECT_FALSE(lan.is_reachable(2));
+}
+
 TEST(pingstat, get)
 {
   ping_stat_collector_t ps(8);
@@ -412,6 +700,149 @@ TEST(pingstat, get)
   EXPECT_EQ(15.0, stat.t_mean);
 }
 
+TEST(pingstat, histogram)
+{
+  ping_stat_collector_t ps(4);
+  ping_stat_t stat;
+  ping_stat_t pathstat;
+  ps.add_value(1.0);
+  ps.add_value(2.0);
+  ps.update_ping_stat(stat, true);
+  ASSERT_EQ(2u, stat.hist.size());
+  EXPECT_EQ(latency_histogram_t::bucket(1.0), stat.hist[0].first);
+  EXPECT_EQ(1u, stat.hist[0].second);
+  // only values since last report are reported, including those
+  // which are no longer in the window:
+  for(size_t k = 0; k < 6; ++k)
+    ps.add_value(7.0);
+  // updates without report do not reset the histogram:
+  ps.update_ping_stat(pathstat);
+  EXPECT_EQ(8u, pathstat.received);
+  EXPECT_EQ(0u, pathstat.hist.size());
+  ps.update_ping_stat(stat, true);
+  ASSERT_EQ(1u, stat.hist.size());
+  EXPECT_EQ(latency_histogram_t::bucket(7.0), stat.hist[0].first);
+  EXPECT_EQ(6u, stat.hist[0].second);
+  EXPECT_EQ(7.0, stat.t_min);
+  ps.update_ping_stat(stat, true);
+  EXPECT_EQ(0u, stat.hist.size());
+}
+
+TEST(pingstat, snapshot)
+{
+  ping_stat_collector_t ps(4);
+  ping_stat_snapshot_t snap;
+  ping_stat_t stat;
+  ping_stat_t pathstat;
+  ps.sent = 3;
+  ps.add_value(1.0);
+  ps.add_value(2.0);
+  snap.read(ps, stat, true);
+  EXPECT_EQ(2u, stat.received);
+  EXPECT_EQ(1u, stat.lost);
+  EXPECT_EQ(2u, stat.hist.size());
+  // each reader gets all values since its own previous read:
+  snap.read(ps, pathstat);
+  EXPECT_EQ(2u, pathstat.received);
+  EXPECT_EQ(1u, pathstat.lost);
+  EXPECT_EQ(0u, pathstat.hist.size());
+  EXPECT_EQ(1.0f, pathstat.t_min);
+  ps.sent = 4;
+  ps.add_value(3.0);
+  snap.read(ps, pathstat);
+  EXPECT_EQ(1u, pathstat.received);
+  EXPECT_EQ(0u, pathstat.lost);
+  snap.read(ps, stat, true);
+  EXPECT_EQ(1u, stat.received);
+  EXPECT_EQ(0u, stat.lost);
+  ASSERT_EQ(1u, stat.hist.size());
+  EXPECT_EQ(latency_histogram_t::bucket(3.0), stat.hist[0].first);
+}
+
+class test_ovboxclient_t : public ovboxclient_t {
+public:
+  test_ovboxclient_t()
+      : ovboxclient_t("127.0.0.1", 39999, 0, 0, 0, 1234, 0, true, false,
+                      false, false, 10.0, false, false, false, false)
+  {
+  }
+  // register a peer-to-peer peer which answered a local ping:
+  void add_lan_peer(stage_device_id_t cid, epcaps_t caps, port_t port)
+  {
+    endpoint_t ep(ovgethostbyname("127.0.0.1"));
+    ep.sin_port = htons(port);
+    cid_register(cid, (char*)(&ep), B_PEER2PEER, "test");
+    cid_set_caps(cid, caps);
+    ep.sin_addr.s_addr = htonl(INADDR_LOOPBACK + 1);
+    lan.add_pong(cid, ep);
+    lan_mask |= 1u << cid;
+    lan.update(lan_mask);
+  }
+  using ovboxclient_t::forward_to_proxy_clients;
+  using ovboxclient_t::update_routing_plan;
+  uint32_t lan_mask = 0;
+};
+
+TEST(routingplan, parity)
+{
+  test_ovboxclient_t client;
+  client.set_redundancy(true);
+  client.set_fec(4);
+  // peer 1 cannot receive parity, peer 2 can:
+  client.add_lan_peer(1, 0, 9001);
+  client.add_lan_peer(2, CAP_FEC, 9002);
+  auto snap(client.get_snapshot());
+  routing_plan_t plan;
+  client.update_routing_plan(*snap, plan, true);
+  // data to both endpoints of both peers:
+  EXPECT_EQ(4u, plan.ndest);
+  routing_plan_t parity_plan;
+  client.update_routing_plan(*snap, parity_plan, true, true);
+  // parity only once to peer 2, and not via the server, which would
+  // forward it to peer 1:
+  ASSERT_EQ(1u, parity_plan.ndest);
+  EXPECT_EQ(htons(9002), parity_plan.dest[0].ep.sin_port);
+  EXPECT_EQ(0u, parity_plan.nagg);
+}
+
+// receiver of a proxy client, bound to its own loopback address:
+static udpsocket_t* proxy_client_receiver(const char* addr, port_t& port)
+{
+  udpsocket_t* rec(new udpsocket_t());
+  endpoint_t ep(ovgethostbyname(addr));
+  ep.sin_port = htons(port);
+  if(bind(rec->getsockfd(), (struct sockaddr*)(&ep), sizeof(ep)) != 0) {
+    delete rec;
+    return nullptr;
+  }
+  rec->set_timeout_usec(100000);
+  port = ntohs(rec->getsockep().sin_port);
+  return rec;
+}
+
+TEST(proxy, noecho)
+{
+  test_ovboxclient_t proxy;
+  proxy.set_proxy_multicast("239.255.79.88", true);
+  proxy.add_proxy_client(1, "127.0.0.2");
+  proxy.add_proxy_client(2, "127.0.0.3");
+  port_t port(0);
+  std::unique_ptr<udpsocket_t> rec1(proxy_client_receiver("127.0.0.2", port));
+  std::unique_ptr<udpsocket_t> rec2(proxy_client_receiver("127.0.0.3", port));
+  if((!rec1) || (!rec2))
+    GTEST_SKIP() << "loopback addresses are not available";
+  // a message of client 1, relayed by the server, reaches only
+  // client 2, even if the proxy uses a multicast group:
+  msgbuf_t msg;
+  msg.pack(1234, 1, port, 1, "hello", 5);
+  proxy.forward_to_proxy_clients(msg);
+  char buf[BUFSIZE];
+  endpoint_t sender;
+  EXPECT_EQ(5, rec2->recvfrom(buf, BUFSIZE, sender));
+  EXPECT_EQ(0, memcmp("hello", buf, 5));
+  EXPECT_EQ(-1, rec1->recvfrom(buf, BUFSIZE, sender));
+}
+
 // Local Variables:
 // compile-command: "make -C .. unit-tests"
 // coding: utf-8-unix
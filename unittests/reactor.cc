@@ -0,0 +1,55 @@
+#include <gtest/gtest.h>
+
+#include "reactor.h"
+#include "udpsocket.h"
+#include <atomic>
+#include <thread>
+
+#ifdef HAS_REACTOR
+TEST(reactor, socketandtimer)
+{
+  for(bool multithreaded : {false, true}) {
+    reactor_t reactor(multithreaded);
+    udpsocket_t rec;
+    endpoint_t ep(ovgethostbyname("127.0.0.1"));
+    ep.sin_port = htons(rec.bind(0, true));
+    std::atomic_uint32_t received(0);
+    std::atomic_uint32_t ticks(0);
+    reactor.add(rec.getsockfd(), [&]() {
+      char buf[BUFSIZE];
+      endpoint_t sender;
+      if(rec.recvfrom(buf, BUFSIZE, sender) > 0)
+        ++received;
+    });
+    int timer(reactor.add_timer([&]() { ++ticks; }));
+    bool running(true);
+    std::vector<std::thread> threads;
+    for(size_t k = 0; k < 1u + multithreaded; ++k)
+      threads.emplace_back([&]() { reactor.run(running); });
+    udpsocket_t snd;
+    for(size_t k = 0; k < 10; ++k)
+      snd.send("msg", 3, ep);
+    // one-shot timer:
+    reactor_t::set_timer(timer, 1000, false);
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    EXPECT_EQ(1u, ticks);
+    // periodic timer:
+    reactor_t::set_timer(timer, 10000, true);
+    std::this_thread::sleep_for(std::chrono::milliseconds(55));
+    reactor_t::set_timer(timer, 0, false);
+    running = false;
+    for(auto& th : threads)
+      th.join();
+    EXPECT_EQ(10u, received);
+    EXPECT_LE(4u, ticks);
+    EXPECT_GE(7u, ticks);
+  }
+}
+#endif
+
+// Local Variables:
+// compile-command: "make -C .. unit-tests"
+// coding: utf-8-unix
+// c-basic-offset: 2
+// indent-tabs-mode: nil
+// End:
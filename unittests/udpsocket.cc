@@ -1,6 +1,8 @@
 #include <gtest/gtest.h>
 
 #include "udpsocket.h"
+#include "uring.h"
+#include <memory>
 
 //TEST(msgbuf, age)
 //{
@@ -44,6 +46,57 @@ TEST(msgbuf, copy)
   EXPECT_EQ(msg.size,msg2.size);
 }
 
+TEST(msgbuf, copysize)
+{
+  msgbuf_t msg;
+  msg.pack(1234567, 13, 1234, 1, "abc", 3);
+  msg.sender.sin_port = htons(4711);
+  msgbuf_t msg2;
+  memset(msg2.rawbuffer, 'x', BUFSIZE);
+  msg2.copy(msg);
+  EXPECT_EQ(3u, msg2.size);
+  EXPECT_EQ(0, memcmp("abc", msg2.msg, 3));
+  EXPECT_EQ(htons(4711), msg2.sender.sin_port);
+  // only header and payload are copied:
+  EXPECT_EQ('x', msg2.msg[3]);
+}
+
+TEST(msgbuf, take)
+{
+  msgbuf_t msg;
+  msg.pack(1234567, 13, 1234, 7, "abc", 3);
+  const char* raw(msg.rawbuffer);
+  msgbuf_t msg2;
+  const char* raw2(msg2.rawbuffer);
+  msg2.take(msg);
+  EXPECT_EQ(true, msg2.valid);
+  EXPECT_EQ(false, msg.valid);
+  EXPECT_EQ(13, msg2.cid);
+  EXPECT_EQ(1234, msg2.destport);
+  EXPECT_EQ(7, msg2.seq);
+  EXPECT_EQ(3u, msg2.size);
+  // the buffers are exchanged, not copied:
+  EXPECT_EQ(raw, msg2.rawbuffer);
+  EXPECT_EQ(raw2, msg.rawbuffer);
+  EXPECT_EQ(0, memcmp("abc", msg2.msg, 3));
+}
+
+TEST(msgbuf, pool)
+{
+  msgbuf_pool_t& pool(msgbuf_pool_t::get());
+  size_t available(pool.available());
+  size_t capacity(pool.capacity());
+  {
+    std::unique_ptr<msgbuf_t[]> msg(new msgbuf_t[available + 1]);
+    // the pool grows by one chunk when it is empty:
+    EXPECT_EQ(capacity + MSGBUF_POOL_CHUNK, pool.capacity());
+    EXPECT_EQ(MSGBUF_POOL_CHUNK - 1u, pool.available());
+    msg[0].take(msg[1]);
+  }
+  // all buffers are returned to the pool:
+  EXPECT_EQ(available + pool.capacity() - capacity, pool.available());
+}
+
 TEST(ovboxsocket, packmsg)
 {
   ovbox_udpsocket_t socket(12345678, 13);
@@ -72,6 +125,371 @@ TEST(ovboxsocket, packmsg)
   EXPECT_EQ(13, msg_callerid(buf));
   EXPECT_EQ(9876, msg_port(buf));
   EXPECT_EQ(3, msg_seq(buf));
+  // pack the header of a message which is already in place:
+  memcpy(buf + HEADERLEN, "abc", 3);
+  len = socket.packheader(buf, BUFSIZE, 9876, 3);
+  EXPECT_EQ(HEADERLEN + 3, len);
+  EXPECT_EQ(13, msg_callerid(buf));
+  EXPECT_EQ(9876, msg_port(buf));
+  EXPECT_EQ(4, msg_seq(buf));
+  EXPECT_EQ(0, memcmp(buf + HEADERLEN, "abc", 3));
+  EXPECT_EQ(0u, socket.packheader(buf, HEADERLEN + 2, 9876, 3));
+}
+
+TEST(ovboxsocket, pingcaps)
+{
+  ovbox_udpsocket_t rec(1234, 3);
+  rec.set_timeout_usec(100000);
+  endpoint_t ep(ovgethostbyname("127.0.0.1"));
+  ep.sin_port = htons(rec.bind(0, true));
+  ovbox_udpsocket_t snd(1234, 4);
+  snd.set_caps(CAP_NETAUDIO_TX);
+  snd.send_ping(ep, 3, PORT_PING_SRV);
+  snd.send_ping(ep);
+  msgbuf_t msg;
+  ASSERT_TRUE(rec.recv_sec_msg(msg));
+  EXPECT_EQ(PORT_PING_SRV, msg.destport);
+  EXPECT_EQ(CAP_NETAUDIO_TX, ovbox_udpsocket_t::get_ping_caps(
+                                 msg.msg, msg.size, msg.destport));
+  ASSERT_TRUE(rec.recv_sec_msg(msg));
+  EXPECT_EQ(PORT_PING, msg.destport);
+  EXPECT_EQ(CAP_NETAUDIO_TX, ovbox_udpsocket_t::get_ping_caps(
+                                 msg.msg, msg.size, msg.destport));
+  // pings of older devices have no features:
+  EXPECT_EQ(0u, ovbox_udpsocket_t::get_ping_caps(msg.msg, msg.size - 2,
+                                                 msg.destport));
+}
+
+TEST(ovboxsocket, recvbatch)
+{
+  ovbox_udpsocket_t rec(12345678, 13);
+  port_t port(rec.bind(0, true));
+  rec.set_timeout_usec(100000);
+  ovbox_udpsocket_t snd(12345678, 14);
+  snd.set_destination("127.0.0.1");
+  ovbox_udpsocket_t snd_wrongsecret(87654321, 15);
+  snd_wrongsecret.set_destination("127.0.0.1");
+  EXPECT_EQ(true, snd.pack_and_send(9876, "abc", 3, port));
+  EXPECT_EQ(true, snd_wrongsecret.pack_and_send(9876, "def", 3, port));
+  EXPECT_EQ(true, snd.pack_and_send(9876, "ghij", 4, port));
+  msgbuf_t msgs[4];
+  size_t n(0);
+  while(n < 3) {
+    size_t rx(rec.recv_sec_msg(&(msgs[n]), 4 - n));
+    ASSERT_LT(0u, rx);
+    n += rx;
+  }
+  EXPECT_EQ(3u, n);
+  EXPECT_EQ(true, msgs[0].valid);
+  EXPECT_EQ(14, msgs[0].cid);
+  EXPECT_EQ(9876, msgs[0].destport);
+  EXPECT_EQ(1, msgs[0].seq);
+  EXPECT_EQ(3u, msgs[0].size);
+  EXPECT_EQ(0, memcmp("abc", msgs[0].msg, 3));
+  EXPECT_EQ(false, msgs[1].valid);
+  EXPECT_EQ(true, msgs[2].valid);
+  EXPECT_EQ(2, msgs[2].seq);
+  EXPECT_EQ(4u, msgs[2].size);
+  EXPECT_EQ(0, memcmp("ghij", msgs[2].msg, 4));
+  // nothing left, expect timeout:
+  EXPECT_EQ(0u, rec.recv_sec_msg(msgs, 4));
+}
+
+TEST(udpsocket, sendmmsg)
+{
+  udpsocket_t rec1;
+  udpsocket_t rec2;
+  rec1.set_timeout_usec(100000);
+  rec2.set_timeout_usec(100000);
+  fanout_dest_t dest[3];
+  dest[0].ep = ovgethostbyname("127.0.0.1");
+  dest[0].ep.sin_port = htons(rec1.bind(0, true));
+  dest[1].ep = ovgethostbyname("127.0.0.1");
+  dest[1].ep.sin_port = htons(rec2.bind(0, true));
+  // third destination receives a payload override:
+  dest[2].ep = dest[1].ep;
+  dest[2].buf = "override";
+  dest[2].len = 8;
+  udpsocket_t snd;
+  EXPECT_EQ(3u, snd.sendmmsg("common", 6, dest, 3));
+  EXPECT_EQ(20u, snd.tx_bytes);
+  char buf[BUFSIZE];
+  endpoint_t sender;
+  EXPECT_EQ(6, rec1.recvfrom(buf, BUFSIZE, sender));
+  EXPECT_EQ(0, memcmp("common", buf, 6));
+  EXPECT_EQ(6, rec2.recvfrom(buf, BUFSIZE, sender));
+  EXPECT_EQ(0, memcmp("common", buf, 6));
+  EXPECT_EQ(8, rec2.recvfrom(buf, BUFSIZE, sender));
+  EXPECT_EQ(0, memcmp("override", buf, 8));
+}
+
+TEST(udpsocket, queue)
+{
+  udpsocket_t rec;
+  rec.set_timeout_usec(100000);
+  port_t port(rec.bind(0, true));
+  udpsocket_t snd;
+  snd.set_destination("127.0.0.1");
+  snd.queue("abc", 3, port);
+  char tmp[] = "defg";
+  snd.queue(tmp, 4, port);
+  // the message is copied into the queue:
+  tmp[0] = 'x';
+  // port zero is ignored, like in send():
+  snd.queue("hij", 3, 0);
+  EXPECT_EQ(0u, snd.tx_bytes);
+  EXPECT_EQ(2u, snd.flush());
+  EXPECT_EQ(1u, snd.syscalls);
+  EXPECT_EQ(7u, snd.tx_bytes);
+  EXPECT_EQ(0u, snd.flush());
+  char buf[BUFSIZE];
+  endpoint_t sender;
+  EXPECT_EQ(3, rec.recvfrom(buf, BUFSIZE, sender));
+  EXPECT_EQ(0, memcmp("abc", buf, 3));
+  EXPECT_EQ(4, rec.recvfrom(buf, BUFSIZE, sender));
+  EXPECT_EQ(0, memcmp("defg", buf, 4));
+  EXPECT_EQ(snd.getsockep().sin_port, sender.sin_port);
+}
+
+TEST(udpsocket, multicast)
+{
+  // stand-in for a proxy and its clients on one host: each client
+  // joins the group, and its receiver is bound to all interfaces on
+  // the port of the stream:
+  const size_t nclients(4);
+  udpsocket_t member[nclients];
+  udpsocket_t rec[nclients];
+  port_t port(0);
+  for(size_t k = 0; k < nclients; ++k) {
+    try {
+      member[k].join_multicast("239.255.79.87");
+    }
+    catch(const std::exception& e) {
+      GTEST_SKIP() << e.what();
+    }
+    rec[k].set_timeout_usec(100000);
+    port = rec[k].bind(port, false);
+  }
+  udpsocket_t snd;
+  // the clients are on the same host as the sender:
+  snd.set_multicast_loop(true);
+  endpoint_t ep(ovgethostbyname("239.255.79.87"));
+  ep.sin_port = htons(port);
+  // the proxy sends each message only once:
+  EXPECT_EQ(5, snd.send("hello", 5, ep));
+  EXPECT_EQ(1u, snd.syscalls);
+  char buf[BUFSIZE];
+  endpoint_t sender;
+  for(size_t k = 0; k < nclients; ++k) {
+    EXPECT_EQ(5, rec[k].recvfrom(buf, BUFSIZE, sender));
+    EXPECT_EQ(0, memcmp("hello", buf, 5));
+    EXPECT_EQ(snd.getsockep().sin_port, sender.sin_port);
+  }
+  // every member receives a group datagram, including the client
+  // whose stream it is, so the streams of proxy clients are not sent
+  // to the group, see test proxy.noecho
+  // without loop the clients on the same host receive nothing:
+  snd.set_multicast_loop(false);
+  snd.send("hello", 5, ep);
+  for(size_t k = 0; k < nclients; ++k)
+    EXPECT_EQ(-1, rec[k].recvfrom(buf, BUFSIZE, sender));
+}
+
+TEST(udpsocket, uring)
+{
+  udpsocket_t rec(true);
+  if(!rec.has_uring())
+    GTEST_SKIP() << "io_uring is not available";
+  rec.set_timeout_usec(100000);
+  port_t port(rec.bind(0, true));
+  udpsocket_t snd(true);
+  ASSERT_TRUE(snd.has_uring());
+  fanout_dest_t dest[2];
+  dest[0].ep = ovgethostbyname("127.0.0.1");
+  dest[0].ep.sin_port = htons(port);
+  dest[1].ep = dest[0].ep;
+  dest[1].buf = "override";
+  dest[1].len = 8;
+  size_t syscalls(snd.syscalls);
+  EXPECT_EQ(2u, snd.sendmmsg("common", 6, dest, 2));
+  EXPECT_EQ(syscalls + 1u, snd.syscalls);
+  EXPECT_EQ(14u, snd.tx_bytes);
+  EXPECT_TRUE(rec.wait_readable(100000));
+  char buf[BUFSIZE];
+  endpoint_t sender;
+  EXPECT_EQ(6, rec.recvfrom(buf, BUFSIZE, sender));
+  EXPECT_EQ(0, memcmp("common", buf, 6));
+  EXPECT_EQ(snd.getsockep().sin_port, sender.sin_port);
+  EXPECT_EQ(htonl(INADDR_LOOPBACK), sender.sin_addr.s_addr);
+  EXPECT_EQ(8, rec.recvfrom(buf, BUFSIZE, sender));
+  EXPECT_EQ(0, memcmp("override", buf, 8));
+  EXPECT_EQ(14u, rec.rx_bytes);
+  // messages longer than the buffer are truncated:
+  snd.send("0123456789", 10, dest[0].ep);
+  EXPECT_EQ(4, rec.recvfrom(buf, 4, sender));
+  EXPECT_EQ(0, memcmp("0123", buf, 4));
+  // nothing left, expect timeout:
+  EXPECT_FALSE(rec.wait_readable(1000));
+  EXPECT_EQ(-1, rec.recvfrom(buf, BUFSIZE, sender));
+}
+
+#ifdef HAS_URING
+TEST(ovboxsocket, uringrecvbatch)
+{
+  ovbox_udpsocket_t rec(12345678, 13, true);
+  if(!rec.has_uring())
+    GTEST_SKIP() << "io_uring is not available";
+  port_t port(rec.bind(0, true));
+  rec.set_timeout_usec(100000);
+  ovbox_udpsocket_t snd(12345678, 14);
+  snd.set_destination("127.0.0.1");
+  // more messages than receive buffers, to test re-arming of the
+  // receive request:
+  const size_t nsend(URING_RXBUFS + 2 * RECV_BATCHSIZE);
+  for(size_t k = 0; k < nsend; ++k)
+    EXPECT_EQ(true, snd.pack_and_send(9876, "abc", 3, port));
+  msgbuf_t msgs[RECV_BATCHSIZE];
+  size_t n(0);
+  sequence_t seq(0);
+  while(n < nsend) {
+    size_t rx(rec.recv_sec_msg(msgs, RECV_BATCHSIZE));
+    ASSERT_LT(0u, rx);
+    for(size_t k = 0; k < rx; ++k) {
+      EXPECT_EQ(true, msgs[k].valid);
+      EXPECT_EQ(14, msgs[k].cid);
+      EXPECT_EQ(++seq, msgs[k].seq);
+      EXPECT_EQ(3u, msgs[k].size);
+    }
+    n += rx;
+  }
+  EXPECT_EQ(nsend, n);
+  EXPECT_EQ(0u, rec.recv_sec_msg(msgs, RECV_BATCHSIZE));
+}
+#endif
+
+TEST(udpsocket, benchmark)
+{
+  // forwarding of one batch of messages per period to a local
+  // receiver: one send() and recvfrom() per message, or one
+  // submission of the send queue and one batched receive call with
+  // sendmmsg()/recvmmsg() or with io_uring
+  const size_t nperiods(2000);
+  const size_t nmsg(RECV_BATCHSIZE);
+  const char* msg("0123456789012345678901234567890123456789");
+  const char* name[3] = {"send/recvfrom", "sendmmsg/recvmmsg", "io_uring"};
+  for(int variant = 0; variant < 3; ++variant) {
+    udpsocket_t rec(variant == 2);
+    udpsocket_t snd(variant == 2);
+    if((variant == 2) && !snd.has_uring())
+      break;
+    rec.set_timeout_usec(100000);
+    port_t port(rec.bind(0, true));
+    snd.set_destination("127.0.0.1");
+    size_t tx_calls(snd.syscalls);
+    size_t rx_calls(rec.syscalls);
+    size_t nrec(0);
+    char recbuf[RECV_BATCHSIZE][64];
+    char* bufs[RECV_BATCHSIZE];
+    for(size_t k = 0; k < RECV_BATCHSIZE; ++k)
+      bufs[k] = recbuf[k];
+    size_t rxlens[RECV_BATCHSIZE];
+    endpoint_t addrs[RECV_BATCHSIZE];
+    auto t0 = std::chrono::high_resolution_clock::now();
+    for(size_t period = 0; period < nperiods; ++period) {
+      for(size_t k = 0; k < nmsg; ++k) {
+        if(variant == 0)
+          snd.send(msg, 40, port);
+        else
+          snd.queue(msg, 40, port);
+      }
+      snd.flush();
+      size_t n(0);
+      while(n < nmsg) {
+        size_t rx(0);
+        if(variant == 0)
+          rx = (rec.recvfrom(bufs[0], 64, addrs[0]) > 0);
+        else
+          rx = rec.recvmmsg(bufs, 64, rxlens, addrs, nmsg - n);
+        ASSERT_LT(0u, rx);
+        n += rx;
+      }
+      nrec += n;
+    }
+    double t(std::chrono::duration<double>(
+                 std::chrono::high_resolution_clock::now() - t0)
+                 .count());
+    EXPECT_EQ(nmsg * nperiods, nrec);
+    double txc((double)(snd.syscalls - tx_calls) / (double)nperiods);
+    double rxc((double)(rec.syscalls - rx_calls) / (double)nperiods);
+    if(variant == 0)
+      EXPECT_EQ((double)nmsg, txc);
+    else
+      EXPECT_EQ(1.0, txc);
+    printf("udpsocket %s: %g+%g system calls per period, %g us per period\n",
+           name[variant], txc, rxc, 1e6 * t / (double)nperiods);
+  }
+}
+
+TEST(ovboxsocket, packbenchmark)
+{
+  // forwarding of local messages of typical audio size: receive into
+  // a separate buffer and copy the message behind the header with
+  // packmsg(), or receive behind the header and pack only the header
+  // with packheader()
+  const size_t nperiods(2000);
+  const size_t nmsg(RECV_BATCHSIZE);
+  const size_t msglen(1000);
+  std::vector<char> msg(msglen);
+  for(size_t k = 0; k < msglen; ++k)
+    msg[k] = (char)k;
+  const char* name[2] = {"packmsg", "packheader"};
+  char packed[2][BUFSIZE];
+  size_t packedlen[2] = {0, 0};
+  for(int variant = 0; variant < 2; ++variant) {
+    ovbox_udpsocket_t socket(12345678, 13);
+    udpsocket_t rec;
+    udpsocket_t snd;
+    rec.set_timeout_usec(100000);
+    port_t port(rec.bind(0, true));
+    snd.set_destination("127.0.0.1");
+    char recbuf[BUFSIZE];
+    char sendbuf[BUFSIZE];
+    endpoint_t addr;
+    size_t copied(0);
+    auto t0 = std::chrono::high_resolution_clock::now();
+    for(size_t period = 0; period < nperiods; ++period) {
+      for(size_t k = 0; k < nmsg; ++k)
+        snd.queue(msg.data(), msglen, port);
+      snd.flush();
+      for(size_t k = 0; k < nmsg; ++k) {
+        ssize_t n(0);
+        if(variant == 0) {
+          n = rec.recvfrom(recbuf, BUFSIZE, addr);
+          ASSERT_EQ((ssize_t)msglen, n);
+          packedlen[variant] =
+              socket.packmsg(sendbuf, BUFSIZE, 4464, recbuf, (size_t)n);
+          copied += (size_t)n;
+        } else {
+          n = rec.recvfrom(sendbuf + HEADERLEN, BUFSIZE - HEADERLEN, addr);
+          ASSERT_EQ((ssize_t)msglen, n);
+          packedlen[variant] =
+              socket.packheader(sendbuf, BUFSIZE, 4464, (size_t)n);
+        }
+      }
+    }
+    double t(std::chrono::duration<double>(
+                 std::chrono::high_resolution_clock::now() - t0)
+                 .count());
+    memcpy(packed[variant], sendbuf, packedlen[variant]);
+    printf("ovboxsocket %s: %g payload bytes copied per message, %g us per "
+           "period\n",
+           name[variant], (double)copied / (double)(nmsg * nperiods),
+           1e6 * t / (double)nperiods);
+  }
+  // both variants produce the same messages:
+  ASSERT_EQ(HEADERLEN + msglen, packedlen[0]);
+  ASSERT_EQ(packedlen[0], packedlen[1]);
+  EXPECT_EQ(0, memcmp(packed[0], packed[1], packedlen[0]));
 }
 
 // Local Variables:
@@ -0,0 +1,98 @@
+#include <gtest/gtest.h>
+
+#include "common.h"
+#include "workerpool.h"
+#include <algorithm>
+#include <chrono>
+#include <sodium.h>
+#include <stdio.h>
+
+TEST(workerpool, alljobs)
+{
+  for(size_t nthreads : {0u, 1u, 3u}) {
+    worker_pool_t pool(nthreads, 0);
+    EXPECT_EQ(nthreads, pool.size());
+    for(size_t njobs : {0u, 1u, 2u, 7u, 31u}) {
+      std::vector<std::atomic_size_t> cnt(njobs);
+      for(auto& c : cnt)
+        c = 0;
+      pool.run(njobs, [&cnt](size_t k) { ++cnt[k]; });
+      for(auto& c : cnt)
+        EXPECT_EQ(1u, c);
+    }
+  }
+}
+
+TEST(workerpool, repeatedruns)
+{
+  // run() returns before late workers have woken up, the next call
+  // must not hand them a stale job:
+  worker_pool_t pool(3, 0);
+  for(size_t rep = 0; rep < 2000; ++rep) {
+    size_t njobs(2u + rep % 5u);
+    std::vector<std::atomic_size_t> cnt(njobs);
+    for(auto& c : cnt)
+      c = 0;
+    pool.run(njobs, [&cnt](size_t k) { ++cnt[k]; });
+    for(auto& c : cnt)
+      ASSERT_EQ(1u, c);
+  }
+}
+
+// Benchmark: skew between first and last encrypted copy of a packet
+// when encrypting with sealed boxes for N peers, serial vs. parallel
+TEST(workerpool, encryptionskew)
+{
+  uint8_t pk[crypto_box_PUBLICKEYBYTES];
+  uint8_t sk[crypto_box_SECRETKEYBYTES];
+  crypto_box_keypair(pk, sk);
+  char msg[BUFSIZE];
+  char payload[400];
+  memset(payload, 0, sizeof(payload));
+  size_t len(packmsg(msg, BUFSIZE, 1234, 1, 4464, 1, payload, 400));
+  // fixed number of workers, to get comparable results across hosts:
+  const size_t nthreads(3);
+  worker_pool_t pool(nthreads, 0);
+  const size_t repetitions(20);
+  for(size_t npeers : {8u, 16u, 31u}) {
+    std::vector<char> cmsg(npeers * (BUFSIZE + crypto_box_SEALBYTES));
+    std::vector<double> t_done(npeers);
+    double skew_serial(0.0);
+    double skew_parallel(0.0);
+    for(size_t rep = 0; rep < repetitions; ++rep) {
+      for(auto parallel : {false, true}) {
+        auto t0 = std::chrono::high_resolution_clock::now();
+        auto job = [&](size_t k) {
+          EXPECT_EQ(len + crypto_box_SEALBYTES,
+                    encryptmsg(&(cmsg[k * (BUFSIZE + crypto_box_SEALBYTES)]),
+                               BUFSIZE + crypto_box_SEALBYTES, msg, len, pk));
+          t_done[k] = std::chrono::duration<double>(
+                          std::chrono::high_resolution_clock::now() - t0)
+                          .count();
+        };
+        if(parallel)
+          pool.run(npeers, job);
+        else
+          for(size_t k = 0; k < npeers; ++k)
+            job(k);
+        double skew(*std::max_element(t_done.begin(), t_done.end()) -
+                    *std::min_element(t_done.begin(), t_done.end()));
+        if(parallel)
+          skew_parallel += skew;
+        else
+          skew_serial += skew;
+      }
+    }
+    printf("%zu peers, %zu workers: first-to-last skew serial %1.3f ms, "
+           "parallel %1.3f ms\n",
+           npeers, nthreads, 1000.0 * skew_serial / (double)repetitions,
+           1000.0 * skew_parallel / (double)repetitions);
+  }
+}
+
+// Local Variables:
+// compile-command: "make -C .. unit-tests"
+// coding: utf-8-unix
+// c-basic-offset: 2
+// indent-tabs-mode: nil
+// End: